@@ -0,0 +1,559 @@
+#include "afpacket.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <linux/virtio_net.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#ifndef PACKET_IGNORE_OUTGOING
+#define PACKET_IGNORE_OUTGOING 23
+#endif
+
+void afpacket_config_default(struct afpacket_config_t* config) {
+  config->block_size = 1 << 20;
+  config->frame_size = 2048;
+  config->frame_count = 4096;
+  config->retire_timeout = 1;
+  config->tx_frame_size = 2048;
+  config->tx_frame_count = 1024;
+  config->qdisc_bypass = false;
+  config->vnet_hdr = false;
+  config->fanout = 1;
+  config->fanout_mode = PACKET_FANOUT_HASH;
+  config->fanout_group = 0;
+}
+
+int afpacket_parse_fanout_mode(struct afpacket_config_t* config,
+                               const char* name) {
+  if (!strcmp(name, "hash")) {
+    config->fanout_mode = PACKET_FANOUT_HASH;
+  } else if (!strcmp(name, "cpu")) {
+    config->fanout_mode = PACKET_FANOUT_CPU;
+  } else if (!strcmp(name, "rollover")) {
+    config->fanout_mode = PACKET_FANOUT_ROLLOVER;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+void afpacket_init(struct afpacket_t* packet) {
+  packet->fd = -1;
+  packet->ifindex = 0;
+  packet->map = NULL;
+  packet->map_size = 0;
+  packet->block_size = 0;
+  packet->block_count = 0;
+  packet->block_index = 0;
+  packet->frame = NULL;
+  packet->frame_left = 0;
+  packet->vnet_hdr = false;
+  packet->stat_packets = 0;
+  packet->stat_drops = 0;
+  packet->skipped = 0;
+  packet->capture = NULL;
+}
+
+void afpacket_close(struct afpacket_t* packet) {
+  if (packet->map) {
+    munmap(packet->map, packet->map_size);
+  }
+  if (packet->fd != -1) {
+    close(packet->fd);
+  }
+  afpacket_init(packet);
+}
+
+static int afpacket_attach_filter(struct afpacket_t* packet,
+                                  const struct sock_fprog* prog) {
+  if (!prog) {
+    return 0;
+  }
+  if (setsockopt(packet->fd, SOL_SOCKET, SO_ATTACH_FILTER, prog,
+                 sizeof(*prog)) == -1) {
+    fprintf(stderr, "ERROR> %s setsockopt SO_ATTACH_FILTER\n", __FUNCTION__);
+    return -1;
+  }
+  return 0;
+}
+
+// Перед кадром идет virtio_net_hdr: ядро отдает кадры после GRO целиком и
+// режет на сегменты отправленные GSO кадры. Включается до создания кольца.
+static int afpacket_setup_vnet(int fd, const struct afpacket_config_t* config) {
+  if (!config->vnet_hdr) {
+    return 0;
+  }
+
+  int one = 1;
+  if (setsockopt(fd, SOL_PACKET, PACKET_VNET_HDR, &one, sizeof(one)) == -1) {
+    fprintf(stderr, "ERROR> %s setsockopt PACKET_VNET_HDR\n", __FUNCTION__);
+    perror("setsockopt:");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int afpacket_setup_rx(struct afpacket_t* packet,
+                             const struct afpacket_config_t* config) {
+  long page_size = sysconf(_SC_PAGESIZE);
+  if ((config->block_size == 0) || (config->block_size % page_size) ||
+      (config->frame_size < TPACKET3_HDRLEN) ||
+      (config->frame_size % TPACKET_ALIGNMENT) ||
+      (config->block_size % config->frame_size)) {
+    fprintf(stderr,
+            "ERROR> %s incorrect ring geometry block %u frame %u count %u\n",
+            __FUNCTION__, config->block_size, config->frame_size,
+            config->frame_count);
+    return -1;
+  }
+
+  unsigned int frames_per_block = config->block_size / config->frame_size;
+  unsigned int block_count =
+      (config->frame_count + frames_per_block - 1) / frames_per_block;
+  if (block_count == 0) {
+    block_count = 1;
+  }
+
+  int version = TPACKET_V3;
+  if (setsockopt(packet->fd, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) == -1) {
+    fprintf(stderr, "ERROR> %s setsockopt PACKET_VERSION\n", __FUNCTION__);
+    return -1;
+  }
+
+  struct tpacket_req3 req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = config->block_size;
+  req.tp_block_nr = block_count;
+  req.tp_frame_size = config->frame_size;
+  req.tp_frame_nr = frames_per_block * block_count;
+  req.tp_retire_blk_tov = config->retire_timeout;
+  req.tp_feature_req_word = TP_FT_REQ_FILL_RXHASH;
+  if (setsockopt(packet->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) ==
+      -1) {
+    fprintf(stderr, "ERROR> %s setsockopt PACKET_RX_RING\n", __FUNCTION__);
+    perror("setsockopt:");
+    return -1;
+  }
+
+  packet->block_size = config->block_size;
+  packet->block_count = block_count;
+  packet->map_size = (size_t)config->block_size * block_count;
+  packet->map = mmap(NULL, packet->map_size, PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, packet->fd, 0);
+  if (packet->map == MAP_FAILED) {
+    packet->map = NULL;
+    fprintf(stderr, "ERROR> %s mmap\n", __FUNCTION__);
+    perror("mmap:");
+    return -1;
+  }
+
+  return 0;
+}
+
+// В режиме hash кадры одного потока попадают в один сокет, фрагменты IP
+// сначала собираются (FLAG_DEFRAG), чтобы хеш у них был общий. Сокет
+// вступает в группу только после bind.
+static int afpacket_join_fanout(struct afpacket_t* packet,
+                                const struct afpacket_config_t* config) {
+  unsigned int mode = config->fanout_mode;
+  if (mode == PACKET_FANOUT_HASH) {
+    mode |= PACKET_FANOUT_FLAG_DEFRAG;
+  }
+  int arg = (config->fanout_group & 0xffff) | (mode << 16);
+  if (setsockopt(packet->fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) ==
+      -1) {
+    fprintf(stderr, "ERROR> %s PACKET_FANOUT group %u\n", __FUNCTION__,
+            config->fanout_group);
+    perror("setsockopt:");
+    return -1;
+  }
+  return 0;
+}
+
+// Фильтр ставится до bind: кадры, не прошедшие его, в кольцо не попадают
+// ни разу.
+int afpacket_open(struct afpacket_t* packet,
+                  const char* ifname,
+                  const struct afpacket_config_t* config,
+                  const struct sock_fprog* filter) {
+  if (packet->fd != -1) {
+    return 0;
+  }
+
+  packet->ifindex = if_nametoindex(ifname);
+  if (packet->ifindex == 0) {
+    fprintf(stderr, "ERROR> %s if_nametoindex(%s)\n", __FUNCTION__, ifname);
+    return -1;
+  }
+
+  // Сокет создается без протокола и начинает принимать пакеты только после
+  // bind, когда кольцо уже отображено.
+  packet->fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (packet->fd == -1) {
+    fprintf(stderr, "ERROR> %s socket(%s)\n", __FUNCTION__, ifname);
+    perror("socket:");
+    return -1;
+  }
+
+  if ((afpacket_attach_filter(packet, filter) == -1) ||
+      (afpacket_setup_vnet(packet->fd, config) == -1) ||
+      (afpacket_setup_rx(packet, config) == -1)) {
+    goto aborting;
+  }
+  packet->vnet_hdr = config->vnet_hdr;
+
+  int one = 1;
+  setsockopt(packet->fd, SOL_PACKET, PACKET_IGNORE_OUTGOING, &one,
+             sizeof(one));
+
+  struct packet_mreq mreq;
+  memset(&mreq, 0, sizeof(mreq));
+  mreq.mr_ifindex = packet->ifindex;
+  mreq.mr_type = PACKET_MR_PROMISC;
+  if (setsockopt(packet->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq,
+                 sizeof(mreq)) == -1) {
+    fprintf(stderr, "ERROR> %s PACKET_MR_PROMISC(%s)\n", __FUNCTION__, ifname);
+    goto aborting;
+  }
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(ETH_P_ALL);
+  addr.sll_ifindex = packet->ifindex;
+  if (bind(packet->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "ERROR> %s bind(%s)\n", __FUNCTION__, ifname);
+    perror("bind:");
+    goto aborting;
+  }
+
+  if ((config->fanout > 1) && (afpacket_join_fanout(packet, config) == -1)) {
+    goto aborting;
+  }
+
+  return 0;
+
+aborting:
+  afpacket_close(packet);
+  return -1;
+}
+
+// PACKET_STATISTICS обнуляет счетчики ядра при чтении, поэтому они
+// накапливаются здесь. Вызывается только из потока статистики.
+int afpacket_stats(struct afpacket_t* packet,
+                   uint64_t* packets,
+                   uint64_t* drops) {
+  struct tpacket_stats_v3 stats;
+  socklen_t len = sizeof(stats);
+  if ((packet->fd == -1) ||
+      (getsockopt(packet->fd, SOL_PACKET, PACKET_STATISTICS, &stats, &len) ==
+       -1)) {
+    return -1;
+  }
+
+  packet->stat_packets += stats.tp_packets;
+  packet->stat_drops += stats.tp_drops;
+  *packets = packet->stat_packets;
+  *drops = packet->stat_drops;
+  return 0;
+}
+
+static struct tpacket_block_desc* afpacket_block(struct afpacket_t* packet,
+                                                 unsigned int index) {
+  return (struct tpacket_block_desc*)(packet->map +
+                                      (size_t)index * packet->block_size);
+}
+
+int afpacket_dispatch(struct afpacket_t* packet,
+                      int count,
+                      int timeout,
+                      afpacket_handler_t handler,
+                      void* user) {
+  if (!packet->map || !handler) {
+    return -1;
+  }
+
+  // scanned ограничивает работу за вызов, processed - только кадры,
+  // отданные обработчику.
+  int scanned = 0;
+  int processed = 0;
+  while (scanned < count) {
+    struct tpacket_block_desc* block =
+        afpacket_block(packet, packet->block_index);
+    uint32_t status =
+        __atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+    if (!(status & TP_STATUS_USER)) {
+      if (scanned) {
+        break;
+      }
+
+      struct pollfd pfd = {packet->fd, POLLIN | POLLERR, 0};
+      int res = poll(&pfd, 1, timeout);
+      if (res == -1) {
+        return errno == EINTR ? 0 : -1;
+      }
+      if (res == 0) {
+        return 0;
+      }
+      status = __atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE);
+      if (!(status & TP_STATUS_USER)) {
+        return 0;
+      }
+    }
+
+    if (!packet->frame) {
+      packet->frame = (uint8_t*)block + block->hdr.bh1.offset_to_first_pkt;
+      packet->frame_left = block->hdr.bh1.num_pkts;
+    }
+
+    while (packet->frame_left && (scanned < count)) {
+      struct tpacket3_hdr* hdr = (struct tpacket3_hdr*)packet->frame;
+      const struct sockaddr_ll* sll =
+          (const struct sockaddr_ll*)(packet->frame +
+                                      TPACKET_ALIGN(sizeof(*hdr)));
+      size_t vnet = packet->vnet_hdr ? sizeof(struct virtio_net_hdr) : 0;
+      if (hdr->tp_snaplen < hdr->tp_len) {
+        fprintf(stderr, "ERROR> %s frame %u bytes truncated to %u\n",
+                __FUNCTION__, hdr->tp_len, hdr->tp_snaplen);
+        __atomic_store_n(&packet->skipped, packet->skipped + 1,
+                         __ATOMIC_RELAXED);
+      } else if (sll->sll_pkttype == PACKET_OUTGOING) {
+        __atomic_store_n(&packet->skipped, packet->skipped + 1,
+                         __ATOMIC_RELAXED);
+      } else {
+        if (packet->capture) {
+          latency_record_wall(packet->capture, hdr->tp_sec, hdr->tp_nsec);
+        }
+        handler(user, packet->frame + hdr->tp_mac - vnet,
+                hdr->tp_snaplen + vnet);
+        processed++;
+      }
+      scanned++;
+
+      packet->frame += hdr->tp_next_offset;
+      packet->frame_left--;
+    }
+
+    if (!packet->frame_left) {
+      __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL,
+                       __ATOMIC_RELEASE);
+      packet->block_index = (packet->block_index + 1) % packet->block_count;
+      packet->frame = NULL;
+    }
+  }
+
+  return processed;
+}
+
+int afpacket_write(struct afpacket_t* packet,
+                   const uint8_t* bytes,
+                   size_t size) {
+  if (packet->fd == -1) {
+    return -1;
+  }
+
+  if (send(packet->fd, bytes, size, 0) != (ssize_t)size) {
+    return -1;
+  }
+
+  return 0;
+}
+
+void afpacket_tx_init(struct afpacket_tx_t* tx) {
+  tx->fd = -1;
+  tx->map = NULL;
+  tx->map_size = 0;
+  tx->frame_size = 0;
+  tx->frame_count = 0;
+  tx->frame_index = 0;
+  tx->pending = 0;
+}
+
+void afpacket_tx_close(struct afpacket_tx_t* tx) {
+  if (tx->map) {
+    munmap(tx->map, tx->map_size);
+  }
+  if (tx->fd != -1) {
+    close(tx->fd);
+  }
+  afpacket_tx_init(tx);
+}
+
+int afpacket_tx_open(struct afpacket_tx_t* tx,
+                     const char* ifname,
+                     const struct afpacket_config_t* config) {
+  if (tx->fd != -1) {
+    return 0;
+  }
+
+  long page_size = sysconf(_SC_PAGESIZE);
+  unsigned int block_size = config->block_size;
+  if ((block_size == 0) || (block_size % page_size) ||
+      (config->tx_frame_size <= TPACKET2_HDRLEN) ||
+      (config->tx_frame_size % TPACKET_ALIGNMENT) ||
+      (block_size % config->tx_frame_size) || (config->tx_frame_count == 0)) {
+    fprintf(stderr, "ERROR> %s incorrect tx ring geometry frame %u count %u\n",
+            __FUNCTION__, config->tx_frame_size, config->tx_frame_count);
+    return -1;
+  }
+
+  int ifindex = if_nametoindex(ifname);
+  if (ifindex == 0) {
+    fprintf(stderr, "ERROR> %s if_nametoindex(%s)\n", __FUNCTION__, ifname);
+    return -1;
+  }
+
+  // Протокол 0: сокет только передает и не получает копии трафика.
+  tx->fd = socket(AF_PACKET, SOCK_RAW, 0);
+  if (tx->fd == -1) {
+    fprintf(stderr, "ERROR> %s socket(%s)\n", __FUNCTION__, ifname);
+    perror("socket:");
+    return -1;
+  }
+
+  int version = TPACKET_V2;
+  if (setsockopt(tx->fd, SOL_PACKET, PACKET_VERSION, &version,
+                 sizeof(version)) == -1) {
+    fprintf(stderr, "ERROR> %s setsockopt PACKET_VERSION\n", __FUNCTION__);
+    goto aborting;
+  }
+  if (afpacket_setup_vnet(tx->fd, config) == -1) {
+    goto aborting;
+  }
+
+  if (config->qdisc_bypass) {
+    int one = 1;
+    if (setsockopt(tx->fd, SOL_PACKET, PACKET_QDISC_BYPASS, &one,
+                   sizeof(one)) == -1) {
+      fprintf(stderr, "WARNING> %s PACKET_QDISC_BYPASS(%s) unsupported\n",
+              __FUNCTION__, ifname);
+    }
+  }
+
+  unsigned int frames_per_block = block_size / config->tx_frame_size;
+  unsigned int block_count =
+      (config->tx_frame_count + frames_per_block - 1) / frames_per_block;
+
+  struct tpacket_req req;
+  memset(&req, 0, sizeof(req));
+  req.tp_block_size = block_size;
+  req.tp_block_nr = block_count;
+  req.tp_frame_size = config->tx_frame_size;
+  req.tp_frame_nr = frames_per_block * block_count;
+  if (setsockopt(tx->fd, SOL_PACKET, PACKET_TX_RING, &req, sizeof(req)) ==
+      -1) {
+    fprintf(stderr, "ERROR> %s setsockopt PACKET_TX_RING\n", __FUNCTION__);
+    perror("setsockopt:");
+    goto aborting;
+  }
+
+  tx->frame_size = req.tp_frame_size;
+  tx->frame_count = req.tp_frame_nr;
+  tx->map_size = (size_t)block_size * block_count;
+  tx->map = mmap(NULL, tx->map_size, PROT_READ | PROT_WRITE,
+                 MAP_SHARED | MAP_POPULATE, tx->fd, 0);
+  if (tx->map == MAP_FAILED) {
+    tx->map = NULL;
+    fprintf(stderr, "ERROR> %s mmap\n", __FUNCTION__);
+    perror("mmap:");
+    goto aborting;
+  }
+
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = 0;
+  addr.sll_ifindex = ifindex;
+  if (bind(tx->fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) {
+    fprintf(stderr, "ERROR> %s bind(%s)\n", __FUNCTION__, ifname);
+    perror("bind:");
+    goto aborting;
+  }
+
+  return 0;
+
+aborting:
+  afpacket_tx_close(tx);
+  return -1;
+}
+
+static struct tpacket2_hdr* afpacket_tx_frame(struct afpacket_tx_t* tx) {
+  return (struct tpacket2_hdr*)(tx->map +
+                                (size_t)tx->frame_index * tx->frame_size);
+}
+
+static bool afpacket_tx_available(struct tpacket2_hdr* hdr) {
+  uint32_t status = __atomic_load_n(&hdr->tp_status, __ATOMIC_ACQUIRE);
+  return (status == TP_STATUS_AVAILABLE) || (status == TP_STATUS_WRONG_FORMAT);
+}
+
+int afpacket_tx_flush(struct afpacket_tx_t* tx) {
+  if (tx->fd == -1) {
+    return -1;
+  }
+  if (!tx->pending) {
+    return 0;
+  }
+
+  tx->pending = 0;
+  if ((send(tx->fd, NULL, 0, MSG_DONTWAIT) == -1) && (errno != EAGAIN) &&
+      (errno != ENOBUFS)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+// send() с данными на сокете с TX кольцом отправляет кольцо, а не переданный
+// буфер, поэтому кадр больше слота нужно писать через другой сокет.
+bool afpacket_tx_fits(const struct afpacket_tx_t* tx, size_t size) {
+  size_t offset = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+  return size <= tx->frame_size - offset;
+}
+
+int afpacket_tx_write(struct afpacket_tx_t* tx,
+                      const uint8_t* bytes,
+                      size_t size) {
+  if (!tx->map) {
+    return -1;
+  }
+
+  size_t offset = TPACKET2_HDRLEN - sizeof(struct sockaddr_ll);
+  if (!afpacket_tx_fits(tx, size)) {
+    return -1;
+  }
+
+  struct tpacket2_hdr* hdr = afpacket_tx_frame(tx);
+  if (!afpacket_tx_available(hdr)) {
+    afpacket_tx_flush(tx);
+
+    struct pollfd pfd = {tx->fd, POLLOUT, 0};
+    poll(&pfd, 1, 1);
+    if (!afpacket_tx_available(hdr)) {
+      return -1;
+    }
+  }
+
+  memcpy((uint8_t*)hdr + offset, bytes, size);
+  hdr->tp_len = size;
+  __atomic_store_n(&hdr->tp_status, TP_STATUS_SEND_REQUEST, __ATOMIC_RELEASE);
+
+  tx->frame_index = (tx->frame_index + 1) % tx->frame_count;
+  tx->pending++;
+  if (tx->pending >= tx->frame_count / 2) {
+    return afpacket_tx_flush(tx);
+  }
+
+  return 0;
+}
@@ -0,0 +1,94 @@
+#ifndef BRIDGE_AFPACKET_H
+#define BRIDGE_AFPACKET_H
+
+#include "latency.h"
+
+#include <inttypes.h>
+#include <linux/filter.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void (*afpacket_handler_t)(void* user,
+                                   const uint8_t* bytes,
+                                   size_t size);
+
+struct afpacket_config_t {
+  unsigned int block_size;
+  unsigned int frame_size;
+  unsigned int frame_count;
+  unsigned int retire_timeout;
+  unsigned int tx_frame_size;
+  unsigned int tx_frame_count;
+  bool qdisc_bypass;
+  bool vnet_hdr;
+  // Сокетов на интерфейс в группе PACKET_FANOUT, 1 - без группы. Группа
+  // своя у каждого интерфейса, ядро делит кадры между ее сокетами по
+  // fanout_mode (PACKET_FANOUT_*).
+  unsigned int fanout;
+  unsigned int fanout_mode;
+  unsigned int fanout_group;
+};
+
+struct afpacket_t {
+  int fd;
+  int ifindex;
+  uint8_t* map;
+  size_t map_size;
+  unsigned int block_size;
+  unsigned int block_count;
+  unsigned int block_index;
+  uint8_t* frame;
+  unsigned int frame_left;
+  bool vnet_hdr;
+  uint64_t stat_packets;
+  uint64_t stat_drops;
+  // Свои исходящие и обрезанные кадры, пропущенные без обработчика.
+  uint64_t skipped;
+  struct latency_hist_t* capture;
+};
+
+struct afpacket_tx_t {
+  int fd;
+  uint8_t* map;
+  size_t map_size;
+  unsigned int frame_size;
+  unsigned int frame_count;
+  unsigned int frame_index;
+  unsigned int pending;
+};
+
+void afpacket_config_default(struct afpacket_config_t* config);
+int afpacket_parse_fanout_mode(struct afpacket_config_t* config,
+                               const char* name);
+
+void afpacket_init(struct afpacket_t* packet);
+int afpacket_open(struct afpacket_t* packet,
+                  const char* ifname,
+                  const struct afpacket_config_t* config,
+                  const struct sock_fprog* filter);
+void afpacket_close(struct afpacket_t* packet);
+int afpacket_dispatch(struct afpacket_t* packet,
+                      int count,
+                      int timeout,
+                      afpacket_handler_t handler,
+                      void* user);
+int afpacket_write(struct afpacket_t* packet,
+                   const uint8_t* bytes,
+                   size_t size);
+int afpacket_stats(struct afpacket_t* packet,
+                   uint64_t* packets,
+                   uint64_t* drops);
+
+void afpacket_tx_init(struct afpacket_tx_t* tx);
+int afpacket_tx_open(struct afpacket_tx_t* tx,
+                     const char* ifname,
+                     const struct afpacket_config_t* config);
+void afpacket_tx_close(struct afpacket_tx_t* tx);
+bool afpacket_tx_fits(const struct afpacket_tx_t* tx, size_t size);
+int afpacket_tx_write(struct afpacket_tx_t* tx,
+                      const uint8_t* bytes,
+                      size_t size);
+int afpacket_tx_flush(struct afpacket_tx_t* tx);
+
+#endif  // BRIDGE_AFPACKET_H
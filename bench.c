@@ -0,0 +1,554 @@
+#include "latency.h"
+#include "local.h"
+#include "loop.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <inttypes.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+#include <net/if.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+// Генератор и приемник кадров для замеров моста: кадры уходят в один
+// интерфейс, принимаются с другого, в теле кадра номер и метка времени.
+// С --loop мост запускается в этом же процессе на проводах loop: замеряется
+// только пересылка и FDB, без системных вызовов и root.
+#define BENCH_ETHERTYPE 0x88b5
+#define BENCH_MAGIC 0x62726c32
+#define BENCH_BATCH 64
+#define BENCH_MIN_SIZE 64
+#define BENCH_MAX_SIZE 9216
+#define BENCH_BUFFER_SIZE 16384
+#define BENCH_DRAIN_MS 500
+#define BENCH_SOCKET_BUFFER (64 << 20)
+#define BENCH_LOOP_TIMEOUT_MS 100
+
+struct bench_payload_t {
+  uint32_t magic;
+  uint32_t flow;
+  uint64_t seq;
+  uint64_t stamp;
+} __attribute__((packed));
+
+#define BENCH_HEADER_SIZE (ETH_HLEN + sizeof(struct bench_payload_t))
+
+struct bench_config_t {
+  const char* tx_name;
+  const char* rx_name;
+  const char* tx_netns;
+  const char* rx_netns;
+  const char* label;
+  size_t size;
+  unsigned int flows;
+  unsigned int duration;
+  uint64_t rate;
+  bool loop;
+  struct engine_config_t engine;
+};
+
+struct bench_t {
+  struct bench_config_t config;
+  int tx_fd;
+  int rx_fd;
+  struct loop_t tx_loop;
+  struct loop_t rx_loop;
+  struct local_bridge_t* bridge;
+  uint64_t sent;
+  uint64_t received;
+  uint64_t received_bytes;
+  uint64_t corrupted;
+  double elapsed;
+  bool sending;
+  bool terminated;
+  struct latency_hist_t* latency;
+};
+
+static uint64_t bench_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Сокет открывается в пространстве имен netns (ip netns add), если задано:
+// интерфейсы моста лежат в разных namespace.
+static int bench_socket(const char* ifname, const char* netns, int protocol) {
+  int origin = -1;
+  if (netns) {
+    char path[256];
+    snprintf(path, sizeof(path), "/run/netns/%s", netns);
+    int target = open(path, O_RDONLY | O_CLOEXEC);
+    origin = open("/proc/self/ns/net", O_RDONLY | O_CLOEXEC);
+    if ((target == -1) || (origin == -1) ||
+        (setns(target, CLONE_NEWNET) == -1)) {
+      fprintf(stderr, "ERROR> %s netns %s: %s\n", __FUNCTION__, netns,
+              strerror(errno));
+      if (target != -1) {
+        close(target);
+      }
+      if (origin != -1) {
+        close(origin);
+      }
+      return -1;
+    }
+    close(target);
+  }
+
+  int fd = socket(AF_PACKET, SOCK_RAW, htons(protocol));
+  struct sockaddr_ll addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sll_family = AF_PACKET;
+  addr.sll_protocol = htons(protocol);
+  addr.sll_ifindex = if_nametoindex(ifname);
+  if ((fd == -1) || !addr.sll_ifindex ||
+      (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) == -1)) {
+    fprintf(stderr, "ERROR> %s %s: %s\n", __FUNCTION__, ifname,
+            strerror(errno));
+    if (fd != -1) {
+      close(fd);
+    }
+    fd = -1;
+  }
+
+  if (origin != -1) {
+    setns(origin, CLONE_NEWNET);
+    close(origin);
+  }
+
+  return fd;
+}
+
+// Поток i шлет кадры с MAC адресами 02:b1:00:00:0x:i, мост видит их как
+// разные станции.
+static void bench_frame_init(uint8_t* frame, size_t size, unsigned int flow) {
+  static const uint8_t dst[ETH_ALEN] = {0x02, 0xb1, 0x00, 0x00, 0x01, 0x00};
+  static const uint8_t src[ETH_ALEN] = {0x02, 0xb1, 0x00, 0x00, 0x00, 0x00};
+
+  memcpy(frame, dst, ETH_ALEN);
+  memcpy(frame + ETH_ALEN, src, ETH_ALEN);
+  frame[4] |= flow >> 8;
+  frame[5] = flow & 0xff;
+  frame[ETH_ALEN + 4] = flow >> 8;
+  frame[ETH_ALEN + 5] = flow & 0xff;
+  frame[2 * ETH_ALEN] = BENCH_ETHERTYPE >> 8;
+  frame[2 * ETH_ALEN + 1] = BENCH_ETHERTYPE & 0xff;
+  for (size_t i = BENCH_HEADER_SIZE; i < size; i++) {
+    frame[i] = i & 0xff;
+  }
+}
+
+// Провод loop, как и сокет, не принимает кадры при полной очереди: тогда
+// отправка повторяется.
+static int bench_send(struct bench_t* bench,
+                      struct mmsghdr* msgs,
+                      unsigned int count) {
+  if (!bench->config.loop) {
+    return sendmmsg(bench->tx_fd, msgs, count, 0);
+  }
+
+  unsigned int sent = 0;
+  while (sent < count) {
+    const struct iovec* iov = msgs[sent].msg_hdr.msg_iov;
+    if (loop_write(&bench->tx_loop, iov->iov_base, iov->iov_len) == -1) {
+      break;
+    }
+    sent++;
+  }
+  if (!sent) {
+    errno = EAGAIN;
+    return -1;
+  }
+  return sent;
+}
+
+static void* bench_send_thread(void* thread_data) {
+  struct bench_t* bench = thread_data;
+  const struct bench_config_t* config = &bench->config;
+  size_t size = config->size;
+
+  uint8_t* frames = malloc(BENCH_BATCH * size);
+  if (!frames) {
+    fprintf(stderr, "ERROR> %s malloc\n", __FUNCTION__);
+    return NULL;
+  }
+
+  struct mmsghdr msgs[BENCH_BATCH];
+  struct iovec iovs[BENCH_BATCH];
+  memset(msgs, 0, sizeof(msgs));
+  for (unsigned int i = 0; i < BENCH_BATCH; i++) {
+    bench_frame_init(frames + i * size, size, 0);
+    iovs[i].iov_base = frames + i * size;
+    iovs[i].iov_len = size;
+    msgs[i].msg_hdr.msg_iov = &iovs[i];
+    msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+
+  uint64_t start = bench_now_ns();
+  uint64_t end = start + config->duration * 1000000000ull;
+  uint64_t seq = 0;
+  uint64_t now = start;
+  while (now < end) {
+    for (unsigned int i = 0; i < BENCH_BATCH; i++) {
+      uint8_t* frame = frames + i * size;
+      unsigned int flow = (seq + i) % config->flows;
+      bench_frame_init(frame, BENCH_HEADER_SIZE, flow);
+      struct bench_payload_t payload = {BENCH_MAGIC, flow, seq + i,
+                                        latency_now()};
+      memcpy(frame + ETH_HLEN, &payload, sizeof(payload));
+    }
+
+    int count = bench_send(bench, msgs, BENCH_BATCH);
+    if (count > 0) {
+      seq += count;
+    } else if ((errno != ENOBUFS) && (errno != EAGAIN) && (errno != EINTR)) {
+      fprintf(stderr, "ERROR> %s send %s\n", __FUNCTION__,
+              strerror(errno));
+      break;
+    } else {
+      sched_yield();
+    }
+
+    now = bench_now_ns();
+    if (config->rate) {
+      uint64_t due = start + seq * 1000000000ull / config->rate;
+      while (now < due) {
+        now = bench_now_ns();
+      }
+    }
+  }
+
+  bench->elapsed = (now - start) / 1e9;
+  __atomic_store_n(&bench->sent, seq, __ATOMIC_RELEASE);
+  __atomic_store_n(&bench->sending, false, __ATOMIC_RELEASE);
+  free(frames);
+
+  return NULL;
+}
+
+static void bench_receive(void* user, const uint8_t* frame, size_t size) {
+  struct bench_t* bench = user;
+  struct bench_payload_t payload;
+  if (size < BENCH_HEADER_SIZE) {
+    return;
+  }
+  memcpy(&payload, frame + ETH_HLEN, sizeof(payload));
+  if (payload.magic != BENCH_MAGIC) {
+    return;
+  }
+
+  if (size != bench->config.size) {
+    bench->corrupted++;
+    return;
+  }
+
+  bench->received++;
+  bench->received_bytes += size;
+  latency_record(bench->latency, payload.stamp);
+}
+
+static void* bench_recv_thread(void* thread_data) {
+  struct bench_t* bench = thread_data;
+
+  if (bench->config.loop) {
+    while (!__atomic_load_n(&bench->terminated, __ATOMIC_ACQUIRE)) {
+      loop_dispatch(&bench->rx_loop, BENCH_BATCH, BENCH_LOOP_TIMEOUT_MS,
+                    bench_receive, bench);
+    }
+    return NULL;
+  }
+
+  uint8_t* buffers = malloc(BENCH_BATCH * BENCH_BUFFER_SIZE);
+  if (!buffers) {
+    fprintf(stderr, "ERROR> %s malloc\n", __FUNCTION__);
+    return NULL;
+  }
+
+  struct mmsghdr msgs[BENCH_BATCH];
+  struct iovec iovs[BENCH_BATCH];
+  struct sockaddr_ll addrs[BENCH_BATCH];
+  while (!__atomic_load_n(&bench->terminated, __ATOMIC_ACQUIRE)) {
+    memset(msgs, 0, sizeof(msgs));
+    for (unsigned int i = 0; i < BENCH_BATCH; i++) {
+      iovs[i].iov_base = buffers + i * BENCH_BUFFER_SIZE;
+      iovs[i].iov_len = BENCH_BUFFER_SIZE;
+      msgs[i].msg_hdr.msg_iov = &iovs[i];
+      msgs[i].msg_hdr.msg_iovlen = 1;
+      msgs[i].msg_hdr.msg_name = &addrs[i];
+      msgs[i].msg_hdr.msg_namelen = sizeof(addrs[i]);
+    }
+
+    int count = recvmmsg(bench->rx_fd, msgs, BENCH_BATCH, MSG_WAITFORONE,
+                         NULL);
+    for (int i = 0; i < count; i++) {
+      if (addrs[i].sll_pkttype != PACKET_OUTGOING) {
+        bench_receive(bench, iovs[i].iov_base, msgs[i].msg_len);
+      }
+    }
+  }
+
+  free(buffers);
+  return NULL;
+}
+
+// Одна строка JSON на прогон, чтобы результаты можно было сравнивать между
+// сборками.
+static void bench_report(const struct bench_t* bench) {
+  const struct bench_config_t* config = &bench->config;
+  struct latency_summary_t latency;
+  latency_summary(bench->latency, &latency);
+
+  double elapsed = bench->elapsed > 0 ? bench->elapsed : 1;
+  double drop_rate = 0;
+  if (bench->sent > bench->received) {
+    drop_rate = (double)(bench->sent - bench->received) / bench->sent;
+  }
+
+  printf("{\"label\": \"%s\", \"tx\": \"%s\", \"rx\": \"%s\", "
+         "\"size\": %zu, \"flows\": %u, \"seconds\": %.3f, "
+         "\"sent\": %" PRIu64 ", \"received\": %" PRIu64
+         ", \"corrupted\": %" PRIu64 ", \"drop_rate\": %.6f, "
+         "\"pps\": %.0f, \"gbps\": %.3f, \"p50_ns\": %" PRIu64
+         ", \"p99_ns\": %" PRIu64 ", \"p999_ns\": %" PRIu64
+         ", \"max_ns\": %" PRIu64 "}\n",
+         config->label, config->tx_name, config->rx_name, config->size,
+         config->flows, elapsed, bench->sent, bench->received,
+         bench->corrupted, drop_rate, bench->received / elapsed,
+         bench->received_bytes * 8 / elapsed / 1e9, latency.p50, latency.p99,
+         latency.p999, latency.max);
+  fflush(stdout);
+}
+
+static int bench_open_sockets(struct bench_t* bench) {
+  const struct bench_config_t* config = &bench->config;
+
+  bench->tx_fd = bench_socket(config->tx_name, config->tx_netns, 0);
+  bench->rx_fd =
+      bench_socket(config->rx_name, config->rx_netns, BENCH_ETHERTYPE);
+  if ((bench->tx_fd == -1) || (bench->rx_fd == -1)) {
+    return -1;
+  }
+
+  int size = BENCH_SOCKET_BUFFER;
+  setsockopt(bench->rx_fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size));
+  struct timeval timeout = {0, 100000};
+  setsockopt(bench->rx_fd, SOL_SOCKET, SO_RCVTIMEO, &timeout,
+             sizeof(timeout));
+  return 0;
+}
+
+// Генератор занимает один конец каждого провода, мост - другой.
+static int bench_open_loop(struct bench_t* bench) {
+  const struct bench_config_t* config = &bench->config;
+
+  if ((loop_open(&bench->tx_loop, config->tx_name) == -1) ||
+      (loop_open(&bench->rx_loop, config->rx_name) == -1)) {
+    return -1;
+  }
+
+  const char* ifnames[2] = {config->tx_name, config->rx_name};
+  struct inter_config_t inter_config;
+  inter_config_default(&inter_config);
+  inter_config.backend = INTER_BACKEND_LOOP;
+  bench->bridge =
+      local_bridge_new(ifnames, 2, &inter_config, &config->engine, FDB_AGE);
+  if (!bench->bridge) {
+    fprintf(stderr, "ERROR> %s local_bridge_new\n", __FUNCTION__);
+    return -1;
+  }
+
+  if ((local_bridge_open(bench->bridge) == -1) ||
+      (local_bridge_run(bench->bridge) == -1)) {
+    fprintf(stderr, "ERROR> %s bridge %s <=> %s\n", __FUNCTION__,
+            config->tx_name, config->rx_name);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void bench_close(struct bench_t* bench) {
+  if (bench->tx_fd != -1) {
+    close(bench->tx_fd);
+  }
+  if (bench->rx_fd != -1) {
+    close(bench->rx_fd);
+  }
+  if (bench->bridge) {
+    local_bridge_stop(bench->bridge);
+    local_bridge_close(bench->bridge);
+    local_bridge_free(bench->bridge);
+    bench->bridge = NULL;
+  }
+  loop_close(&bench->tx_loop);
+  loop_close(&bench->rx_loop);
+}
+
+static int bench_run(struct bench_t* bench) {
+  bench->tx_fd = -1;
+  bench->rx_fd = -1;
+  loop_init(&bench->tx_loop);
+  loop_init(&bench->rx_loop);
+  bench->bridge = NULL;
+
+  int res = bench->config.loop ? bench_open_loop(bench)
+                               : bench_open_sockets(bench);
+  if (res == -1) {
+    goto aborting;
+  }
+
+  pthread_t recv_thread;
+  pthread_t send_thread;
+  bench->sending = true;
+  if (pthread_create(&recv_thread, NULL, bench_recv_thread, bench) != 0) {
+    fprintf(stderr, "ERROR> %s pthread_create\n", __FUNCTION__);
+    goto aborting;
+  }
+  if (pthread_create(&send_thread, NULL, bench_send_thread, bench) != 0) {
+    fprintf(stderr, "ERROR> %s pthread_create\n", __FUNCTION__);
+    __atomic_store_n(&bench->terminated, true, __ATOMIC_RELEASE);
+    pthread_join(recv_thread, NULL);
+    goto aborting;
+  }
+
+  pthread_join(send_thread, NULL);
+  // Кадры, которые еще в очередях моста, успевают дойти.
+  usleep(BENCH_DRAIN_MS * 1000);
+  __atomic_store_n(&bench->terminated, true, __ATOMIC_RELEASE);
+  pthread_join(recv_thread, NULL);
+
+  bench_close(bench);
+  bench_report(bench);
+  if (bench->config.loop) {
+    // Задержки по ступеням моста.
+    latency_dump(stderr);
+  }
+  return 0;
+
+aborting:
+  bench_close(bench);
+  return -1;
+}
+
+enum {
+  OPT_SIZE = 256,
+  OPT_FLOWS,
+  OPT_DURATION,
+  OPT_RATE,
+  OPT_TX_NETNS,
+  OPT_RX_NETNS,
+  OPT_LABEL,
+  OPT_LOOP,
+  OPT_ENGINE,
+};
+
+static const struct option long_options[] = {
+    {"size", required_argument, NULL, OPT_SIZE},
+    {"flows", required_argument, NULL, OPT_FLOWS},
+    {"duration", required_argument, NULL, OPT_DURATION},
+    {"rate", required_argument, NULL, OPT_RATE},
+    {"tx-netns", required_argument, NULL, OPT_TX_NETNS},
+    {"rx-netns", required_argument, NULL, OPT_RX_NETNS},
+    {"label", required_argument, NULL, OPT_LABEL},
+    {"loop", no_argument, NULL, OPT_LOOP},
+    {"engine", required_argument, NULL, OPT_ENGINE},
+    {NULL, 0, NULL, 0},
+};
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: bridge_l2_bench [options] <tx-if> <rx-if>\n"
+          "Options:\n"
+          "  --size=<bytes>\n"
+          "  --flows=<count>\n"
+          "  --duration=<sec>\n"
+          "  --rate=<pps>\n"
+          "  --tx-netns=<name>\n"
+          "  --rx-netns=<name>\n"
+          "  --label=<text>\n"
+          "  --loop\n"
+          "  --engine=threads|pipeline (with --loop)\n");
+}
+
+int main(int argc, char** argv) {
+  struct bench_t bench;
+  memset(&bench, 0, sizeof(bench));
+  struct bench_config_t* config = &bench.config;
+  config->label = "";
+  config->size = BENCH_MIN_SIZE;
+  config->flows = 1;
+  config->duration = 5;
+  engine_config_default(&config->engine);
+
+  int option;
+  while ((option = getopt_long(argc, argv, "", long_options, NULL)) != -1) {
+    switch (option) {
+      case OPT_SIZE:
+        config->size = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_FLOWS:
+        config->flows = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_DURATION:
+        config->duration = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_RATE:
+        config->rate = strtoull(optarg, NULL, 0);
+        break;
+      case OPT_TX_NETNS:
+        config->tx_netns = optarg;
+        break;
+      case OPT_RX_NETNS:
+        config->rx_netns = optarg;
+        break;
+      case OPT_LABEL:
+        config->label = optarg;
+        break;
+      case OPT_LOOP:
+        config->loop = true;
+        break;
+      case OPT_ENGINE:
+        if (!strcmp(optarg, "threads")) {
+          config->engine.type = ENGINE_THREADS;
+        } else if (!strcmp(optarg, "pipeline")) {
+          config->engine.type = ENGINE_PIPELINE;
+        } else {
+          fprintf(stderr, "Unknown engine %s\n", optarg);
+          return 1;
+        }
+        break;
+      default:
+        usage();
+        return 1;
+    }
+  }
+
+  if ((argc - optind != 2) || (config->size < BENCH_MIN_SIZE) ||
+      (config->size > BENCH_MAX_SIZE) || !config->flows ||
+      (config->flows > 0xffff) || !config->duration) {
+    usage();
+    return 1;
+  }
+  config->tx_name = argv[optind];
+  config->rx_name = argv[optind + 1];
+
+  if (!config->loop && (geteuid() != 0)) {
+    fprintf(stderr, "You must be root!\n");
+    return 1;
+  }
+
+  latency_enable();
+  bench.latency = latency_hist("bench");
+
+  return bench_run(&bench) == -1 ? 1 : 0;
+}
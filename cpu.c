@@ -0,0 +1,238 @@
+#include "cpu.h"
+
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef SO_PREFER_BUSY_POLL
+#define SO_PREFER_BUSY_POLL 69
+#endif
+
+static enum cpu_profile_t cpu_profile = CPU_PROFILE_NONE;
+static int cpu_list[CPU_SETSIZE];
+static unsigned int cpu_count = 0;
+static unsigned int cpu_next = 0;
+
+void cpu_config_default(struct cpu_config_t* config) {
+  config->profile = CPU_PROFILE_NONE;
+  CPU_ZERO(&config->cpus);
+  config->cpus_set = false;
+  config->node = -1;
+}
+
+int cpu_parse_profile(struct cpu_config_t* config, const char* name) {
+  if (!strcmp(name, "throughput")) {
+    config->profile = CPU_PROFILE_THROUGHPUT;
+  } else if (!strcmp(name, "low-latency")) {
+    config->profile = CPU_PROFILE_LOW_LATENCY;
+  } else if (!strcmp(name, "power-save")) {
+    config->profile = CPU_PROFILE_POWER_SAVE;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+// Список в формате cpulist ядра: 0-3,8,10-11.
+int cpu_parse_list(cpu_set_t* set, const char* list) {
+  CPU_ZERO(set);
+  const char* item = list;
+  while (*item && (*item != '\n')) {
+    char* end = NULL;
+    unsigned long first = strtoul(item, &end, 10);
+    unsigned long last = first;
+    if (end == item) {
+      return -1;
+    }
+    if (*end == '-') {
+      item = end + 1;
+      last = strtoul(item, &end, 10);
+      if (end == item) {
+        return -1;
+      }
+    }
+    if ((last < first) || (last >= CPU_SETSIZE) ||
+        ((*end != ',') && (*end != '\n') && *end)) {
+      return -1;
+    }
+    for (unsigned long cpu = first; cpu <= last; cpu++) {
+      CPU_SET(cpu, set);
+    }
+    item = (*end == ',') ? end + 1 : end;
+  }
+
+  return CPU_COUNT(set) ? 0 : -1;
+}
+
+static int cpu_read_line(const char* path, char* line, size_t size) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    return -1;
+  }
+  char* res = fgets(line, size, file);
+  fclose(file);
+  return res ? 0 : -1;
+}
+
+// Узел NUMA устройства сетевой карты, -1 если узел неизвестен (одна память,
+// виртуальное устройство).
+static int cpu_interface_node(const char* ifname) {
+  char path[128];
+  char line[32];
+  if (!ifname) {
+    return -1;
+  }
+  snprintf(path, sizeof(path), "/sys/class/net/%.32s/device/numa_node",
+           ifname);
+  if (cpu_read_line(path, line, sizeof(line)) == -1) {
+    return -1;
+  }
+  return atoi(line);
+}
+
+static int cpu_node_cpus(int node, cpu_set_t* set) {
+  char path[128];
+  char line[1024];
+  snprintf(path, sizeof(path), "/sys/devices/system/node/node%d/cpulist",
+           node);
+  if (cpu_read_line(path, line, sizeof(line)) == -1) {
+    return -1;
+  }
+  return cpu_parse_list(set, line);
+}
+
+// Память предпочтительно выделяется на узле node, libnuma не нужна. Политику
+// наследуют потоки, созданные после.
+static void cpu_prefer_node(int node) {
+  unsigned long mask = 0;
+  if ((node < 0) || (node >= (int)(sizeof(mask) * 8))) {
+    fprintf(stderr, "WARNING> %s node %d out of range\n", __FUNCTION__, node);
+    return;
+  }
+
+  mask = 1ul << node;
+  if (syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask,
+              sizeof(mask) * 8 + 1) == -1) {
+    fprintf(stderr, "WARNING> %s set_mempolicy node %d\n", __FUNCTION__,
+            node);
+  }
+}
+
+int cpu_configure(const struct cpu_config_t* config, const char* ifname) {
+  if ((config->profile == CPU_PROFILE_NONE) && !config->cpus_set &&
+      (config->node == -1)) {
+    return 0;
+  }
+
+  int node = (config->node != -1) ? config->node : cpu_interface_node(ifname);
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    fprintf(stderr, "ERROR> %s sched_getaffinity\n", __FUNCTION__);
+    return -1;
+  }
+
+  // Ядра узла, которые процессу разрешены. Если таких нет, берутся все
+  // разрешенные ядра.
+  cpu_set_t set = allowed;
+  if (config->cpus_set) {
+    CPU_AND(&set, &config->cpus, &allowed);
+  } else if ((node != -1) && (cpu_node_cpus(node, &set) == 0)) {
+    CPU_AND(&set, &set, &allowed);
+    if (!CPU_COUNT(&set)) {
+      set = allowed;
+    }
+  }
+  if (!CPU_COUNT(&set)) {
+    fprintf(stderr, "ERROR> %s no allowed cpus\n", __FUNCTION__);
+    return -1;
+  }
+
+  cpu_profile = config->profile;
+  cpu_count = 0;
+  for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+    if (CPU_ISSET(cpu, &set)) {
+      cpu_list[cpu_count++] = cpu;
+    }
+  }
+
+  // Кольца, пул и буферы выделяются главным потоком: он и все потоки после
+  // него работают на выбранных ядрах.
+  if (sched_setaffinity(0, sizeof(set), &set) == -1) {
+    fprintf(stderr, "WARNING> %s sched_setaffinity\n", __FUNCTION__);
+  }
+  if (node != -1) {
+    cpu_prefer_node(node);
+  }
+  if ((cpu_profile == CPU_PROFILE_POWER_SAVE) &&
+      (prctl(PR_SET_TIMERSLACK, CPU_TIMER_SLACK) == -1)) {
+    fprintf(stderr, "WARNING> %s PR_SET_TIMERSLACK\n", __FUNCTION__);
+  }
+
+  return 0;
+}
+
+unsigned int cpu_thread_count(void) {
+  if (cpu_count) {
+    return cpu_count;
+  }
+
+  cpu_set_t allowed;
+  if (sched_getaffinity(0, sizeof(allowed), &allowed) == -1) {
+    return 1;
+  }
+  return CPU_COUNT(&allowed);
+}
+
+// Потоки пересылки получают по ядру по кругу, чтобы данные потока не
+// переезжали между кэшами. В power-save потоки не закрепляются и
+// планировщик может собрать их на меньшем числе ядер.
+void cpu_place_thread(pthread_t thread, const char* name) {
+  char thread_name[16];
+  snprintf(thread_name, sizeof(thread_name), "%s", name);
+  pthread_setname_np(thread, thread_name);
+  if (!cpu_count || (cpu_profile == CPU_PROFILE_POWER_SAVE)) {
+    return;
+  }
+
+  unsigned int index = __atomic_fetch_add(&cpu_next, 1, __ATOMIC_RELAXED);
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu_list[index % cpu_count], &set);
+  if (pthread_setaffinity_np(thread, sizeof(set), &set) != 0) {
+    fprintf(stderr, "WARNING> %s pthread_setaffinity_np %s\n", __FUNCTION__,
+            name);
+  }
+
+  if (cpu_profile == CPU_PROFILE_LOW_LATENCY) {
+    struct sched_param param = {.sched_priority = CPU_RT_PRIORITY};
+    if (pthread_setschedparam(thread, SCHED_FIFO, &param) != 0) {
+      fprintf(stderr, "WARNING> %s SCHED_FIFO %s\n", __FUNCTION__, name);
+    }
+  }
+}
+
+// В low-latency поток, ждущий данные сокета, сначала опрашивает очередь
+// сетевой карты (SO_BUSY_POLL), а не засыпает до прерывания. fd tap не
+// сокет, для него опрос не включается.
+void cpu_socket(int fd) {
+  if ((fd == -1) || (cpu_profile != CPU_PROFILE_LOW_LATENCY)) {
+    return;
+  }
+
+  int busy_poll = CPU_BUSY_POLL;
+  int one = 1;
+  if (setsockopt(fd, SOL_SOCKET, SO_BUSY_POLL, &busy_poll,
+                 sizeof(busy_poll)) == -1) {
+    if (errno != ENOTSOCK) {
+      fprintf(stderr, "WARNING> %s SO_BUSY_POLL\n", __FUNCTION__);
+    }
+    return;
+  }
+  setsockopt(fd, SOL_SOCKET, SO_PREFER_BUSY_POLL, &one, sizeof(one));
+}
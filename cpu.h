@@ -0,0 +1,42 @@
+#ifndef BRIDGE_CPU_H
+#define BRIDGE_CPU_H
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+
+// Поток опрашивает сокет перед сном, мкс (low-latency).
+#define CPU_BUSY_POLL 50
+#define CPU_RT_PRIORITY 10
+// Ядро объединяет пробуждения таймеров в пределах этого окна, нс
+// (power-save).
+#define CPU_TIMER_SLACK 200000
+
+enum cpu_profile_t {
+  CPU_PROFILE_NONE,
+  CPU_PROFILE_THROUGHPUT,
+  CPU_PROFILE_LOW_LATENCY,
+  CPU_PROFILE_POWER_SAVE,
+};
+
+// Размещение потоков пересылки: ядра из cpus (по умолчанию - ядра узла
+// NUMA сетевой карты), память на узле node (-1 - узел карты).
+struct cpu_config_t {
+  enum cpu_profile_t profile;
+  cpu_set_t cpus;
+  bool cpus_set;
+  int node;
+};
+
+void cpu_config_default(struct cpu_config_t* config);
+int cpu_parse_profile(struct cpu_config_t* config, const char* name);
+int cpu_parse_list(cpu_set_t* set, const char* list);
+// Вызывается до открытия мостов: память и потоки, созданные после, уже
+// размещаются на выбранных ядрах и узле.
+int cpu_configure(const struct cpu_config_t* config, const char* ifname);
+// Сколько потоков пула нужно, чтобы занять выбранные ядра.
+unsigned int cpu_thread_count(void);
+void cpu_place_thread(pthread_t thread, const char* name);
+void cpu_socket(int fd);
+
+#endif  // BRIDGE_CPU_H
@@ -0,0 +1,140 @@
+#include "daemon.h"
+
+#include <stdio.h>
+#include <string.h>
+
+void daemon_init(struct bridge_daemon_t* daemon) {
+  worker_pool_init(&daemon->pool);
+  daemon->bridge_count = 0;
+  daemon->running = false;
+}
+
+int daemon_open(struct bridge_daemon_t* daemon,
+                unsigned int workers,
+                unsigned int busy_poll) {
+  return worker_pool_open(&daemon->pool, workers, busy_poll);
+}
+
+static struct daemon_bridge_t* daemon_bridge(struct bridge_daemon_t* daemon,
+                                             enum daemon_bridge_type_t type) {
+  if (daemon->bridge_count >= DAEMON_MAX_BRIDGES) {
+    fprintf(stderr, "ERROR> %s too many bridges, max %d\n", __FUNCTION__,
+            DAEMON_MAX_BRIDGES);
+    return NULL;
+  }
+
+  struct daemon_bridge_t* bridge = &daemon->bridges[daemon->bridge_count];
+  memset(bridge, 0, sizeof(*bridge));
+  bridge->type = type;
+  return bridge;
+}
+
+// Мост попадает в список сразу после создания: если открыть его не вышло,
+// daemon_close закроет его вместе с остальными.
+int daemon_add_local(struct bridge_daemon_t* daemon,
+                     const char** ifnames,
+                     unsigned int count,
+                     const struct inter_config_t* inter_config,
+                     const struct remote_config_t* remote_config) {
+  struct daemon_bridge_t* bridge = daemon_bridge(daemon, DAEMON_LOCAL);
+  if (!bridge) {
+    return -1;
+  }
+
+  bridge->local =
+      local_bridge_new(ifnames, count, inter_config, &remote_config->engine,
+                       remote_config->fdb_age);
+  if (!bridge->local) {
+    return -1;
+  }
+  daemon->bridge_count++;
+
+  if ((local_bridge_open(bridge->local) == -1) ||
+      (local_bridge_attach(bridge->local, &daemon->pool) == -1)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+int daemon_add_client(struct bridge_daemon_t* daemon,
+                      const char* inter_name,
+                      const char* server_addr,
+                      int server_port,
+                      const struct inter_config_t* inter_config,
+                      const struct remote_config_t* remote_config) {
+  struct daemon_bridge_t* bridge = daemon_bridge(daemon, DAEMON_CLIENT);
+  if (!bridge) {
+    return -1;
+  }
+
+  bridge->client = client_init(inter_name, server_addr, server_port,
+                               inter_config, remote_config);
+  if (!bridge->client) {
+    return -1;
+  }
+  daemon->bridge_count++;
+
+  return client_attach(bridge->client, &daemon->pool);
+}
+
+int daemon_add_server(struct bridge_daemon_t* daemon,
+                      const char* inter_name,
+                      const char* name_addr,
+                      int port,
+                      const struct inter_config_t* inter_config,
+                      const struct remote_config_t* remote_config) {
+  struct daemon_bridge_t* bridge = daemon_bridge(daemon, DAEMON_SERVER);
+  if (!bridge) {
+    return -1;
+  }
+
+  bridge->server = server_init(inter_name, name_addr, port,
+                               &inter_config->filter, remote_config);
+  if (!bridge->server) {
+    return -1;
+  }
+  daemon->bridge_count++;
+
+  return server_attach(bridge->server, &daemon->pool);
+}
+
+int daemon_run(struct bridge_daemon_t* daemon) {
+  if (!daemon->bridge_count) {
+    fprintf(stderr, "ERROR> %s no bridges\n", __FUNCTION__);
+    return -1;
+  }
+
+  daemon->running = true;
+  return worker_pool_run(&daemon->pool);
+}
+
+void daemon_close(struct bridge_daemon_t* daemon) {
+  worker_pool_stop(&daemon->pool);
+
+  for (unsigned int i = 0; i < daemon->bridge_count; i++) {
+    struct daemon_bridge_t* bridge = &daemon->bridges[i];
+    switch (bridge->type) {
+      case DAEMON_LOCAL:
+        local_bridge_stop(bridge->local);
+        local_bridge_close(bridge->local);
+        local_bridge_free(bridge->local);
+        break;
+      case DAEMON_CLIENT:
+        client_stop(bridge->client);
+        client_free(bridge->client);
+        break;
+      case DAEMON_SERVER:
+        server_stop(bridge->server);
+        server_free(bridge->server);
+        break;
+    }
+  }
+  daemon->bridge_count = 0;
+
+  if (daemon->running) {
+    worker_pool_report(&daemon->pool, stderr);
+    daemon->running = false;
+  }
+  worker_pool_close(&daemon->pool);
+}
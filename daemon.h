@@ -0,0 +1,61 @@
+#ifndef BRIDGE_DAEMON_H
+#define BRIDGE_DAEMON_H
+
+#include "interface.h"
+#include "local.h"
+#include "remote.h"
+#include "worker.h"
+
+#include <stdbool.h>
+
+#define DAEMON_MAX_BRIDGES 256
+
+enum daemon_bridge_type_t {
+  DAEMON_LOCAL,
+  DAEMON_CLIENT,
+  DAEMON_SERVER,
+};
+
+struct daemon_bridge_t {
+  enum daemon_bridge_type_t type;
+  struct local_bridge_t* local;
+  struct client_t* client;
+  struct server_t* server;
+};
+
+// Много мостов в одном процессе: их источники (порты, сокеты туннеля, tap)
+// обслуживает один пул из workers потоков. Мост добавляется открытым и сразу
+// регистрируется в пуле, пул запускается после всех мостов.
+struct bridge_daemon_t {
+  struct worker_pool_t pool;
+  struct daemon_bridge_t bridges[DAEMON_MAX_BRIDGES];
+  unsigned int bridge_count;
+  bool running;
+};
+
+void daemon_init(struct bridge_daemon_t* daemon);
+int daemon_open(struct bridge_daemon_t* daemon,
+                unsigned int workers,
+                unsigned int busy_poll);
+int daemon_add_local(struct bridge_daemon_t* daemon,
+                     const char** ifnames,
+                     unsigned int count,
+                     const struct inter_config_t* inter_config,
+                     const struct remote_config_t* remote_config);
+int daemon_add_client(struct bridge_daemon_t* daemon,
+                      const char* inter_name,
+                      const char* server_addr,
+                      int server_port,
+                      const struct inter_config_t* inter_config,
+                      const struct remote_config_t* remote_config);
+int daemon_add_server(struct bridge_daemon_t* daemon,
+                      const char* inter_name,
+                      const char* name_addr,
+                      int port,
+                      const struct inter_config_t* inter_config,
+                      const struct remote_config_t* remote_config);
+int daemon_run(struct bridge_daemon_t* daemon);
+// Останавливает пул, затем закрывает и освобождает все мосты.
+void daemon_close(struct bridge_daemon_t* daemon);
+
+#endif  // BRIDGE_DAEMON_H
@@ -0,0 +1,176 @@
+#include "engine.h"
+#include "cpu.h"
+#include "ring.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+void engine_config_default(struct engine_config_t* config) {
+  config->type = ENGINE_THREADS;
+  config->busy_poll = 50;
+  config->ring_size = RING_SIZE;
+  config->pool_count = POOL_COUNT;
+  config->pool_buffer_size = POOL_BUFFER_SIZE;
+  config->hugepages = false;
+}
+
+void engine_init(struct engine_t* engine) {
+  engine->epoll_fd = -1;
+  engine->event_fd = -1;
+  engine->thread = 0;
+  engine->terminated = false;
+  engine->busy_poll = 0;
+  engine->source_count = 0;
+}
+
+int engine_open(struct engine_t* engine, const struct engine_config_t* config) {
+  engine->busy_poll = config->busy_poll;
+
+  engine->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (engine->epoll_fd == -1) {
+    fprintf(stderr, "ERROR> %s epoll_create1\n", __FUNCTION__);
+    return -1;
+  }
+
+  engine->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (engine->event_fd == -1) {
+    fprintf(stderr, "ERROR> %s eventfd\n", __FUNCTION__);
+    engine_close(engine);
+    return -1;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, engine->event_fd, &event) ==
+      -1) {
+    fprintf(stderr, "ERROR> %s epoll_ctl eventfd\n", __FUNCTION__);
+    engine_close(engine);
+    return -1;
+  }
+
+  return 0;
+}
+
+int engine_add(struct engine_t* engine,
+               int fd,
+               engine_handler_t handler,
+               void* user) {
+  if ((fd < 0) || (engine->source_count >= ENGINE_MAX_SOURCES)) {
+    fprintf(stderr, "ERROR> %s can't add fd %d\n", __FUNCTION__, fd);
+    return -1;
+  }
+
+  struct engine_source_t* source = &engine->sources[engine->source_count];
+  source->handler = handler;
+  source->user = user;
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = source;
+  if (epoll_ctl(engine->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    fprintf(stderr, "ERROR> %s epoll_ctl fd %d\n", __FUNCTION__, fd);
+    perror("epoll_ctl:");
+    return -1;
+  }
+
+  engine->source_count++;
+  return 0;
+}
+
+static uint64_t engine_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+// После последней полезной работы цикл еще busy_poll микросекунд опрашивает
+// источники без сна, затем засыпает в epoll_wait до следующего события.
+static void* engine_thread(void* thread_data) {
+  struct engine_t* engine = thread_data;
+
+  struct epoll_event events[ENGINE_MAX_SOURCES + 1];
+  uint64_t last_work = 0;
+  while (!engine->terminated) {
+    int timeout = -1;
+    if (engine->busy_poll && (engine_now() - last_work < engine->busy_poll)) {
+      timeout = 0;
+    }
+
+    int count = epoll_wait(engine->epoll_fd, events,
+                           sizeof(events) / sizeof(events[0]), timeout);
+    if (count == -1) {
+      if (errno == EINTR) {
+        continue;
+      }
+      fprintf(stderr, "ERROR> %s epoll_wait\n", __FUNCTION__);
+      break;
+    }
+
+    int work = 0;
+    for (int i = 0; i < count; i++) {
+      struct engine_source_t* source = events[i].data.ptr;
+      if (!source) {
+        continue;
+      }
+
+      int res = source->handler(source->user);
+      if (res > 0) {
+        work += res;
+      }
+    }
+
+    if (work) {
+      last_work = engine_now();
+    }
+  }
+
+  return NULL;
+}
+
+int engine_run(struct engine_t* engine) {
+  engine->terminated = false;
+
+  int res = pthread_create(&engine->thread, NULL, engine_thread, engine);
+  if (res != 0) {
+    fprintf(stderr, "ERROR> %s pthread_create\n", __FUNCTION__);
+    engine->thread = 0;
+    return -1;
+  }
+  cpu_place_thread(engine->thread, "engine");
+
+  return 0;
+}
+
+void engine_stop(struct engine_t* engine) {
+  if (!engine->thread) {
+    return;
+  }
+
+  engine->terminated = true;
+  uint64_t value = 1;
+  if (write(engine->event_fd, &value, sizeof(value)) == -1) {
+    fprintf(stderr, "ERROR> %s write eventfd\n", __FUNCTION__);
+  }
+
+  pthread_join(engine->thread, NULL);
+  engine->thread = 0;
+}
+
+void engine_close(struct engine_t* engine) {
+  if (engine->epoll_fd != -1) {
+    close(engine->epoll_fd);
+  }
+  if (engine->event_fd != -1) {
+    close(engine->event_fd);
+  }
+  engine_init(engine);
+}
@@ -0,0 +1,56 @@
+#ifndef BRIDGE_ENGINE_H
+#define BRIDGE_ENGINE_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+
+#define ENGINE_MAX_SOURCES 32
+
+typedef int (*engine_handler_t)(void* user);
+
+enum engine_type_t {
+  ENGINE_THREADS,
+  ENGINE_EPOLL,
+  ENGINE_URING,
+  ENGINE_PIPELINE,
+};
+
+struct engine_config_t {
+  enum engine_type_t type;
+  unsigned int busy_poll;
+  size_t ring_size;
+  unsigned int pool_count;
+  size_t pool_buffer_size;
+  bool hugepages;
+};
+
+struct engine_source_t {
+  engine_handler_t handler;
+  void* user;
+};
+
+struct engine_t {
+  int epoll_fd;
+  int event_fd;
+  pthread_t thread;
+  bool terminated;
+  unsigned int busy_poll;
+  unsigned int source_count;
+  struct engine_source_t sources[ENGINE_MAX_SOURCES];
+};
+
+void engine_config_default(struct engine_config_t* config);
+
+void engine_init(struct engine_t* engine);
+int engine_open(struct engine_t* engine, const struct engine_config_t* config);
+int engine_add(struct engine_t* engine,
+               int fd,
+               engine_handler_t handler,
+               void* user);
+int engine_run(struct engine_t* engine);
+void engine_stop(struct engine_t* engine);
+void engine_close(struct engine_t* engine);
+
+#endif  // BRIDGE_ENGINE_H
@@ -0,0 +1,292 @@
+#include "fdb.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define FDB_CACHE_LINE 64
+
+static uint64_t fdb_mac(const uint8_t* mac) {
+  return ((uint64_t)mac[0] << 40) | ((uint64_t)mac[1] << 32) |
+         ((uint64_t)mac[2] << 24) | ((uint64_t)mac[3] << 16) |
+         ((uint64_t)mac[4] << 8) | (uint64_t)mac[5];
+}
+
+static unsigned int fdb_hash(uint64_t mac) {
+  return (mac * 0x9e3779b97f4a7c15ull) >> 52;
+}
+
+uint32_t fdb_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return ts.tv_sec;
+}
+
+// age - через сколько секунд без кадров от адреса запись устаревает, 0 -
+// записи не устаревают.
+int fdb_init(struct fdb_t* fdb, unsigned int age) {
+  fdb->age = age;
+  fdb->peer_count = 0;
+  fdb->rejected.logged = 0;
+  fdb->rejected.count = 0;
+  fdb->table = aligned_alloc(FDB_CACHE_LINE, FDB_SIZE * sizeof(*fdb->table));
+  fdb->seen = aligned_alloc(FDB_CACHE_LINE, FDB_SIZE * sizeof(*fdb->seen));
+  fdb->peers = calloc(FDB_MAX_PEERS, sizeof(*fdb->peers));
+  fdb->peer_seen = calloc(FDB_MAX_PEERS, sizeof(*fdb->peer_seen));
+  if (!fdb->table || !fdb->seen || !fdb->peers || !fdb->peer_seen) {
+    fprintf(stderr, "ERROR> %s malloc\n", __FUNCTION__);
+    free(fdb->table);
+    free(fdb->seen);
+    free(fdb->peers);
+    free(fdb->peer_seen);
+    fdb->table = NULL;
+    fdb->seen = NULL;
+    fdb->peers = NULL;
+    fdb->peer_seen = NULL;
+    return -1;
+  }
+  memset(fdb->table, 0, FDB_SIZE * sizeof(*fdb->table));
+  memset(fdb->seen, 0, FDB_SIZE * sizeof(*fdb->seen));
+  pthread_mutex_init(&fdb->lock, NULL);
+
+  return 0;
+}
+
+void fdb_free(struct fdb_t* fdb) {
+  if (!fdb->table) {
+    return;
+  }
+
+  pthread_mutex_destroy(&fdb->lock);
+  free(fdb->table);
+  free(fdb->seen);
+  free(fdb->peers);
+  free(fdb->peer_seen);
+  fdb->table = NULL;
+  fdb->seen = NULL;
+  fdb->peers = NULL;
+  fdb->peer_seen = NULL;
+}
+
+static bool fdb_peer_equal(const struct sockaddr_in* a,
+                           const struct sockaddr_in* b) {
+  return (a->sin_port == b->sin_port) &&
+         (a->sin_addr.s_addr == b->sin_addr.s_addr);
+}
+
+static int fdb_peer_find(const struct fdb_t* fdb,
+                         const struct sockaddr_in* addr,
+                         unsigned int count) {
+  for (unsigned int i = 0; i < count; i++) {
+    if (fdb_peer_equal(&fdb->peers[i], addr)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void fdb_peer_touch(struct fdb_t* fdb,
+                           unsigned int index,
+                           uint32_t now) {
+  if (__atomic_load_n(&fdb->peer_seen[index], __ATOMIC_RELAXED) != now) {
+    __atomic_store_n(&fdb->peer_seen[index], now, __ATOMIC_RELAXED);
+  }
+}
+
+bool fdb_peer_alive(const struct fdb_t* fdb, unsigned int index, uint32_t now) {
+  return now - __atomic_load_n(&fdb->peer_seen[index], __ATOMIC_RELAXED) <=
+         FDB_PEER_AGE;
+}
+
+// Записи пира, место которого заняли, перестают указывать на новый адрес:
+// номер пира обнуляется, MAC остается в цепочке проб до переобучения.
+static void fdb_forget_peer(struct fdb_t* fdb, unsigned int peer) {
+  for (unsigned int i = 0; i < FDB_SIZE; i++) {
+    uint64_t current = __atomic_load_n(&fdb->table[i], __ATOMIC_RELAXED);
+    if (current && ((current & 0xffff) == peer + 1)) {
+      __atomic_compare_exchange_n(&fdb->table[i], &current,
+                                  current & ~0xffffull, false,
+                                  __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+    }
+  }
+}
+
+static int fdb_peer_slot(struct fdb_t* fdb, uint32_t now) {
+  if (fdb->peer_count < FDB_MAX_PEERS) {
+    return fdb->peer_count;
+  }
+  for (unsigned int i = 0; i < FDB_MAX_PEERS; i++) {
+    if (!fdb_peer_alive(fdb, i, now)) {
+      return i;
+    }
+  }
+
+  return -1;
+}
+
+static void fdb_peer_log(const char* format, const struct sockaddr_in* addr) {
+  char name[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &addr->sin_addr, name, sizeof(name));
+  fprintf(stderr, format, name, ntohs(addr->sin_port));
+}
+
+// Отказы печатаются не чаще раза в секунду, с числом отказов с прошлой
+// строки.
+static void fdb_peer_reject(struct fdb_t* fdb,
+                            const struct sockaddr_in* addr) {
+  uint64_t rejected = stats_limit(&fdb->rejected);
+  if (!rejected) {
+    return;
+  }
+
+  char name[INET_ADDRSTRLEN];
+  inet_ntop(AF_INET, &addr->sin_addr, name, sizeof(name));
+  fprintf(stderr,
+          "ERROR> %s too many clients, %s:%d rejected (%" PRIu64
+          " datagrams)\n",
+          __FUNCTION__, name, ntohs(addr->sin_port), rejected);
+}
+
+// hint - номер пира, от которого пришла предыдущая датаграмма, обычно он же.
+// Место нового пира - свободное или молчащего дольше FDB_PEER_AGE. Адрес
+// занятого заново места читатели без блокировки могут увидеть наполовину
+// записанным, но к нему уже FDB_PEER_AGE секунд ничего не отправлялось.
+int fdb_peer(struct fdb_t* fdb, const struct sockaddr_in* addr, int hint) {
+  uint32_t now = fdb_now();
+  unsigned int count = fdb_peer_count(fdb);
+  if ((hint >= 0) && ((unsigned int)hint < count) &&
+      fdb_peer_equal(&fdb->peers[hint], addr)) {
+    fdb_peer_touch(fdb, hint, now);
+    return hint;
+  }
+
+  int index = fdb_peer_find(fdb, addr, count);
+  if (index != -1) {
+    fdb_peer_touch(fdb, index, now);
+    return index;
+  }
+
+  pthread_mutex_lock(&fdb->lock);
+  count = fdb->peer_count;
+  index = fdb_peer_find(fdb, addr, count);
+  if (index == -1) {
+    index = fdb_peer_slot(fdb, now);
+    if (index != -1) {
+      if ((unsigned int)index < count) {
+        fdb_forget_peer(fdb, index);
+        fdb_peer_log("client %s:%d expired\n", &fdb->peers[index]);
+      }
+      fdb->peers[index] = *addr;
+      __atomic_store_n(&fdb->peer_seen[index], now, __ATOMIC_RELAXED);
+      if ((unsigned int)index == count) {
+        __atomic_store_n(&fdb->peer_count, count + 1, __ATOMIC_RELEASE);
+      }
+      fdb_peer_log("client %s:%d connected\n", addr);
+    }
+  } else {
+    fdb_peer_touch(fdb, index, now);
+  }
+  pthread_mutex_unlock(&fdb->lock);
+
+  if (index == -1) {
+    fdb_peer_reject(fdb, addr);
+  }
+
+  return index;
+}
+
+unsigned int fdb_peer_count(const struct fdb_t* fdb) {
+  return __atomic_load_n(&fdb->peer_count, __ATOMIC_ACQUIRE);
+}
+
+const struct sockaddr_in* fdb_peer_addr(const struct fdb_t* fdb,
+                                        unsigned int index) {
+  return &fdb->peers[index];
+}
+
+static bool fdb_expired(const struct fdb_t* fdb,
+                        unsigned int index,
+                        uint32_t now) {
+  return fdb->age &&
+         (now - __atomic_load_n(&fdb->seen[index], __ATOMIC_RELAXED) >
+          fdb->age);
+}
+
+static void fdb_touch(struct fdb_t* fdb, unsigned int index, uint32_t now) {
+  // Время пишется только при смене секунды, чтобы не гонять кеш линию между
+  // потоками на каждом кадре.
+  if (!fdb->age) {
+    return;
+  }
+  if (__atomic_load_n(&fdb->seen[index], __ATOMIC_RELAXED) != now) {
+    __atomic_store_n(&fdb->seen[index], now, __ATOMIC_RELAXED);
+  }
+}
+
+// Пробы идут подряд по одной-двум кеш линиям. Если в окне проб нет места,
+// адрес не запоминается и кадры к нему рассылаются всем.
+void fdb_learn(struct fdb_t* fdb, const uint8_t* mac, unsigned int peer) {
+  if (mac[0] & 1) {
+    return;
+  }
+
+  uint32_t now = fdb->age ? fdb_now() : 0;
+  uint64_t key = fdb_mac(mac);
+  uint64_t entry = (key << 16) | (peer + 1);
+  unsigned int hash = fdb_hash(key);
+  int free_index = -1;
+  uint64_t free_current = 0;
+  for (unsigned int i = 0; i < FDB_PROBES; i++) {
+    unsigned int index = (hash + i) & (FDB_SIZE - 1);
+    uint64_t current = __atomic_load_n(&fdb->table[index], __ATOMIC_RELAXED);
+    if (current && ((current >> 16) == key)) {
+      fdb_touch(fdb, index, now);
+      if (current != entry) {
+        __atomic_compare_exchange_n(&fdb->table[index], &current, entry, false,
+                                    __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+      }
+      return;
+    }
+    if ((free_index == -1) && (!current || fdb_expired(fdb, index, now))) {
+      free_index = index;
+      free_current = current;
+    }
+    if (!current) {
+      break;
+    }
+  }
+
+  if (free_index == -1) {
+    return;
+  }
+  fdb_touch(fdb, free_index, now);
+  __atomic_compare_exchange_n(&fdb->table[free_index], &free_current, entry,
+                              false, __ATOMIC_RELEASE, __ATOMIC_RELAXED);
+}
+
+int fdb_lookup(const struct fdb_t* fdb, const uint8_t* mac) {
+  if (mac[0] & 1) {
+    return -1;
+  }
+
+  uint64_t key = fdb_mac(mac);
+  unsigned int hash = fdb_hash(key);
+  for (unsigned int i = 0; i < FDB_PROBES; i++) {
+    unsigned int index = (hash + i) & (FDB_SIZE - 1);
+    uint64_t current = __atomic_load_n(&fdb->table[index], __ATOMIC_ACQUIRE);
+    if (!current) {
+      return -1;
+    }
+    if ((current >> 16) == key) {
+      if (fdb->age && fdb_expired(fdb, index, fdb_now())) {
+        return -1;
+      }
+      return (int)(current & 0xffff) - 1;
+    }
+  }
+
+  return -1;
+}
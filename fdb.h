@@ -0,0 +1,48 @@
+#ifndef BRIDGE_FDB_H
+#define BRIDGE_FDB_H
+
+#include "stats.h"
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FDB_MAX_PEERS 256
+#define FDB_SIZE 4096
+#define FDB_PROBES 8
+#define FDB_AGE 300
+// Через сколько секунд без датаграмм место пира может занять новый пир.
+#define FDB_PEER_AGE 300
+
+// Запись таблицы одно 64 битное слово: MAC в старших 48 битах и номер пира
+// плюс один в младших 16, поэтому читается и обновляется атомарно без
+// блокировок. Устаревшие записи не удаляются, а занимаются новыми адресами
+// при обучении. Место пира, молчащего FDB_PEER_AGE секунд, отдается новому
+// пиру, записи старого при этом забываются (номер пира 0).
+struct fdb_t {
+  uint64_t* table;
+  uint32_t* seen;
+  unsigned int age;
+  struct sockaddr_in* peers;
+  uint32_t* peer_seen;
+  unsigned int peer_count;
+  struct stats_limit_t rejected;
+  pthread_mutex_t lock;
+};
+
+int fdb_init(struct fdb_t* fdb, unsigned int age);
+void fdb_free(struct fdb_t* fdb);
+
+int fdb_peer(struct fdb_t* fdb, const struct sockaddr_in* addr, int hint);
+unsigned int fdb_peer_count(const struct fdb_t* fdb);
+bool fdb_peer_alive(const struct fdb_t* fdb, unsigned int index, uint32_t now);
+uint32_t fdb_now(void);
+const struct sockaddr_in* fdb_peer_addr(const struct fdb_t* fdb,
+                                        unsigned int index);
+
+void fdb_learn(struct fdb_t* fdb, const uint8_t* mac, unsigned int peer);
+int fdb_lookup(const struct fdb_t* fdb, const uint8_t* mac);
+
+#endif  // BRIDGE_FDB_H
@@ -0,0 +1,179 @@
+#include "filter.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define FILTER_ETHERTYPE 12
+#define FILTER_SOURCE 6
+#define FILTER_VLAN_MASK 0x0fff
+#define FILTER_ACCEPT 0xffffffff
+
+void filter_config_default(struct filter_config_t* config) {
+  memset(config, 0, sizeof(*config));
+}
+
+bool filter_empty(const struct filter_config_t* config) {
+  return !config->ethertype_count && !config->vlan_count && !config->mac_count;
+}
+
+// Список через запятую, каждое значение не больше max.
+static int filter_parse_list(const char* list,
+                             int base,
+                             unsigned long max,
+                             uint16_t* values,
+                             unsigned int* count) {
+  const char* item = list;
+  while (*item) {
+    char* end = NULL;
+    unsigned long value = strtoul(item, &end, base);
+    if ((end == item) || ((*end != ',') && *end) || (value > max) ||
+        (*count >= FILTER_MAX_ITEMS)) {
+      fprintf(stderr, "ERROR> %s incorrect list %s\n", __FUNCTION__, list);
+      return -1;
+    }
+    values[(*count)++] = value;
+    item = *end ? end + 1 : end;
+  }
+
+  return 0;
+}
+
+int filter_parse_ethertypes(struct filter_config_t* config, const char* list) {
+  return filter_parse_list(list, 0, 0xffff, config->ethertypes,
+                           &config->ethertype_count);
+}
+
+int filter_parse_vlans(struct filter_config_t* config, const char* list) {
+  return filter_parse_list(list, 10, FILTER_VLAN_MASK, config->vlans,
+                           &config->vlan_count);
+}
+
+int filter_parse_macs(struct filter_config_t* config, const char* list) {
+  const char* item = list;
+  while (*item) {
+    uint8_t* mac = config->macs[config->mac_count];
+    int length = 0;
+    if ((config->mac_count >= FILTER_MAX_ITEMS) ||
+        (sscanf(item, "%2hhx:%2hhx:%2hhx:%2hhx:%2hhx:%2hhx%n", &mac[0],
+                &mac[1], &mac[2], &mac[3], &mac[4], &mac[5], &length) != 6) ||
+        ((item[length] != ',') && item[length])) {
+      fprintf(stderr, "ERROR> %s incorrect list %s\n", __FUNCTION__, list);
+      return -1;
+    }
+    config->mac_count++;
+    item += item[length] ? length + 1 : length;
+  }
+
+  return 0;
+}
+
+struct filter_program_t {
+  struct sock_filter* code;
+  unsigned int count;
+};
+
+static unsigned int filter_emit(struct filter_program_t* program,
+                                uint16_t op,
+                                uint32_t k) {
+  struct sock_filter insn = BPF_STMT(op, k);
+  program->code[program->count] = insn;
+  return program->count++;
+}
+
+static unsigned int filter_emit_jeq(struct filter_program_t* program,
+                                    uint32_t k) {
+  struct sock_filter insn = BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, k, 0, 0);
+  program->code[program->count] = insn;
+  return program->count++;
+}
+
+// Переход вперед с инструкции from на инструкцию to.
+static uint8_t filter_offset(unsigned int from, unsigned int to) {
+  return to - from - 1;
+}
+
+// Совпадение с любым значением переходит к следующему списку, иначе кадр
+// отбрасывается.
+static void filter_build_ethertypes(struct filter_program_t* program,
+                                    const struct filter_config_t* config) {
+  unsigned int jumps[FILTER_MAX_ITEMS];
+  filter_emit(program, BPF_LD | BPF_H | BPF_ABS, FILTER_ETHERTYPE);
+  for (unsigned int i = 0; i < config->ethertype_count; i++) {
+    jumps[i] = filter_emit_jeq(program, config->ethertypes[i]);
+  }
+  filter_emit(program, BPF_RET | BPF_K, 0);
+
+  for (unsigned int i = 0; i < config->ethertype_count; i++) {
+    program->code[jumps[i]].jt = filter_offset(jumps[i], program->count);
+  }
+}
+
+// Ядро снимает тег VLAN с кадра до захвата, номер читается из метаданных
+// пакета (SKF_AD_VLAN_TAG).
+static void filter_build_vlans(struct filter_program_t* program,
+                               const struct filter_config_t* config) {
+  unsigned int jumps[FILTER_MAX_ITEMS];
+  unsigned int count = 0;
+  bool untagged = false;
+  filter_emit(program, BPF_LD | BPF_W | BPF_ABS,
+              SKF_AD_OFF + SKF_AD_VLAN_TAG_PRESENT);
+  unsigned int present = filter_emit_jeq(program, 0);
+  filter_emit(program, BPF_LD | BPF_W | BPF_ABS, SKF_AD_OFF + SKF_AD_VLAN_TAG);
+  filter_emit(program, BPF_ALU | BPF_AND | BPF_K, FILTER_VLAN_MASK);
+  for (unsigned int i = 0; i < config->vlan_count; i++) {
+    if (config->vlans[i] == FILTER_UNTAGGED) {
+      untagged = true;
+      continue;
+    }
+    jumps[count++] = filter_emit_jeq(program, config->vlans[i]);
+  }
+  unsigned int drop = filter_emit(program, BPF_RET | BPF_K, 0);
+
+  for (unsigned int i = 0; i < count; i++) {
+    program->code[jumps[i]].jt = filter_offset(jumps[i], program->count);
+  }
+  program->code[present].jt =
+      filter_offset(present, untagged ? program->count : drop);
+}
+
+static void filter_build_macs(struct filter_program_t* program,
+                              const struct filter_config_t* config) {
+  unsigned int jumps[FILTER_MAX_ITEMS];
+  for (unsigned int i = 0; i < config->mac_count; i++) {
+    const uint8_t* mac = config->macs[i];
+    filter_emit(program, BPF_LD | BPF_W | BPF_ABS, FILTER_SOURCE);
+    unsigned int high = filter_emit_jeq(
+        program, ((uint32_t)mac[0] << 24) | ((uint32_t)mac[1] << 16) |
+                     ((uint32_t)mac[2] << 8) | mac[3]);
+    filter_emit(program, BPF_LD | BPF_H | BPF_ABS, FILTER_SOURCE + 4);
+    jumps[i] = filter_emit_jeq(program, ((uint32_t)mac[4] << 8) | mac[5]);
+    program->code[high].jf = filter_offset(high, program->count);
+  }
+  filter_emit(program, BPF_RET | BPF_K, 0);
+
+  for (unsigned int i = 0; i < config->mac_count; i++) {
+    program->code[jumps[i]].jt = filter_offset(jumps[i], program->count);
+  }
+}
+
+unsigned int filter_build(const struct filter_config_t* config,
+                          struct sock_filter* code) {
+  if (filter_empty(config)) {
+    return 0;
+  }
+
+  struct filter_program_t program = {code, 0};
+  if (config->ethertype_count) {
+    filter_build_ethertypes(&program, config);
+  }
+  if (config->vlan_count) {
+    filter_build_vlans(&program, config);
+  }
+  if (config->mac_count) {
+    filter_build_macs(&program, config);
+  }
+  filter_emit(&program, BPF_RET | BPF_K, FILTER_ACCEPT);
+
+  return program.count;
+}
@@ -0,0 +1,37 @@
+#ifndef BRIDGE_FILTER_H
+#define BRIDGE_FILTER_H
+
+#include <inttypes.h>
+#include <linux/filter.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+#define FILTER_MAX_ITEMS 16
+// Наибольшая программа: все три списка заполнены.
+#define FILTER_MAX_CODE (9 + 7 * FILTER_MAX_ITEMS)
+// VLAN 0 в списке - кадры без тега.
+#define FILTER_UNTAGGED 0
+
+// Списки разрешенных значений захвата. Кадр проходит, если подходит под
+// каждый непустой список: EtherType (внутренний у кадров с тегом), номер
+// VLAN и MAC адрес источника. Пустые списки ничего не ограничивают.
+struct filter_config_t {
+  unsigned int ethertype_count;
+  uint16_t ethertypes[FILTER_MAX_ITEMS];
+  unsigned int vlan_count;
+  uint16_t vlans[FILTER_MAX_ITEMS];
+  unsigned int mac_count;
+  uint8_t macs[FILTER_MAX_ITEMS][6];
+};
+
+void filter_config_default(struct filter_config_t* config);
+bool filter_empty(const struct filter_config_t* config);
+int filter_parse_ethertypes(struct filter_config_t* config, const char* list);
+int filter_parse_vlans(struct filter_config_t* config, const char* list);
+int filter_parse_macs(struct filter_config_t* config, const char* list);
+// Программа cBPF для SO_ATTACH_FILTER, pcap_setfilter и TUNATTACHFILTER.
+// Возвращает количество инструкций, 0 если фильтр не нужен.
+unsigned int filter_build(const struct filter_config_t* config,
+                          struct sock_filter* code);
+
+#endif  // BRIDGE_FILTER_H
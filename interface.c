@@ -1,4 +1,6 @@
 #include "interface.h"
+#include "cpu.h"
+#include "stats.h"
 
 #include <inttypes.h>
 #include <net/if.h>
@@ -10,35 +12,48 @@
 #include <sys/types.h>
 #include <unistd.h>
 
-void inter_init(struct interface_bridge_t* inter,
-                const char* ifname,
-                clock_t timeout) {
-  strcpy(inter->name, ifname);
-  inter->timeout = timeout;
-  inter->pcap = NULL;
+void inter_config_default(struct inter_config_t* config) {
+  config->backend = INTER_BACKEND_PCAP;
+  config->timeout = 1;
+  config->tx_ring = false;
+  config->multi_queue = false;
+  afpacket_config_default(&config->afpacket);
+  filter_config_default(&config->filter);
+  pcapfile_config_default(&config->file);
 }
 
-void inter_close(struct interface_bridge_t* inter) {
-  if (inter->pcap) {
-    pcap_close(inter->pcap);
-    inter->pcap = NULL;
-  }
+static void inter_capture_init(struct interface_bridge_t* inter) {
+  char name[STATS_NAME_SIZE];
+  snprintf(name, sizeof(name), "%.32s.capture", inter->name);
+  inter->capture = latency_hist(name);
 }
 
-static int min(size_t x, size_t y) {
-  if (x <= y) {
-    return x;
+// pcap
+
+// Программа та же, что у AF_PACKET: libpcap на Linux передает ее ядру.
+// pcap_open_live уже принимает кадры, но libpcap сам выбрасывает те, что
+// пришли до фильтра: ставит фильтр, отбрасывающий все, вычитывает сокет и
+// фильтрует уже заполненные блоки кольца у себя.
+static int inter_pcap_filter(struct interface_bridge_t* inter,
+                             const struct sock_fprog* prog) {
+  struct bpf_program program = {prog->len, (struct bpf_insn*)prog->filter};
+  if (pcap_setfilter(inter->pcap, &program) < 0) {
+    fprintf(stderr, "ERROR> %s pcap_setfilter(%s) failed: %s\n", __FUNCTION__,
+            inter->name, pcap_geterr(inter->pcap));
+    return -1;
   }
-  return y;
+  return 0;
 }
 
-int inter_open(struct interface_bridge_t* inter) {
+static int inter_pcap_open(struct interface_bridge_t* inter,
+                           const struct sock_fprog* filter) {
   if (inter->pcap) {
     return 0;
   }
 
   char eb[PCAP_ERRBUF_SIZE];
-  inter->pcap = pcap_open_live(inter->name, 65535, 1, inter->timeout, eb);
+  inter->pcap =
+      pcap_open_live(inter->name, INTER_SNAPLEN, 1, inter->config.timeout, eb);
   if (inter->pcap == 0) {
     fprintf(stderr, "ERROR> %s pcap_open_live(%s) failed\n\t %s\n",
             __FUNCTION__, inter->name, eb);
@@ -48,49 +63,534 @@ int inter_open(struct interface_bridge_t* inter) {
   if (pcap_setdirection(inter->pcap, PCAP_D_IN) < 0) {
     fprintf(stderr, "ERROR> %s pcap_setdirection(%s) failed\n", __FUNCTION__,
             inter->name);
-    goto aborting;
+    pcap_close(inter->pcap);
+    inter->pcap = NULL;
+    return -1;
+  }
+
+  if (filter && (inter_pcap_filter(inter, filter) == -1)) {
+    pcap_close(inter->pcap);
+    inter->pcap = NULL;
+    return -1;
   }
 
+  inter_capture_init(inter);
   return 0;
+}
+
+static void inter_pcap_close(struct interface_bridge_t* inter) {
+  if (inter->pcap) {
+    pcap_close(inter->pcap);
+    inter->pcap = NULL;
+  }
+}
 
-aborting:
-  inter_close(inter);
-  return -1;
+struct inter_dispatch_t {
+  inter_handler_t handler;
+  void* user;
+  struct latency_hist_t* capture;
+};
+
+static void inter_dispatch_cb(u_char* user,
+                              const struct pcap_pkthdr* pkt_header,
+                              const u_char* pkt_data) {
+  struct inter_dispatch_t* dispatch = (struct inter_dispatch_t*)user;
+  if (pkt_header->caplen < pkt_header->len) {
+    static struct stats_limit_t limit;
+    uint64_t count = stats_limit(&limit);
+    if (count) {
+      fprintf(stderr,
+              "ERROR> %s frame %u bytes truncated to %u (%" PRIu64
+              " frames)\n",
+              __FUNCTION__, pkt_header->len, pkt_header->caplen, count);
+    }
+    return;
+  }
+  if (dispatch->capture) {
+    latency_record_wall(dispatch->capture, pkt_header->ts.tv_sec,
+                        pkt_header->ts.tv_usec * 1000ull);
+  }
+  dispatch->handler(dispatch->user, pkt_data, pkt_header->caplen);
 }
 
-int inter_read(struct interface_bridge_t* inter, uint8_t* bytes, size_t size) {
-  if (!inter->pcap || (bytes == 0) || (size == 0)) {
+// Таймаут ожидания у pcap задается при открытии (pcap_open_live).
+static int inter_pcap_dispatch(struct interface_bridge_t* inter,
+                               int count,
+                               int timeout,
+                               inter_handler_t handler,
+                               void* user) {
+  if (!inter->pcap) {
+    return -1;
+  }
+
+  struct inter_dispatch_t dispatch = {handler, user, inter->capture};
+  int ret = pcap_dispatch(inter->pcap, count, inter_dispatch_cb,
+                          (u_char*)&dispatch);
+  if (ret < 0) {
+    return -1;
+  }
+
+  return ret;
+}
+
+static int inter_pcap_write(struct interface_bridge_t* inter,
+                            const uint8_t* bytes,
+                            size_t size) {
+  if (!inter->pcap) {
+    return -1;
+  }
+
+  if (pcap_inject(inter->pcap, bytes, size) != (int)size) {
     return -1;
   }
 
-  struct pcap_pkthdr phdr;
-  struct pcap_pkthdr* pkt_header = &phdr;
-  const uint8_t* pkt_data = 0;
-  int ret = pcap_next_ex(inter->pcap, &pkt_header, &pkt_data);
-  if (ret == 0) {
+  return 0;
+}
+
+static int inter_pcap_get_fd(struct interface_bridge_t* inter) {
+  if (!inter->pcap) {
+    return -1;
+  }
+
+  return pcap_get_selectable_fd(inter->pcap);
+}
+
+static int inter_pcap_setnonblock(struct interface_bridge_t* inter) {
+  char eb[PCAP_ERRBUF_SIZE];
+  if (!inter->pcap || (pcap_setnonblock(inter->pcap, 1, eb) == -1)) {
+    fprintf(stderr, "ERROR> %s pcap_setnonblock(%s) failed\n\t %s\n",
+            __FUNCTION__, inter->name, inter->pcap ? eb : "not opened");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int inter_pcap_stats(struct interface_bridge_t* inter,
+                            uint64_t* received,
+                            uint64_t* dropped,
+                            uint64_t* ifdropped) {
+  struct pcap_stat ps;
+  if (!inter->pcap || (pcap_stats(inter->pcap, &ps) == -1)) {
+    return -1;
+  }
+
+  *received = ps.ps_recv;
+  *dropped = ps.ps_drop;
+  *ifdropped = ps.ps_ifdrop;
+  return 0;
+}
+
+static const struct inter_ops_t inter_pcap_ops = {
+    "pcap",
+    inter_pcap_open,
+    inter_pcap_close,
+    inter_pcap_dispatch,
+    inter_pcap_write,
+    inter_pcap_get_fd,
+    inter_pcap_setnonblock,
+    inter_pcap_stats,
+    true,
+};
+
+// afpacket
+
+static int inter_afpacket_open(struct interface_bridge_t* inter,
+                               const struct sock_fprog* filter) {
+  if (afpacket_open(&inter->afpacket, inter->name, &inter->config.afpacket,
+                    filter) == -1) {
+    fprintf(stderr, "ERROR> %s afpacket_open(%s) failed\n", __FUNCTION__,
+            inter->name);
+    return -1;
+  }
+
+  inter_capture_init(inter);
+  inter->afpacket.capture = inter->capture;
+  return 0;
+}
+
+static void inter_afpacket_close(struct interface_bridge_t* inter) {
+  afpacket_close(&inter->afpacket);
+}
+
+static int inter_afpacket_dispatch(struct interface_bridge_t* inter,
+                                   int count,
+                                   int timeout,
+                                   inter_handler_t handler,
+                                   void* user) {
+  return afpacket_dispatch(&inter->afpacket, count, timeout, handler, user);
+}
+
+static int inter_afpacket_write(struct interface_bridge_t* inter,
+                                const uint8_t* bytes,
+                                size_t size) {
+  return afpacket_write(&inter->afpacket, bytes, size);
+}
+
+static int inter_afpacket_get_fd(struct interface_bridge_t* inter) {
+  return inter->afpacket.fd;
+}
+
+static int inter_afpacket_stats(struct interface_bridge_t* inter,
+                                uint64_t* received,
+                                uint64_t* dropped,
+                                uint64_t* ifdropped) {
+  *ifdropped = 0;
+  return afpacket_stats(&inter->afpacket, received, dropped);
+}
+
+static const struct inter_ops_t inter_afpacket_ops = {
+    "afpacket",
+    inter_afpacket_open,
+    inter_afpacket_close,
+    inter_afpacket_dispatch,
+    inter_afpacket_write,
+    inter_afpacket_get_fd,
+    NULL,
+    inter_afpacket_stats,
+    true,
+};
+
+// tap: кадры читаются и пишутся в fd tap устройства, которое создает сам
+// мост.
+
+static int inter_tap_open(struct interface_bridge_t* inter,
+                          const struct sock_fprog* filter) {
+  return tap_open(&inter->tap, inter->name, inter->config.multi_queue,
+                  inter->config.afpacket.vnet_hdr, filter);
+}
+
+static void inter_tap_close(struct interface_bridge_t* inter) {
+  tap_close(&inter->tap);
+}
+
+static int inter_tap_dispatch(struct interface_bridge_t* inter,
+                              int count,
+                              int timeout,
+                              inter_handler_t handler,
+                              void* user) {
+  return tap_dispatch(&inter->tap, count, timeout, handler, user);
+}
+
+static int inter_tap_write(struct interface_bridge_t* inter,
+                           const uint8_t* bytes,
+                           size_t size) {
+  return tap_write(&inter->tap, bytes, size);
+}
+
+static int inter_tap_get_fd(struct interface_bridge_t* inter) {
+  return inter->tap.fd;
+}
+
+static const struct inter_ops_t inter_tap_ops = {
+    "tap",
+    inter_tap_open,
+    inter_tap_close,
+    inter_tap_dispatch,
+    inter_tap_write,
+    inter_tap_get_fd,
+    NULL,
+    NULL,
+    true,
+};
+
+// loop: провод в памяти процесса (loop.h), fd нет, поэтому работает только
+// с потоками и конвейером.
+
+static int inter_loop_open(struct interface_bridge_t* inter,
+                           const struct sock_fprog* filter) {
+  return loop_open(&inter->loop, inter->name);
+}
+
+static void inter_loop_close(struct interface_bridge_t* inter) {
+  loop_close(&inter->loop);
+}
+
+static int inter_loop_dispatch(struct interface_bridge_t* inter,
+                               int count,
+                               int timeout,
+                               inter_handler_t handler,
+                               void* user) {
+  return loop_dispatch(&inter->loop, count, timeout, handler, user);
+}
+
+static int inter_loop_write(struct interface_bridge_t* inter,
+                            const uint8_t* bytes,
+                            size_t size) {
+  return loop_write(&inter->loop, bytes, size);
+}
+
+static int inter_loop_stats(struct interface_bridge_t* inter,
+                            uint64_t* received,
+                            uint64_t* dropped,
+                            uint64_t* ifdropped) {
+  *ifdropped = 0;
+  loop_stats(&inter->loop, received, dropped);
+  return 0;
+}
+
+static const struct inter_ops_t inter_loop_ops = {
+    "loop",
+    inter_loop_open,
+    inter_loop_close,
+    inter_loop_dispatch,
+    inter_loop_write,
+    NULL,
+    NULL,
+    inter_loop_stats,
+    false,
+};
+
+// file: проигрывание и запись файлов pcap (pcapfile.h). Как у loop, fd нет:
+// только потоки и конвейер.
+
+static int inter_file_open(struct interface_bridge_t* inter,
+                           const struct sock_fprog* filter) {
+  return pcapfile_open(&inter->file, inter->name, &inter->config.file);
+}
+
+static void inter_file_close(struct interface_bridge_t* inter) {
+  pcapfile_close(&inter->file);
+}
+
+static int inter_file_dispatch(struct interface_bridge_t* inter,
+                               int count,
+                               int timeout,
+                               inter_handler_t handler,
+                               void* user) {
+  return pcapfile_dispatch(&inter->file, count, timeout, handler, user);
+}
+
+static int inter_file_write(struct interface_bridge_t* inter,
+                            const uint8_t* bytes,
+                            size_t size) {
+  return pcapfile_write(&inter->file, bytes, size);
+}
+
+static int inter_file_stats(struct interface_bridge_t* inter,
+                            uint64_t* received,
+                            uint64_t* dropped,
+                            uint64_t* ifdropped) {
+  *ifdropped = 0;
+  pcapfile_stats(&inter->file, received, dropped);
+  return 0;
+}
+
+static const struct inter_ops_t inter_file_ops = {
+    "file",
+    inter_file_open,
+    inter_file_close,
+    inter_file_dispatch,
+    inter_file_write,
+    NULL,
+    NULL,
+    inter_file_stats,
+    false,
+};
+
+static const struct inter_ops_t* inter_ops(enum inter_backend_t backend) {
+  switch (backend) {
+    case INTER_BACKEND_AFPACKET:
+      return &inter_afpacket_ops;
+    case INTER_BACKEND_TAP:
+      return &inter_tap_ops;
+    case INTER_BACKEND_LOOP:
+      return &inter_loop_ops;
+    case INTER_BACKEND_FILE:
+      return &inter_file_ops;
+    default:
+      return &inter_pcap_ops;
+  }
+}
+
+void inter_init(struct interface_bridge_t* inter,
+                const char* ifname,
+                const struct inter_config_t* config) {
+  strcpy(inter->name, ifname);
+  inter->config = *config;
+  inter->ops = inter_ops(config->backend);
+  inter->nonblock = false;
+  inter->capture = NULL;
+  switch (config->backend) {
+    case INTER_BACKEND_AFPACKET:
+      afpacket_init(&inter->afpacket);
+      break;
+    case INTER_BACKEND_TAP:
+      tap_init(&inter->tap);
+      break;
+    case INTER_BACKEND_LOOP:
+      loop_init(&inter->loop);
+      break;
+    case INTER_BACKEND_FILE:
+      pcapfile_init(&inter->file);
+      break;
+    default:
+      inter->pcap = NULL;
+      break;
+  }
+  afpacket_tx_init(&inter->tx);
+}
+
+void inter_close(struct interface_bridge_t* inter) {
+  inter->ops->close(inter);
+  afpacket_tx_close(&inter->tx);
+}
+
+static int inter_open_tx(struct interface_bridge_t* inter) {
+  if (!inter->config.tx_ring) {
     return 0;
   }
 
-  if (ret < 0) {
+  if (afpacket_tx_open(&inter->tx, inter->name, &inter->config.afpacket) ==
+      -1) {
+    fprintf(stderr, "ERROR> %s afpacket_tx_open(%s) failed\n", __FUNCTION__,
+            inter->name);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Счетчики ядра: сколько кадров сокет захвата принял и сколько потеряно из-за
+// переполнения кольца или буфера.
+static void inter_report(void* user, FILE* out) {
+  struct interface_bridge_t* inter = user;
+  uint64_t received = 0;
+  uint64_t dropped = 0;
+  uint64_t ifdropped = 0;
+
+  if (!inter->ops->stats ||
+      (inter->ops->stats(inter, &received, &dropped, &ifdropped) == -1)) {
+    return;
+  }
+
+  fprintf(out,
+          "%s.kernel received %" PRIu64 " dropped %" PRIu64
+          " ifdropped %" PRIu64 "\n",
+          inter->name, received, dropped, ifdropped);
+  if (inter->config.backend == INTER_BACKEND_AFPACKET) {
+    fprintf(out, "%s.skipped %" PRIu64 "\n", inter->name,
+            __atomic_load_n(&inter->afpacket.skipped, __ATOMIC_RELAXED));
+  }
+}
+
+int inter_open(struct interface_bridge_t* inter) {
+  if (inter->config.afpacket.vnet_hdr &&
+      (inter->config.backend != INTER_BACKEND_AFPACKET) &&
+      (inter->config.backend != INTER_BACKEND_TAP)) {
+    fprintf(stderr, "ERROR> %s virtio_net_hdr requires afpacket or tap\n",
+            __FUNCTION__);
+    return -1;
+  }
+
+  // Кадры, не прошедшие фильтр, отбрасываются в ядре и не копируются в
+  // кольцо или буфер захвата.
+  struct sock_filter code[FILTER_MAX_CODE];
+  struct sock_fprog prog = {filter_build(&inter->config.filter, code), code};
+  if (prog.len && !inter->ops->filters) {
+    fprintf(stderr, "ERROR> %s %s backend has no capture filters\n",
+            __FUNCTION__, inter->ops->name);
+    return -1;
+  }
+
+  if (inter->ops->open(inter, prog.len ? &prog : NULL) == -1) {
+    return -1;
+  }
+  cpu_socket(inter_get_fd(inter));
+
+  if (inter_open_tx(inter) == -1) {
+    inter_close(inter);
     return -1;
   }
 
-  int bytes_count = min((size_t)pkt_header->len, size);
-  memcpy(bytes, pkt_data, bytes_count);
+  stats_source(inter_report, inter);
+  return 0;
+}
+
+static int inter_timeout(struct interface_bridge_t* inter) {
+  return inter->nonblock ? 0 : inter->config.timeout;
+}
+
+struct inter_buffer_t {
+  uint8_t* bytes;
+  size_t size;
+  int count;
+};
 
-  return bytes_count;
+// Кадр, который не влезает в буфер, отбрасывается, а не обрезается.
+static void inter_copy_cb(void* user, const uint8_t* bytes, size_t size) {
+  struct inter_buffer_t* buffer = user;
+  if (size > buffer->size) {
+    fprintf(stderr, "ERROR> %s frame %zu bytes dropped, buffer %zu\n",
+            __FUNCTION__, size, buffer->size);
+    buffer->count = 0;
+    return;
+  }
+  buffer->count = size;
+  memcpy(buffer->bytes, bytes, size);
+}
+
+int inter_read(struct interface_bridge_t* inter, uint8_t* bytes, size_t size) {
+  if ((bytes == 0) || (size == 0)) {
+    return -1;
+  }
+
+  struct inter_buffer_t buffer = {bytes, size, 0};
+  int ret = inter->ops->dispatch(inter, 1, inter_timeout(inter), inter_copy_cb,
+                                 &buffer);
+  if (ret <= 0) {
+    return ret;
+  }
+  return buffer.count;
+}
+
+int inter_dispatch(struct interface_bridge_t* inter,
+                   int count,
+                   inter_handler_t handler,
+                   void* user) {
+  if (!handler) {
+    return -1;
+  }
+
+  return inter->ops->dispatch(inter, count, inter_timeout(inter), handler,
+                              user);
 }
 
 int inter_write(struct interface_bridge_t* inter,
                 const uint8_t* bytes,
                 size_t size) {
-  if (!inter->pcap || (bytes == 0) || (size == 0)) {
+  if ((bytes == 0) || (size == 0)) {
     return -1;
   }
 
-  if (pcap_inject(inter->pcap, bytes, size) != (int)size) {
+  if (inter->tx.map) {
+    if (afpacket_tx_fits(&inter->tx, size)) {
+      return afpacket_tx_write(&inter->tx, bytes, size);
+    }
+    // Кадр больше слота кольца уходит мимо него, после уже поставленных.
+    inter_flush(inter);
+  }
+
+  return inter->ops->write(inter, bytes, size);
+}
+
+int inter_flush(struct interface_bridge_t* inter) {
+  if (!inter->tx.map) {
+    return 0;
+  }
+
+  return afpacket_tx_flush(&inter->tx);
+}
+
+int inter_get_fd(struct interface_bridge_t* inter) {
+  return inter->ops->get_fd ? inter->ops->get_fd(inter) : -1;
+}
+
+int inter_setnonblock(struct interface_bridge_t* inter) {
+  if (inter->ops->setnonblock && (inter->ops->setnonblock(inter) == -1)) {
     return -1;
   }
 
+  inter->nonblock = true;
   return 0;
 }
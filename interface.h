@@ -1,23 +1,104 @@
 #ifndef BRIDGE_INTERFACE_H
 #define BRIDGE_INTERFACE_H
 
+#include "afpacket.h"
+#include "filter.h"
+#include "loop.h"
+#include "pcapfile.h"
+#include "tap.h"
+
 #include <pcap.h>
 
+#define INTER_BATCH_SIZE 64
+// Наибольший snaplen libpcap, кадры не обрезаются при любом MTU.
+#define INTER_SNAPLEN 262144
+
+typedef void (*inter_handler_t)(void* user, const uint8_t* bytes, size_t size);
+
+enum inter_backend_t {
+  INTER_BACKEND_PCAP,
+  INTER_BACKEND_AFPACKET,
+  INTER_BACKEND_TAP,
+  INTER_BACKEND_LOOP,
+  INTER_BACKEND_FILE,
+};
+
+struct inter_config_t {
+  enum inter_backend_t backend;
+  clock_t timeout;
+  bool tx_ring;
+  // tap: открыть очередь multiqueue устройства.
+  bool multi_queue;
+  struct afpacket_config_t afpacket;
+  struct filter_config_t filter;
+  struct pcapfile_config_t file;
+};
+
+struct interface_bridge_t;
+
+// Операции бэкенда интерфейса. dispatch ждет первый кадр не дольше timeout
+// миллисекунд и отдает обработчику не больше count кадров. get_fd и stats
+// могут отсутствовать (-1 и нет счетчиков ядра). open ставит фильтр захвата
+// filter (NULL - без фильтра) до того, как начнет принимать кадры; без
+// filters бэкенд фильтры не поддерживает и получает только NULL.
+struct inter_ops_t {
+  const char* name;
+  int (*open)(struct interface_bridge_t* inter,
+              const struct sock_fprog* filter);
+  void (*close)(struct interface_bridge_t* inter);
+  int (*dispatch)(struct interface_bridge_t* inter,
+                  int count,
+                  int timeout,
+                  inter_handler_t handler,
+                  void* user);
+  int (*write)(struct interface_bridge_t* inter,
+               const uint8_t* bytes,
+               size_t size);
+  int (*get_fd)(struct interface_bridge_t* inter);
+  int (*setnonblock)(struct interface_bridge_t* inter);
+  int (*stats)(struct interface_bridge_t* inter,
+               uint64_t* received,
+               uint64_t* dropped,
+               uint64_t* ifdropped);
+  bool filters;
+};
+
 struct interface_bridge_t {
   pthread_t thread;
   char name[255];
-  clock_t timeout;
-  struct pcap* pcap;
+  struct inter_config_t config;
+  const struct inter_ops_t* ops;
+  bool nonblock;
+  // Состояние бэкенда config.backend, его читают только операции ops.
+  union {
+    struct pcap* pcap;
+    struct afpacket_t afpacket;
+    struct tap_t tap;
+    struct loop_t loop;
+    struct pcapfile_t file;
+  };
+  struct afpacket_tx_t tx;
+  // От метки времени ядра до передачи кадра обработчику.
+  struct latency_hist_t* capture;
 };
 
+void inter_config_default(struct inter_config_t* config);
+
 void inter_init(struct interface_bridge_t* inter,
                 const char* ifname,
-                clock_t timeout);
+                const struct inter_config_t* config);
 void inter_close(struct interface_bridge_t* inter);
 int inter_open(struct interface_bridge_t* inter);
 int inter_read(struct interface_bridge_t* inter, uint8_t* bytes, size_t size);
+int inter_dispatch(struct interface_bridge_t* inter,
+                   int count,
+                   inter_handler_t handler,
+                   void* user);
 int inter_write(struct interface_bridge_t* inter,
                 const uint8_t* bytes,
                 size_t size);
+int inter_flush(struct interface_bridge_t* inter);
+int inter_get_fd(struct interface_bridge_t* inter);
+int inter_setnonblock(struct interface_bridge_t* inter);
 
 #endif  // BRIDGE_INTERFACE_H
@@ -0,0 +1,176 @@
+#include "latency.h"
+#include "stats.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define LATENCY_CALIBRATE_NS 20000000
+
+bool latency_enabled = false;
+
+struct latency_chunk_t {
+  struct latency_hist_t hists[LATENCY_CHUNK_HISTS];
+  char names[LATENCY_CHUNK_HISTS][LATENCY_NAME_SIZE];
+};
+
+// Блоки не перемещаются и не освобождаются: поток статистики читает их без
+// блокировки.
+static struct latency_chunk_t* latency_chunks[LATENCY_MAX_CHUNKS];
+static unsigned int latency_hist_count = 0;
+static pthread_mutex_t latency_lock = PTHREAD_MUTEX_INITIALIZER;
+// Наносекунд в такте счетчика latency_now.
+static double latency_tick_ns = 1.0;
+
+static uint64_t latency_clock_ns(clockid_t clock) {
+  struct timespec ts;
+  clock_gettime(clock, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Частота TSC не сообщается ядром напрямую, поэтому она меряется по
+// CLOCK_MONOTONIC на старте. Без TSC latency_now уже в наносекундах.
+static void latency_calibrate(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  uint64_t ns = latency_clock_ns(CLOCK_MONOTONIC);
+  uint64_t ticks = latency_now();
+  struct timespec pause = {0, LATENCY_CALIBRATE_NS};
+  nanosleep(&pause, NULL);
+  ns = latency_clock_ns(CLOCK_MONOTONIC) - ns;
+  ticks = latency_now() - ticks;
+  if (ticks) {
+    latency_tick_ns = (double)ns / ticks;
+  }
+#endif
+}
+
+static void latency_source(void* user, FILE* out) {
+  latency_dump(out);
+}
+
+// Включается до открытия мостов: ступени берут гистограммы при открытии.
+void latency_enable(void) {
+  if (latency_enabled) {
+    return;
+  }
+
+  latency_calibrate();
+  latency_enabled = true;
+  stats_source(latency_source, NULL);
+}
+
+// NULL, если замеры выключены или гистограммы кончились: ступень тогда не
+// ставит метки.
+struct latency_hist_t* latency_hist(const char* name) {
+  struct latency_hist_t* hist = NULL;
+  if (!latency_enabled) {
+    return NULL;
+  }
+
+  pthread_mutex_lock(&latency_lock);
+  unsigned int index = latency_hist_count;
+  unsigned int chunk = index / LATENCY_CHUNK_HISTS;
+  if ((chunk < LATENCY_MAX_CHUNKS) && !latency_chunks[chunk]) {
+    latency_chunks[chunk] =
+        aligned_alloc(LATENCY_CACHE_LINE, sizeof(struct latency_chunk_t));
+    if (latency_chunks[chunk]) {
+      memset(latency_chunks[chunk], 0, sizeof(struct latency_chunk_t));
+    }
+  }
+  if ((chunk < LATENCY_MAX_CHUNKS) && latency_chunks[chunk]) {
+    struct latency_chunk_t* hists = latency_chunks[chunk];
+    snprintf(hists->names[index % LATENCY_CHUNK_HISTS], LATENCY_NAME_SIZE,
+             "%s", name);
+    hist = &hists->hists[index % LATENCY_CHUNK_HISTS];
+    __atomic_store_n(&latency_hist_count, index + 1, __ATOMIC_RELEASE);
+  } else {
+    fprintf(stderr, "WARNING> %s no memory for histogram, %s not measured\n",
+            __FUNCTION__, name);
+  }
+  pthread_mutex_unlock(&latency_lock);
+
+  return hist;
+}
+
+void latency_record_wall(struct latency_hist_t* hist,
+                         uint64_t sec,
+                         uint64_t nsec) {
+  if (!hist) {
+    return;
+  }
+
+  uint64_t stamp = sec * 1000000000ull + nsec;
+  uint64_t now = latency_clock_ns(CLOCK_REALTIME);
+  latency_add(hist, (now > stamp) ? (now - stamp) / latency_tick_ns : 0);
+}
+
+// Наибольшее значение интервала, как highest equivalent value в HdrHistogram.
+static uint64_t latency_bucket_value(unsigned int index) {
+  if (index < LATENCY_SUB) {
+    return index;
+  }
+
+  unsigned int shift = index / LATENCY_SUB - 1;
+  uint64_t low = (uint64_t)(LATENCY_SUB + index % LATENCY_SUB) << shift;
+  return low + ((1ull << shift) - 1);
+}
+
+static uint64_t latency_ns(uint64_t ticks) {
+  return ticks * latency_tick_ns;
+}
+
+// Перцентили по снимку интервалов: гистограмма меняется во время чтения,
+// поэтому сумма считается по самим интервалам, а не по count.
+void latency_summary(const struct latency_hist_t* hist,
+                     struct latency_summary_t* summary) {
+  static const unsigned int quantiles[] = {500, 990, 999};
+  uint64_t buckets[LATENCY_BUCKETS];
+  uint64_t total = 0;
+  for (unsigned int i = 0; i < LATENCY_BUCKETS; i++) {
+    buckets[i] = __atomic_load_n(&hist->buckets[i], __ATOMIC_RELAXED);
+    total += buckets[i];
+  }
+
+  // Верхняя граница интервала может быть больше самого большого значения.
+  uint64_t max = __atomic_load_n(&hist->max, __ATOMIC_RELAXED);
+  uint64_t values[3] = {0, 0, 0};
+  uint64_t seen = 0;
+  unsigned int next = 0;
+  for (unsigned int i = 0; (i < LATENCY_BUCKETS) && (next < 3); i++) {
+    seen += buckets[i];
+    while ((next < 3) && total &&
+           (seen * 1000 >= total * quantiles[next])) {
+      uint64_t value = latency_bucket_value(i);
+      values[next++] = (value < max) ? value : max;
+    }
+  }
+
+  summary->count = total;
+  summary->p50 = latency_ns(values[0]);
+  summary->p99 = latency_ns(values[1]);
+  summary->p999 = latency_ns(values[2]);
+  summary->max = latency_ns(max);
+}
+
+static void latency_report(const struct latency_hist_t* hist,
+                           const char* name,
+                           FILE* out) {
+  struct latency_summary_t summary;
+  latency_summary(hist, &summary);
+  fprintf(out,
+          "%s.latency count %" PRIu64 " p50 %" PRIu64 " p99 %" PRIu64
+          " p999 %" PRIu64 " max %" PRIu64 " ns\n",
+          name, summary.count, summary.p50, summary.p99, summary.p999,
+          summary.max);
+}
+
+void latency_dump(FILE* out) {
+  unsigned int count =
+      __atomic_load_n(&latency_hist_count, __ATOMIC_ACQUIRE);
+  for (unsigned int i = 0; i < count; i++) {
+    const struct latency_chunk_t* chunk =
+        latency_chunks[i / LATENCY_CHUNK_HISTS];
+    unsigned int index = i % LATENCY_CHUNK_HISTS;
+    latency_report(&chunk->hists[index], chunk->names[index], out);
+  }
+}
@@ -0,0 +1,103 @@
+#ifndef BRIDGE_LATENCY_H
+#define BRIDGE_LATENCY_H
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+#define LATENCY_CACHE_LINE 64
+// Гистограммы выделяются блоками по мере открытия ступеней, в режиме
+// daemon их число растет с числом мостов.
+#define LATENCY_CHUNK_HISTS 64
+#define LATENCY_MAX_CHUNKS 256
+#define LATENCY_NAME_SIZE 48
+// Интервалы делятся на степени двойки, каждая степень еще на 16 частей:
+// погрешность значения не больше 1/16.
+#define LATENCY_SUB_BITS 4
+#define LATENCY_SUB (1 << LATENCY_SUB_BITS)
+#define LATENCY_BUCKETS ((64 - LATENCY_SUB_BITS + 1) * LATENCY_SUB)
+
+// Гистограмма задержек одной ступени в тактах TSC (как в HdrHistogram,
+// с логарифмическими интервалами). Пишет один поток без атомарных
+// сложений, читает поток статистики.
+struct latency_hist_t {
+  uint64_t count;
+  uint64_t max;
+  uint64_t buckets[LATENCY_BUCKETS];
+} __attribute__((aligned(LATENCY_CACHE_LINE)));
+
+// Перцентили гистограммы в наносекундах.
+struct latency_summary_t {
+  uint64_t count;
+  uint64_t p50;
+  uint64_t p99;
+  uint64_t p999;
+  uint64_t max;
+};
+
+extern bool latency_enabled;
+
+void latency_enable(void);
+struct latency_hist_t* latency_hist(const char* name);
+void latency_summary(const struct latency_hist_t* hist,
+                     struct latency_summary_t* summary);
+void latency_dump(FILE* out);
+
+static inline uint64_t latency_now(void) {
+#if defined(__x86_64__) || defined(__i386__)
+  return __builtin_ia32_rdtsc();
+#else
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+#endif
+}
+
+// Метка времени кадра, 0 если замеры выключены.
+static inline uint64_t latency_stamp(void) {
+  return latency_enabled ? latency_now() : 0;
+}
+
+static inline uint64_t latency_start(const struct latency_hist_t* hist) {
+  return hist ? latency_now() : 0;
+}
+
+static inline unsigned int latency_bucket(uint64_t value) {
+  if (value < LATENCY_SUB) {
+    return value;
+  }
+
+  unsigned int magnitude = 63 - __builtin_clzll(value);
+  unsigned int shift = magnitude - LATENCY_SUB_BITS;
+  return (shift + 1) * LATENCY_SUB + ((value >> shift) & (LATENCY_SUB - 1));
+}
+
+static inline void latency_add(struct latency_hist_t* hist, uint64_t ticks) {
+  uint64_t* bucket = &hist->buckets[latency_bucket(ticks)];
+  __atomic_store_n(bucket, *bucket + 1, __ATOMIC_RELAXED);
+  __atomic_store_n(&hist->count, hist->count + 1, __ATOMIC_RELAXED);
+  if (ticks > hist->max) {
+    __atomic_store_n(&hist->max, ticks, __ATOMIC_RELAXED);
+  }
+}
+
+// Время от метки start до текущего момента.
+static inline void latency_record(struct latency_hist_t* hist,
+                                  uint64_t start) {
+  if (!hist || !start) {
+    return;
+  }
+
+  uint64_t now = latency_now();
+  latency_add(hist, (now > start) ? now - start : 0);
+}
+
+// Время от метки ядра (CLOCK_REALTIME) до текущего момента.
+void latency_record_wall(struct latency_hist_t* hist,
+                         uint64_t sec,
+                         uint64_t nsec);
+
+#endif  // BRIDGE_LATENCY_H
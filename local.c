@@ -1,111 +1,432 @@
 #include "local.h"
+#include "cpu.h"
 
 #include <inttypes.h>
+#include <linux/if_ether.h>
 #include <net/if.h>
 #include <netinet/in.h>
 #include <stdint.h>
+#include <string.h>
 #include <sys/ioctl.h>
 #include <sys/socket.h>
 #include <sys/types.h>
+#include <unistd.h>
 
-struct bridge_tunnel_t {
-  struct interface_bridge_t* inter_0;
-  struct interface_bridge_t* inter_1;
-  bool* terminated;
-};
-
-void* inter_swap_ptk(void* thread_data) {
-  struct bridge_tunnel_t* tunnel = thread_data;
-  struct interface_bridge_t* inter_0 = tunnel->inter_0;
-  struct interface_bridge_t* inter_1 = tunnel->inter_1;
-  bool* terminated = tunnel->terminated;
-  free(tunnel);
-
-  uint8_t buffer[64 * 1024];
-  size_t buffer_size = sizeof(buffer);
-  while (!*terminated) {
-    int bytes_count = inter_read(inter_0, buffer, buffer_size);
-    if (bytes_count == 0) {
-      continue;
+// Номера групп fanout выдаются на процесс: в режиме daemon мостов несколько.
+static unsigned int local_fanout_groups = 0;
+
+static bool local_pipeline(const struct local_bridge_t* bridge) {
+  return bridge->engine_config.type == ENGINE_PIPELINE;
+}
+
+static unsigned int local_worker_count(const struct local_bridge_t* bridge) {
+  return bridge->port_count * bridge->fanout;
+}
+
+// Обработчик порта index с тем же номером, что у обработчика ingress.
+static struct bridge_port_t* local_port(struct local_bridge_t* bridge,
+                                        unsigned int index,
+                                        const struct bridge_port_t* ingress) {
+  return &bridge->ports[index * bridge->fanout + ingress->worker];
+}
+
+// У каждого порта по кольцу от каждого другого порта, свой номер порт
+// пропускает.
+static struct ring_t* port_ring(struct bridge_port_t* port,
+                                const struct bridge_port_t* ingress) {
+  unsigned int index = ingress->index;
+  if (index > port->index) {
+    index--;
+  }
+  return &port->tx.rings[index];
+}
+
+static void port_tx_ptk(void* user, const uint8_t* bytes, size_t size) {
+  struct bridge_port_t* port = user;
+
+  uint64_t start = latency_start(port->inject);
+  int res = inter_write(&port->inter, bytes, size);
+  latency_record(port->inject, start);
+  if (res == -1) {
+    static struct stats_limit_t limit;
+    stats_error(port->tx_stats);
+    uint64_t count = stats_limit(&limit);
+    if (count) {
+      fprintf(stderr,
+              "ERROR> %s can't write interface %s (%" PRIu64 " frames)\n",
+              __FUNCTION__, port->inter.name, count);
+    }
+    return;
+  }
+  stats_add(port->tx_stats, size);
+}
+
+// В порт могут писать потоки всех остальных портов, поэтому запись и сброс
+// очереди порта идут под его мьютексом. В режиме pipeline кадр кладется в
+// кольцо порта, а пишет в порт только его поток отправки.
+static void port_write_ptk(struct bridge_port_t* ingress,
+                           struct bridge_port_t* port,
+                           const uint8_t* bytes,
+                           size_t size) {
+  if (local_pipeline(ingress->bridge)) {
+    struct ring_t* ring = port_ring(port, ingress);
+    if (!ingress->frame) {
+      ring_push(ring, bytes, size);
+    } else {
+      pool_ref(ingress->frame);
+      if (!ring_push_buffer(ring, ingress->frame)) {
+        pool_put(&ingress->cache, ingress->frame);
+      }
+    }
+    ingress->pending |= 1u << port->index;
+    return;
+  }
+
+  pthread_mutex_lock(&port->lock);
+  port_tx_ptk(port, bytes, size);
+  pthread_mutex_unlock(&port->lock);
+
+  ingress->pending |= 1u << port->index;
+}
+
+// Рассылаемый кадр копируется в буфер пула один раз и кладется ссылкой в
+// кольца всех портов. Если пула нет, он пуст или кадр больше буфера, кадр
+// копируется в каждое кольцо.
+static struct pool_buffer_t* port_frame(struct bridge_port_t* ingress,
+                                        const uint8_t* bytes,
+                                        size_t size) {
+  struct local_bridge_t* bridge = ingress->bridge;
+  if (!local_pipeline(bridge) || !bridge->pool.memory ||
+      (size > bridge->pool.buffer_size)) {
+    return NULL;
+  }
+
+  struct pool_buffer_t* buffer = pool_get(&ingress->cache);
+  if (buffer) {
+    memcpy(buffer->bytes, bytes, size);
+    buffer->size = size;
+  }
+  return buffer;
+}
+
+// Кадр к известному адресу уходит только в порт, за которым этот адрес,
+// и отбрасывается, если адрес за тем же портом, откуда кадр пришел.
+// Широковещательные и кадры к неизвестным адресам уходят во все порты.
+static void port_forward_ptk(void* user, const uint8_t* bytes, size_t size) {
+  struct bridge_port_t* ingress = user;
+  struct local_bridge_t* bridge = ingress->bridge;
+  stats_add(ingress->rx_stats, size);
+  if (size < ETH_HLEN) {
+    stats_drop(ingress->rx_stats);
+    return;
+  }
+
+  fdb_learn(&bridge->fdb, bytes + ETH_ALEN, ingress->index);
+
+  int index = fdb_lookup(&bridge->fdb, bytes);
+  if (index == (int)ingress->index) {
+    return;
+  }
+  if (index != -1) {
+    port_write_ptk(ingress, local_port(bridge, index, ingress), bytes, size);
+    return;
+  }
+
+  ingress->frame = port_frame(ingress, bytes, size);
+  for (unsigned int i = 0; i < bridge->port_count; i++) {
+    if (i != ingress->index) {
+      port_write_ptk(ingress, local_port(bridge, i, ingress), bytes, size);
     }
-    if (bytes_count == -1) {
-      fprintf(stderr, "ERROR> %s can't read interface %s\n", __FUNCTION__,
-              inter_0->name);
+  }
+  if (ingress->frame) {
+    pool_put(&ingress->cache, ingress->frame);
+    ingress->frame = NULL;
+  }
+}
+
+static void port_flush(struct bridge_port_t* ingress) {
+  struct local_bridge_t* bridge = ingress->bridge;
+
+  for (unsigned int i = 0; ingress->pending; i++) {
+    if (!(ingress->pending & (1u << i))) {
       continue;
     }
+    ingress->pending &= ~(1u << i);
 
-    int res = inter_write(inter_1, buffer, bytes_count);
+    struct bridge_port_t* port = local_port(bridge, i, ingress);
+    if (local_pipeline(bridge)) {
+      ring_notify(port_ring(port, ingress));
+      continue;
+    }
+    pthread_mutex_lock(&port->lock);
+    int res = inter_flush(&port->inter);
+    pthread_mutex_unlock(&port->lock);
     if (res == -1) {
-      fprintf(stderr, "ERROR> %s can't write interface %s\n", __FUNCTION__,
-              inter_1->name);
+      fprintf(stderr, "ERROR> %s can't flush interface %s\n", __FUNCTION__,
+              port->inter.name);
     }
   }
+}
+
+static int port_tx_flush(void* user) {
+  struct bridge_port_t* port = user;
+
+  if (inter_flush(&port->inter) == -1) {
+    fprintf(stderr, "ERROR> %s can't flush interface %s\n", __FUNCTION__,
+            port->inter.name);
+    return -1;
+  }
+
+  return 0;
+}
+
+static int port_swap_batch(void* user) {
+  struct bridge_port_t* port = user;
+
+  int count = inter_dispatch(&port->inter, INTER_BATCH_SIZE, port_forward_ptk,
+                             port);
+  if (count == -1) {
+    fprintf(stderr, "ERROR> %s can't read interface %s\n", __FUNCTION__,
+            port->inter.name);
+    return -1;
+  }
+
+  port_flush(port);
+
+  return count;
+}
+
+static void* port_swap_ptk(void* thread_data) {
+  struct bridge_port_t* port = thread_data;
+
+  while (!__atomic_load_n(&port->bridge->terminated, __ATOMIC_RELAXED)) {
+    port_swap_batch(port);
+  }
 
   return NULL;
 }
 
-struct local_bridge_t* local_bridge_new(const char* ifname_0,
-                                        const char* ifname_1,
-                                        clock_t timeout) {
+struct local_bridge_t* local_bridge_new(
+    const char** ifnames,
+    unsigned int count,
+    const struct inter_config_t* config,
+    const struct engine_config_t* engine_config,
+    unsigned int fdb_age) {
+  if ((count < 2) || (count > LOCAL_MAX_PORTS)) {
+    fprintf(stderr, "ERROR> %s expects 2..%d interfaces\n", __FUNCTION__,
+            LOCAL_MAX_PORTS);
+    return NULL;
+  }
+
+  unsigned int fanout = config->afpacket.fanout ? config->afpacket.fanout : 1;
+  if ((fanout > 1) && (config->backend != INTER_BACKEND_AFPACKET)) {
+    fprintf(stderr, "ERROR> %s fanout requires afpacket backend\n",
+            __FUNCTION__);
+    return NULL;
+  }
+
   struct local_bridge_t* bridge = malloc(sizeof(*bridge));
   if (!bridge) {
     fprintf(stderr, "ERROR> %s malloc\n", __FUNCTION__);
     return NULL;
   }
 
-  inter_init(&bridge->inter_0, ifname_0, timeout);
-  inter_init(&bridge->inter_1, ifname_1, timeout);
+  bridge->ports = calloc(count * fanout, sizeof(*bridge->ports));
+  if (!bridge->ports || (fdb_init(&bridge->fdb, fdb_age) == -1)) {
+    fprintf(stderr, "ERROR> %s malloc\n", __FUNCTION__);
+    free(bridge->ports);
+    free(bridge);
+    return NULL;
+  }
+
+  bridge->port_count = count;
+  bridge->fanout = fanout;
+  // Номер группы fanout общий для сокетов интерфейса и разный у
+  // интерфейсов и процессов.
+  unsigned int group =
+      getpid() +
+      __atomic_fetch_add(&local_fanout_groups, count, __ATOMIC_RELAXED);
+  struct inter_config_t port_config = *config;
+  char prefix[40];
+  char name[STATS_NAME_SIZE];
+  for (unsigned int i = 0; i < count * fanout; i++) {
+    struct bridge_port_t* port = &bridge->ports[i];
+    const char* ifname = ifnames[i / fanout];
+    port_config.afpacket.fanout_group = group + i / fanout;
+    inter_init(&port->inter, ifname, &port_config);
+    port->inter.thread = 0;
+    port->bridge = bridge;
+    port->index = i / fanout;
+    port->worker = i % fanout;
+    port->pending = 0;
+    pthread_mutex_init(&port->lock, NULL);
+    ring_reader_init(&port->tx);
+    if (fanout > 1) {
+      snprintf(prefix, sizeof(prefix), "%.24s.%u", ifname, port->worker);
+    } else {
+      snprintf(prefix, sizeof(prefix), "%.32s", ifname);
+    }
+    snprintf(name, sizeof(name), "%s.rx", prefix);
+    port->rx_stats = stats_counter(name);
+    snprintf(name, sizeof(name), "%s.tx", prefix);
+    port->tx_stats = stats_counter(name);
+    snprintf(name, sizeof(name), "%s.inject", prefix);
+    port->inject = latency_hist(name);
+    pool_cache_init(&port->cache, &bridge->pool);
+    port->frame = NULL;
+  }
+  bridge->pool.memory = NULL;
+  bridge->engine_config = *engine_config;
+  engine_init(&bridge->engine);
   bridge->terminated = false;
 
   return bridge;
 }
 
 void local_bridge_close(struct local_bridge_t* bridge) {
-  pthread_join(bridge->inter_0.thread, NULL);
-  pthread_join(bridge->inter_1.thread, NULL);
+  if (bridge->engine_config.type == ENGINE_EPOLL) {
+    engine_close(&bridge->engine);
+  } else {
+    for (unsigned int i = 0; i < local_worker_count(bridge); i++) {
+      if (bridge->ports[i].inter.thread) {
+        pthread_join(bridge->ports[i].inter.thread, NULL);
+      }
+    }
+  }
 
-  inter_close(&bridge->inter_0);
-  inter_close(&bridge->inter_1);
+  for (unsigned int i = 0; i < local_worker_count(bridge); i++) {
+    struct bridge_port_t* port = &bridge->ports[i];
+    if (port->tx.rings) {
+      ring_reader_stop(&port->tx);
+      ring_reader_report(&port->tx, stderr);
+      ring_reader_close(&port->tx);
+    }
+    inter_close(&port->inter);
+  }
 }
 
 void local_bridge_free(struct local_bridge_t* bridge) {
+  for (unsigned int i = 0; i < local_worker_count(bridge); i++) {
+    pthread_mutex_destroy(&bridge->ports[i].lock);
+  }
+  pool_free(&bridge->pool);
+  fdb_free(&bridge->fdb);
+  free(bridge->ports);
   free(bridge);
 }
 
 int local_bridge_open(struct local_bridge_t* bridge) {
-  int res = 0;
-  res = inter_open(&bridge->inter_0);
-  if (res == -1) {
-    fprintf(stderr, "ERROR> %s can't open interface %s\n", __FUNCTION__,
-            bridge->inter_0.name);
+  for (unsigned int i = 0; i < local_worker_count(bridge); i++) {
+    int res = inter_open(&bridge->ports[i].inter);
+    if (res == -1) {
+      fprintf(stderr, "ERROR> %s can't open interface %s\n", __FUNCTION__,
+              bridge->ports[i].inter.name);
+      return -1;
+    }
+  }
+
+  if (!local_pipeline(bridge)) {
+    return 0;
+  }
+
+  const struct engine_config_t* config = &bridge->engine_config;
+  if (config->pool_count &&
+      (pool_init(&bridge->pool, config->pool_count, config->pool_buffer_size,
+                 config->hugepages) == -1)) {
     return -1;
   }
-  res = inter_open(&bridge->inter_1);
-  if (res == -1) {
-    fprintf(stderr, "ERROR> %s can't open interface %s\n", __FUNCTION__,
-            bridge->inter_1.name);
+
+  for (unsigned int i = 0; i < local_worker_count(bridge); i++) {
+    struct bridge_port_t* port = &bridge->ports[i];
+    if (ring_reader_open(&port->tx, stats_name(port->tx_stats),
+                         bridge->port_count - 1,
+                         config->ring_size, port_tx_ptk, port_tx_flush, port,
+                         &bridge->pool) == -1) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+static int local_bridge_run_engine(struct local_bridge_t* bridge) {
+  struct engine_t* engine = &bridge->engine;
+  if (engine_open(engine, &bridge->engine_config) == -1) {
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < local_worker_count(bridge); i++) {
+    struct interface_bridge_t* inter = &bridge->ports[i].inter;
+    if ((inter_setnonblock(inter) == -1) ||
+        (engine_add(engine, inter_get_fd(inter), port_swap_batch,
+                    &bridge->ports[i]) == -1)) {
+      fprintf(stderr, "ERROR> %s can't poll interface %s\n", __FUNCTION__,
+              inter->name);
+      return -1;
+    }
+  }
+
+  return engine_run(engine);
+}
+
+int local_bridge_attach(struct local_bridge_t* bridge,
+                        struct worker_pool_t* pool) {
+  if (bridge->engine_config.type != ENGINE_THREADS) {
+    fprintf(stderr, "ERROR> %s engine is set by worker pool\n", __FUNCTION__);
     return -1;
   }
 
+  for (unsigned int i = 0; i < local_worker_count(bridge); i++) {
+    struct interface_bridge_t* inter = &bridge->ports[i].inter;
+    if ((inter_setnonblock(inter) == -1) ||
+        (worker_pool_add(pool, inter_get_fd(inter), port_swap_batch,
+                         &bridge->ports[i]) == -1)) {
+      fprintf(stderr, "ERROR> %s can't poll interface %s\n", __FUNCTION__,
+              inter->name);
+      return -1;
+    }
+  }
+
   return 0;
 }
 
-void local_bridge_run(struct local_bridge_t* bridge) {
-  struct bridge_tunnel_t* tunnel = malloc(sizeof(*tunnel));
-  tunnel->inter_0 = &bridge->inter_0;
-  tunnel->inter_1 = &bridge->inter_1;
-  tunnel->terminated = &bridge->terminated;
-  pthread_create(&bridge->inter_0.thread, NULL, inter_swap_ptk, tunnel);
+int local_bridge_run(struct local_bridge_t* bridge) {
+  if (bridge->engine_config.type == ENGINE_EPOLL) {
+    return local_bridge_run_engine(bridge);
+  }
+
+  // Потоки отправки запускаются раньше потоков захвата, которые кладут
+  // кадры в их кольца.
+  for (unsigned int i = 0;
+       local_pipeline(bridge) && (i < local_worker_count(bridge)); i++) {
+    if (ring_reader_run(&bridge->ports[i].tx) == -1) {
+      return -1;
+    }
+  }
 
-  tunnel = malloc(sizeof(*tunnel));
-  tunnel->inter_0 = &bridge->inter_1;
-  tunnel->inter_1 = &bridge->inter_0;
-  tunnel->terminated = &bridge->terminated;
-  pthread_create(&bridge->inter_1.thread, NULL, inter_swap_ptk, tunnel);
+  for (unsigned int i = 0; i < local_worker_count(bridge); i++) {
+    struct bridge_port_t* port = &bridge->ports[i];
+    if (pthread_create(&port->inter.thread, NULL, port_swap_ptk, port) != 0) {
+      fprintf(stderr, "ERROR> %s pthread_create %s\n", __FUNCTION__,
+              port->inter.name);
+      port->inter.thread = 0;
+      return -1;
+    }
+    char name[16];
+    snprintf(name, sizeof(name), "%.10s.%u", port->inter.name, port->worker);
+    cpu_place_thread(port->inter.thread, name);
+  }
+
+  return 0;
 }
 
+// Потоки портов не отменяются: поток, отмененный во время записи в чужой
+// порт, оставил бы мьютекс порта захваченным. Поток замечает terminated
+// после очередного inter_dispatch, который ждет не дольше таймаута
+// интерфейса, и local_bridge_close дожидается его в pthread_join.
 void local_bridge_stop(struct local_bridge_t* bridge) {
-  bridge->terminated = true;
-  pthread_cancel(bridge->inter_0.thread);
-  pthread_cancel(bridge->inter_1.thread);
+  __atomic_store_n(&bridge->terminated, true, __ATOMIC_RELAXED);
+  if (bridge->engine_config.type == ENGINE_EPOLL) {
+    engine_stop(&bridge->engine);
+  }
 }
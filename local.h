@@ -1,27 +1,66 @@
 #ifndef BRIDGE_H
 #define BRIDGE_H
 
+#include "engine.h"
+#include "fdb.h"
 #include "interface.h"
+#include "latency.h"
+#include "ring.h"
+#include "stats.h"
+#include "worker.h"
 
 #include <inttypes.h>
 #include <pthread.h>
 #include <stdbool.h>
 #include <stdlib.h>
 
+#define LOCAL_MAX_PORTS 32
+
+// Обработчик порта: с --fanout у порта несколько обработчиков, у каждого
+// свой сокет захвата в группе PACKET_FANOUT и свой путь отправки. Обработчик
+// worker одного порта пишет только в обработчики с тем же номером других
+// портов, поэтому кадры одного потока не обгоняют друг друга.
+struct bridge_port_t {
+  struct interface_bridge_t inter;
+  struct local_bridge_t* bridge;
+  unsigned int index;
+  unsigned int worker;
+  uint32_t pending;
+  pthread_mutex_t lock;
+  struct ring_reader_t tx;
+  struct pool_cache_t cache;
+  struct pool_buffer_t* frame;
+  struct stats_counter_t* rx_stats;
+  struct stats_counter_t* tx_stats;
+  struct latency_hist_t* inject;
+};
+
 struct local_bridge_t {
-  struct interface_bridge_t inter_0;
-  struct interface_bridge_t inter_1;
+  // port_count * fanout обработчиков, по порядку портов.
+  struct bridge_port_t* ports;
+  unsigned int port_count;
+  unsigned int fanout;
+  struct fdb_t fdb;
+  struct pool_t pool;
+  struct engine_config_t engine_config;
+  struct engine_t engine;
   bool terminated;
 };
 
-struct local_bridge_t* local_bridge_new(const char* ifname_0,
-                                        const char* ifname_1,
-                                        clock_t timeout);
+struct local_bridge_t* local_bridge_new(
+    const char** ifnames,
+    unsigned int count,
+    const struct inter_config_t* config,
+    const struct engine_config_t* engine_config,
+    unsigned int fdb_age);
 void local_bridge_close(struct local_bridge_t* bridge);
 void local_bridge_free(struct local_bridge_t* bridge);
 
 int local_bridge_open(struct local_bridge_t* bridge);
-void local_bridge_run(struct local_bridge_t* bridge);
+int local_bridge_run(struct local_bridge_t* bridge);
+// Порты моста обслуживает общий пул потоков вместо своих потоков.
+int local_bridge_attach(struct local_bridge_t* bridge,
+                        struct worker_pool_t* pool);
 void local_bridge_stop(struct local_bridge_t* bridge);
 
 #endif  // BRIDGE_H
@@ -0,0 +1,222 @@
+#include "loop.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define LOOP_RECORD 8
+#define LOOP_WRAP UINT32_MAX
+
+static struct loop_wire_t loop_wires[LOOP_MAX_WIRES];
+static pthread_mutex_t loop_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static size_t loop_record(size_t size) {
+  return LOOP_RECORD + ((size + LOOP_RECORD - 1) & ~(size_t)(LOOP_RECORD - 1));
+}
+
+static int loop_queue_init(struct loop_queue_t* queue) {
+  queue->bytes = malloc(LOOP_QUEUE_SIZE);
+  if (!queue->bytes) {
+    return -1;
+  }
+  queue->size = LOOP_QUEUE_SIZE;
+  queue->head = 0;
+  queue->tail = 0;
+  queue->written = 0;
+  queue->dropped = 0;
+  pthread_mutex_init(&queue->lock, NULL);
+
+  pthread_condattr_t attr;
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&queue->ready, &attr);
+  pthread_condattr_destroy(&attr);
+
+  return 0;
+}
+
+static void loop_queue_free(struct loop_queue_t* queue) {
+  if (!queue->bytes) {
+    return;
+  }
+  pthread_mutex_destroy(&queue->lock);
+  pthread_cond_destroy(&queue->ready);
+  free(queue->bytes);
+  queue->bytes = NULL;
+}
+
+void loop_init(struct loop_t* loop) {
+  loop->wire = NULL;
+  loop->rx = NULL;
+  loop->tx = NULL;
+}
+
+// Первый открывший имя получает конец 0, второй - конец 1. Очереди
+// создаются с проводом, поэтому в конец можно писать до того, как откроют
+// второй.
+int loop_open(struct loop_t* loop, const char* name) {
+  struct loop_wire_t* wire = NULL;
+  struct loop_wire_t* empty = NULL;
+  int res = -1;
+
+  pthread_mutex_lock(&loop_lock);
+  for (unsigned int i = 0; i < LOOP_MAX_WIRES; i++) {
+    struct loop_wire_t* candidate = &loop_wires[i];
+    if (candidate->ends && !strcmp(candidate->name, name)) {
+      wire = candidate;
+      break;
+    }
+    if (!candidate->ends && !empty) {
+      empty = candidate;
+    }
+  }
+
+  if (!wire && empty) {
+    wire = empty;
+    snprintf(wire->name, sizeof(wire->name), "%s", name);
+    if ((loop_queue_init(&wire->queues[0]) == -1) ||
+        (loop_queue_init(&wire->queues[1]) == -1)) {
+      fprintf(stderr, "ERROR> %s malloc %s\n", __FUNCTION__, name);
+      loop_queue_free(&wire->queues[0]);
+      loop_queue_free(&wire->queues[1]);
+      wire = NULL;
+    }
+  }
+
+  if (wire && (wire->ends != 3)) {
+    unsigned int end = (wire->ends & 1) ? 1 : 0;
+    wire->ends |= 1u << end;
+    loop->wire = wire;
+    loop->rx = &wire->queues[end];
+    loop->tx = &wire->queues[1 - end];
+    res = 0;
+  } else {
+    fprintf(stderr, "ERROR> %s no free end of %s\n", __FUNCTION__, name);
+  }
+  pthread_mutex_unlock(&loop_lock);
+
+  return res;
+}
+
+void loop_close(struct loop_t* loop) {
+  struct loop_wire_t* wire = loop->wire;
+  if (!wire) {
+    return;
+  }
+
+  pthread_mutex_lock(&loop_lock);
+  wire->ends &= ~(1u << (loop->rx - wire->queues));
+  if (!wire->ends) {
+    loop_queue_free(&wire->queues[0]);
+    loop_queue_free(&wire->queues[1]);
+  }
+  pthread_mutex_unlock(&loop_lock);
+
+  loop_init(loop);
+}
+
+// Кадр, для которого нет места, отбрасывается, как в очереди устройства.
+int loop_write(struct loop_t* loop, const uint8_t* bytes, size_t size) {
+  struct loop_queue_t* queue = loop->tx;
+  size_t record = loop_record(size);
+  if (!queue || (record > queue->size / 4)) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  size_t offset = queue->tail & (queue->size - 1);
+  size_t skip = (offset + record > queue->size) ? queue->size - offset : 0;
+  if (queue->tail + skip + record - queue->head > queue->size) {
+    queue->dropped++;
+    pthread_mutex_unlock(&queue->lock);
+    return -1;
+  }
+  if (skip) {
+    *(uint32_t*)(queue->bytes + offset) = LOOP_WRAP;
+    offset = 0;
+  }
+
+  *(uint32_t*)(queue->bytes + offset) = size;
+  memcpy(queue->bytes + offset + LOOP_RECORD, bytes, size);
+  bool empty = queue->tail == queue->head;
+  queue->tail += skip + record;
+  queue->written++;
+  if (empty) {
+    pthread_cond_signal(&queue->ready);
+  }
+  pthread_mutex_unlock(&queue->lock);
+
+  return 0;
+}
+
+static void loop_deadline(struct timespec* deadline, int timeout) {
+  clock_gettime(CLOCK_MONOTONIC, deadline);
+  deadline->tv_sec += timeout / 1000;
+  deadline->tv_nsec += (timeout % 1000) * 1000000l;
+  if (deadline->tv_nsec >= 1000000000l) {
+    deadline->tv_sec++;
+    deadline->tv_nsec -= 1000000000l;
+  }
+}
+
+// Читатель у очереди один: записи до tail не меняются, пока он не сдвинет
+// head, поэтому обработчики вызываются без мьютекса.
+int loop_dispatch(struct loop_t* loop,
+                  int count,
+                  int timeout,
+                  loop_handler_t handler,
+                  void* user) {
+  struct loop_queue_t* queue = loop->rx;
+  if (!queue || !handler) {
+    return -1;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  if ((queue->head == queue->tail) && (timeout > 0)) {
+    struct timespec deadline;
+    loop_deadline(&deadline, timeout);
+    while ((queue->head == queue->tail) &&
+           (pthread_cond_timedwait(&queue->ready, &queue->lock, &deadline) !=
+            ETIMEDOUT)) {
+    }
+  }
+  uint64_t tail = queue->tail;
+  pthread_mutex_unlock(&queue->lock);
+
+  uint64_t head = queue->head;
+  int processed = 0;
+  while ((head != tail) && (processed < count)) {
+    size_t offset = head & (queue->size - 1);
+    uint32_t size = *(const uint32_t*)(queue->bytes + offset);
+    if (size == LOOP_WRAP) {
+      head += queue->size - offset;
+      continue;
+    }
+    handler(user, queue->bytes + offset + LOOP_RECORD, size);
+    head += loop_record(size);
+    processed++;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  queue->head = head;
+  pthread_mutex_unlock(&queue->lock);
+
+  return processed;
+}
+
+// Сколько кадров записано в этот конец и сколько не влезло в его очередь.
+void loop_stats(struct loop_t* loop, uint64_t* received, uint64_t* dropped) {
+  struct loop_queue_t* queue = loop->rx;
+  *received = 0;
+  *dropped = 0;
+  if (!queue) {
+    return;
+  }
+
+  pthread_mutex_lock(&queue->lock);
+  *received = queue->written;
+  *dropped = queue->dropped;
+  pthread_mutex_unlock(&queue->lock);
+}
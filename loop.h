@@ -0,0 +1,56 @@
+#ifndef BRIDGE_LOOP_H
+#define BRIDGE_LOOP_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define LOOP_MAX_WIRES 64
+#define LOOP_NAME_SIZE 64
+#define LOOP_QUEUE_SIZE (4 << 20)
+
+typedef void (*loop_handler_t)(void* user, const uint8_t* bytes, size_t size);
+
+// Очередь кадров одного направления провода: кадры лежат подряд записями
+// переменной длины, позиции меняются под мьютексом, а байты кадров
+// читаются без него.
+struct loop_queue_t {
+  pthread_mutex_t lock;
+  pthread_cond_t ready;
+  uint8_t* bytes;
+  size_t size;
+  uint64_t head;
+  uint64_t tail;
+  uint64_t written;
+  uint64_t dropped;
+};
+
+// Провод в памяти процесса: два интерфейса с одним именем - два его конца,
+// кадр, записанный в один конец, читается из другого. Так мост гоняет
+// кадры без системных вызовов (замеры пересылки, FDB, упаковки).
+struct loop_wire_t {
+  char name[LOOP_NAME_SIZE];
+  unsigned int ends;
+  struct loop_queue_t queues[2];
+};
+
+struct loop_t {
+  struct loop_wire_t* wire;
+  struct loop_queue_t* rx;
+  struct loop_queue_t* tx;
+};
+
+void loop_init(struct loop_t* loop);
+int loop_open(struct loop_t* loop, const char* name);
+void loop_close(struct loop_t* loop);
+int loop_dispatch(struct loop_t* loop,
+                  int count,
+                  int timeout,
+                  loop_handler_t handler,
+                  void* user);
+int loop_write(struct loop_t* loop, const uint8_t* bytes, size_t size);
+void loop_stats(struct loop_t* loop, uint64_t* received, uint64_t* dropped);
+
+#endif  // BRIDGE_LOOP_H
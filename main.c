@@ -1,6 +1,11 @@
+#include "cpu.h"
+#include "daemon.h"
+#include "latency.h"
 #include "local.h"
 #include "remote.h"
+#include "stats.h"
 
+#include <getopt.h>
 #include <inttypes.h>
 #include <netinet/in.h>
 #include <signal.h>
@@ -12,8 +17,12 @@
 
 #define ADDR "localhost"
 #define PORT 8214
+#define DAEMON_MAX_ARGS 64
 
 static volatile bool terminated = 0;
+static const char* stats_path = NULL;
+static struct cpu_config_t cpu_config;
+static unsigned int daemon_workers = 0;
 
 void sigint_cb(int sig) {
   if (!terminated) {
@@ -27,12 +36,400 @@ static void signals_init(void) {
   sa_hup.sa_handler = sigint_cb;
   sa_hup.sa_flags = SA_RESTART;
   sigaction(SIGINT, &sa_hup, 0);
+
+  // Клиент статистики может закрыть сокет, не дочитав, - тогда запись
+  // вернет EPIPE, а не убьет процесс.
+  signal(SIGPIPE, SIG_IGN);
+}
+
+// Ждет SIGINT, пока работающий мост отдает статистику по --stats.
+static void wait_terminated(void) {
+  if (stats_path && (stats_open(stats_path) == -1)) {
+    fprintf(stderr, "WARNING> stats endpoint %s is not available\n",
+            stats_path);
+  }
+
+  while (!terminated) {
+    sleep(1);
+  }
+
+  stats_close();
+  if (latency_enabled) {
+    latency_dump(stderr);
+  }
+}
+
+enum {
+  OPT_BACKEND = 256,
+  OPT_RING_BLOCK_SIZE,
+  OPT_RING_FRAME_SIZE,
+  OPT_RING_FRAME_COUNT,
+  OPT_RING_TIMEOUT,
+  OPT_TX_RING,
+  OPT_TX_FRAME_SIZE,
+  OPT_TX_FRAME_COUNT,
+  OPT_QDISC_BYPASS,
+  OPT_BATCH,
+  OPT_NO_UDP_GSO,
+  OPT_NO_UDP_GRO,
+  OPT_QUEUES,
+  OPT_SHARDS,
+  OPT_STEER,
+  OPT_ENGINE,
+  OPT_BUSY_POLL,
+  OPT_FDB_AGE,
+  OPT_TUNNEL_MTU,
+  OPT_FLUSH_DELAY,
+  OPT_REASM_TIMEOUT,
+  OPT_REASM_MEMORY,
+  OPT_SOCKET_BUFFER,
+  OPT_VNET_HDR,
+  OPT_PIPELINE_RING,
+  OPT_POOL_BUFFERS,
+  OPT_POOL_BUFFER_SIZE,
+  OPT_HUGEPAGES,
+  OPT_STATS,
+  OPT_LATENCY,
+  OPT_FILTER_ETHERTYPE,
+  OPT_FILTER_VLAN,
+  OPT_FILTER_MAC,
+  OPT_ALLOW_PEERS,
+  OPT_FANOUT,
+  OPT_FANOUT_MODE,
+  OPT_PROFILE,
+  OPT_CPUS,
+  OPT_NUMA_NODE,
+  OPT_WORKERS,
+  OPT_REPLAY_TIMING,
+  OPT_REPLAY_COUNT,
+};
+
+static const struct option long_options[] = {
+    {"backend", required_argument, NULL, OPT_BACKEND},
+    {"ring-block-size", required_argument, NULL, OPT_RING_BLOCK_SIZE},
+    {"ring-frame-size", required_argument, NULL, OPT_RING_FRAME_SIZE},
+    {"ring-frame-count", required_argument, NULL, OPT_RING_FRAME_COUNT},
+    {"ring-timeout", required_argument, NULL, OPT_RING_TIMEOUT},
+    {"tx-ring", no_argument, NULL, OPT_TX_RING},
+    {"tx-frame-size", required_argument, NULL, OPT_TX_FRAME_SIZE},
+    {"tx-frame-count", required_argument, NULL, OPT_TX_FRAME_COUNT},
+    {"qdisc-bypass", no_argument, NULL, OPT_QDISC_BYPASS},
+    {"batch", required_argument, NULL, OPT_BATCH},
+    {"no-udp-gso", no_argument, NULL, OPT_NO_UDP_GSO},
+    {"no-udp-gro", no_argument, NULL, OPT_NO_UDP_GRO},
+    {"queues", required_argument, NULL, OPT_QUEUES},
+    {"shards", required_argument, NULL, OPT_SHARDS},
+    {"steer", no_argument, NULL, OPT_STEER},
+    {"engine", required_argument, NULL, OPT_ENGINE},
+    {"busy-poll", required_argument, NULL, OPT_BUSY_POLL},
+    {"fdb-age", required_argument, NULL, OPT_FDB_AGE},
+    {"tunnel-mtu", required_argument, NULL, OPT_TUNNEL_MTU},
+    {"flush-delay", required_argument, NULL, OPT_FLUSH_DELAY},
+    {"reasm-timeout", required_argument, NULL, OPT_REASM_TIMEOUT},
+    {"reasm-memory", required_argument, NULL, OPT_REASM_MEMORY},
+    {"socket-buffer", required_argument, NULL, OPT_SOCKET_BUFFER},
+    {"vnet-hdr", no_argument, NULL, OPT_VNET_HDR},
+    {"pipeline-ring", required_argument, NULL, OPT_PIPELINE_RING},
+    {"pool-buffers", required_argument, NULL, OPT_POOL_BUFFERS},
+    {"pool-buffer-size", required_argument, NULL, OPT_POOL_BUFFER_SIZE},
+    {"hugepages", no_argument, NULL, OPT_HUGEPAGES},
+    {"stats", required_argument, NULL, OPT_STATS},
+    {"latency", no_argument, NULL, OPT_LATENCY},
+    {"filter-ethertype", required_argument, NULL, OPT_FILTER_ETHERTYPE},
+    {"filter-vlan", required_argument, NULL, OPT_FILTER_VLAN},
+    {"filter-mac", required_argument, NULL, OPT_FILTER_MAC},
+    {"allow-peers", required_argument, NULL, OPT_ALLOW_PEERS},
+    {"fanout", required_argument, NULL, OPT_FANOUT},
+    {"fanout-mode", required_argument, NULL, OPT_FANOUT_MODE},
+    {"profile", required_argument, NULL, OPT_PROFILE},
+    {"cpus", required_argument, NULL, OPT_CPUS},
+    {"numa-node", required_argument, NULL, OPT_NUMA_NODE},
+    {"workers", required_argument, NULL, OPT_WORKERS},
+    {"replay-timing", required_argument, NULL, OPT_REPLAY_TIMING},
+    {"replay-count", required_argument, NULL, OPT_REPLAY_COUNT},
+    {NULL, 0, NULL, 0},
+};
+
+static void usage(void) {
+  fprintf(stderr,
+          "Usage: bridge_l2 [options] <if1> <if2> [if3 ...]\n"
+          "       bridge_l2 [options] server <tap> [addr] [port]\n"
+          "       bridge_l2 [options] client <if> [addr] [port]\n"
+          "       bridge_l2 [options] daemon <config>\n"
+          "Options:\n"
+          "  --backend=pcap|afpacket|tap|file\n"
+          "  --ring-block-size=<bytes>\n"
+          "  --ring-frame-size=<bytes>\n"
+          "  --ring-frame-count=<count>\n"
+          "  --ring-timeout=<ms>\n"
+          "  --tx-ring\n"
+          "  --tx-frame-size=<bytes>\n"
+          "  --tx-frame-count=<count>\n"
+          "  --qdisc-bypass\n"
+          "  --batch=<count>\n"
+          "  --no-udp-gso\n"
+          "  --no-udp-gro\n"
+          "  --queues=<count>\n"
+          "  --shards=<count>\n"
+          "  --steer\n"
+          "  --engine=threads|epoll|uring|pipeline\n"
+          "  --busy-poll=<us>\n"
+          "  --fdb-age=<sec>\n"
+          "  --tunnel-mtu=<bytes>\n"
+          "  --flush-delay=<us>\n"
+          "  --reasm-timeout=<ms>\n"
+          "  --reasm-memory=<bytes>\n"
+          "  --socket-buffer=<bytes>\n"
+          "  --vnet-hdr\n"
+          "  --pipeline-ring=<bytes>\n"
+          "  --pool-buffers=<count>\n"
+          "  --pool-buffer-size=<bytes>\n"
+          "  --hugepages\n"
+          "  --stats=<path>\n"
+          "  --latency\n"
+          "  --filter-ethertype=<type>[,<type>...]\n"
+          "  --filter-vlan=<id>[,<id>...]\n"
+          "  --filter-mac=<mac>[,<mac>...]\n"
+          "  --allow-peers=<addr>[,<addr>...]\n"
+          "  --fanout=<count>\n"
+          "  --fanout-mode=hash|cpu|rollover\n"
+          "  --profile=throughput|low-latency|power-save\n"
+          "  --cpus=<list>\n"
+          "  --numa-node=<node>\n"
+          "  --workers=<count>\n"
+          "  --replay-timing=max|recorded\n"
+          "  --replay-count=<count>\n");
+}
+
+// Опции процесса: их применяют до запуска мостов, а stats_path хранит
+// optarg, поэтому в строках конфигурации daemon они запрещены.
+static bool global_option(int opt) {
+  switch (opt) {
+    case OPT_BUSY_POLL:
+    case OPT_STATS:
+    case OPT_LATENCY:
+    case OPT_PROFILE:
+    case OPT_CPUS:
+    case OPT_NUMA_NODE:
+    case OPT_WORKERS:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// global - опции командной строки, иначе - строки конфигурации daemon.
+static int parse_options(int argc,
+                         char** argv,
+                         bool global,
+                         struct inter_config_t* inter_config,
+                         struct remote_config_t* remote_config) {
+  int opt = 0;
+  int index = 0;
+  while ((opt = getopt_long(argc, argv, "+", long_options, &index)) != -1) {
+    if (!global && global_option(opt)) {
+      fprintf(stderr, "--%s is allowed only on the daemon command line\n",
+              long_options[index].name);
+      return -1;
+    }
+    switch (opt) {
+      case OPT_BACKEND:
+        if (!strcmp(optarg, "pcap")) {
+          inter_config->backend = INTER_BACKEND_PCAP;
+        } else if (!strcmp(optarg, "afpacket")) {
+          inter_config->backend = INTER_BACKEND_AFPACKET;
+        } else if (!strcmp(optarg, "tap")) {
+          inter_config->backend = INTER_BACKEND_TAP;
+        } else if (!strcmp(optarg, "file")) {
+          inter_config->backend = INTER_BACKEND_FILE;
+        } else {
+          fprintf(stderr, "Unknown backend %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_RING_BLOCK_SIZE:
+        inter_config->afpacket.block_size = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_RING_FRAME_SIZE:
+        inter_config->afpacket.frame_size = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_RING_FRAME_COUNT:
+        inter_config->afpacket.frame_count = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_RING_TIMEOUT:
+        inter_config->afpacket.retire_timeout = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_TX_RING:
+        inter_config->tx_ring = true;
+        break;
+      case OPT_TX_FRAME_SIZE:
+        inter_config->afpacket.tx_frame_size = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_TX_FRAME_COUNT:
+        inter_config->afpacket.tx_frame_count = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_QDISC_BYPASS:
+        inter_config->afpacket.qdisc_bypass = true;
+        break;
+      case OPT_BATCH:
+        remote_config->batch = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_NO_UDP_GSO:
+        remote_config->gso = false;
+        break;
+      case OPT_NO_UDP_GRO:
+        remote_config->gro = false;
+        break;
+      case OPT_QUEUES:
+        remote_config->queues = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_SHARDS:
+        remote_config->shards = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_STEER:
+        remote_config->steer = true;
+        break;
+      case OPT_ENGINE:
+        if (!strcmp(optarg, "threads")) {
+          remote_config->engine.type = ENGINE_THREADS;
+        } else if (!strcmp(optarg, "epoll")) {
+          remote_config->engine.type = ENGINE_EPOLL;
+        } else if (!strcmp(optarg, "uring")) {
+          remote_config->engine.type = ENGINE_URING;
+        } else if (!strcmp(optarg, "pipeline")) {
+          remote_config->engine.type = ENGINE_PIPELINE;
+        } else {
+          fprintf(stderr, "Unknown engine %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_BUSY_POLL:
+        remote_config->engine.busy_poll = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_FDB_AGE:
+        remote_config->fdb_age = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_TUNNEL_MTU: {
+        unsigned long mtu = strtoul(optarg, NULL, 0);
+        if (mtu > TUNNEL_MAX_DATAGRAM) {
+          fprintf(stderr, "Tunnel mtu %s is above %d\n", optarg,
+                  TUNNEL_MAX_DATAGRAM);
+          return -1;
+        }
+        remote_config->mtu = mtu;
+        break;
+      }
+      case OPT_FLUSH_DELAY:
+        remote_config->flush_delay = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_REASM_TIMEOUT:
+        remote_config->reasm_timeout = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_REASM_MEMORY:
+        remote_config->reasm_memory = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_SOCKET_BUFFER:
+        remote_config->socket_buffer = strtol(optarg, NULL, 0);
+        break;
+      case OPT_VNET_HDR:
+        remote_config->vnet_hdr = true;
+        inter_config->afpacket.vnet_hdr = true;
+        break;
+      case OPT_PIPELINE_RING:
+        remote_config->engine.ring_size = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_POOL_BUFFERS:
+        remote_config->engine.pool_count = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_POOL_BUFFER_SIZE:
+        remote_config->engine.pool_buffer_size = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_HUGEPAGES:
+        remote_config->engine.hugepages = true;
+        break;
+      case OPT_STATS:
+        stats_path = optarg;
+        break;
+      case OPT_LATENCY:
+        latency_enable();
+        break;
+      case OPT_FILTER_ETHERTYPE:
+        if (filter_parse_ethertypes(&inter_config->filter, optarg) == -1) {
+          return -1;
+        }
+        break;
+      case OPT_FILTER_VLAN:
+        if (filter_parse_vlans(&inter_config->filter, optarg) == -1) {
+          return -1;
+        }
+        break;
+      case OPT_FILTER_MAC:
+        if (filter_parse_macs(&inter_config->filter, optarg) == -1) {
+          return -1;
+        }
+        break;
+      case OPT_ALLOW_PEERS:
+        if (remote_parse_peers(remote_config, optarg) == -1) {
+          return -1;
+        }
+        break;
+      case OPT_FANOUT:
+        inter_config->afpacket.fanout = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_FANOUT_MODE:
+        if (afpacket_parse_fanout_mode(&inter_config->afpacket, optarg) ==
+            -1) {
+          fprintf(stderr, "Unknown fanout mode %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_PROFILE:
+        if (cpu_parse_profile(&cpu_config, optarg) == -1) {
+          fprintf(stderr, "Unknown profile %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_CPUS:
+        if (cpu_parse_list(&cpu_config.cpus, optarg) == -1) {
+          fprintf(stderr, "Incorrect cpu list %s\n", optarg);
+          return -1;
+        }
+        cpu_config.cpus_set = true;
+        break;
+      case OPT_NUMA_NODE:
+        cpu_config.node = atoi(optarg);
+        break;
+      case OPT_WORKERS:
+        daemon_workers = strtoul(optarg, NULL, 0);
+        break;
+      case OPT_REPLAY_TIMING:
+        if (!strcmp(optarg, "max")) {
+          inter_config->file.recorded = false;
+        } else if (!strcmp(optarg, "recorded")) {
+          inter_config->file.recorded = true;
+        } else {
+          fprintf(stderr, "Unknown replay timing %s\n", optarg);
+          return -1;
+        }
+        break;
+      case OPT_REPLAY_COUNT:
+        inter_config->file.repeat = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        return -1;
+    }
+  }
+
+  return optind;
 }
 
 static int server_bridge(const char* inter_name,
                          const char* name_addr,
-                         int port) {
-  struct server_t* server = server_init(inter_name, name_addr, port);
+                         int port,
+                         const struct inter_config_t* inter_config,
+                         const struct remote_config_t* remote_config) {
+  struct server_t* server = server_init(inter_name, name_addr, port,
+                                        &inter_config->filter, remote_config);
   if (!server) {
     fprintf(stderr, "ERROR > server_bridge server_init.\n");
     return 1;
@@ -47,19 +444,47 @@ static int server_bridge(const char* inter_name,
 
   printf("bridging %s <=> %s:%d \n", inter_name, name_addr, port);
 
-  while (!terminated) {
-    sleep(1);
-  }
+  wait_terminated();
 
   server_stop(server);
   server_free(server);
 
   return 0;
 }
+// У файлового интерфейса нет fd: его читают только потоки и конвейер.
+static int backend_check(const struct inter_config_t* inter_config,
+                         const struct remote_config_t* remote_config) {
+  if ((inter_config->backend == INTER_BACKEND_FILE) &&
+      (remote_config->engine.type != ENGINE_THREADS) &&
+      (remote_config->engine.type != ENGINE_PIPELINE)) {
+    fprintf(stderr, "--backend=file requires --engine=threads or pipeline\n");
+    return -1;
+  }
+
+  return 0;
+}
+
+static int client_check(const struct inter_config_t* inter_config) {
+  if (inter_config->afpacket.fanout > 1) {
+    fprintf(stderr, "--fanout is supported only in local mode\n");
+    return -1;
+  }
+
+  return 0;
+}
+
 static int client_bridge(const char* inter_name,
                          const char* serv_addr,
-                         int serv_port) {
-  struct client_t* client = client_init(inter_name, serv_addr, serv_port);
+                         int serv_port,
+                         const struct inter_config_t* inter_config,
+                         const struct remote_config_t* remote_config) {
+  if ((backend_check(inter_config, remote_config) == -1) ||
+      (client_check(inter_config) == -1)) {
+    return 1;
+  }
+
+  struct client_t* client = client_init(inter_name, serv_addr, serv_port,
+                                        inter_config, remote_config);
   if (!client) {
     fprintf(stderr, "ERROR > client_bridge client_init.\n");
     return 1;
@@ -73,9 +498,7 @@ static int client_bridge(const char* inter_name,
   }
 
   printf("bridging %s <=> %s:%d \n", inter_name, serv_addr, serv_port);
-  while (!terminated) {
-    sleep(1);
-  }
+  wait_terminated();
 
   client_stop(client);
   client_free(client);
@@ -83,13 +506,43 @@ static int client_bridge(const char* inter_name,
   return 0;
 }
 
-static int local_bridge(const char* inter_0, const char* inter_1) {
-  if (!strcmp(inter_0, inter_1)) {
-    fprintf(stderr, "Interfaces must not equal. %s == %s \n", inter_0, inter_1);
+static int local_check(const char** ifnames,
+                       unsigned int count,
+                       const struct remote_config_t* remote_config) {
+  if (remote_config->vnet_hdr) {
+    fprintf(stderr, "--vnet-hdr is supported only by client and server\n");
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    for (unsigned int j = i + 1; j < count; j++) {
+      if (!strcmp(ifnames[i], ifnames[j])) {
+        fprintf(stderr, "Interfaces must not equal. %s == %s \n", ifnames[i],
+                ifnames[j]);
+        return -1;
+      }
+    }
+  }
+
+  return 0;
+}
+
+static int local_bridge(const char** ifnames,
+                        unsigned int count,
+                        const struct inter_config_t* inter_config,
+                        const struct remote_config_t* remote_config) {
+  if ((backend_check(inter_config, remote_config) == -1) ||
+      (local_check(ifnames, count, remote_config) == -1)) {
     return 1;
   }
 
-  struct local_bridge_t* bridge = local_bridge_new(inter_0, inter_1, 1);
+  struct local_bridge_t* bridge =
+      local_bridge_new(ifnames, count, inter_config, &remote_config->engine,
+                       remote_config->fdb_age);
+  if (!bridge) {
+    fprintf(stderr, "Bridge can't create.\n");
+    return 1;
+  }
 
   int res = local_bridge_open(bridge);
   if (res == -1) {
@@ -97,12 +550,19 @@ static int local_bridge(const char* inter_0, const char* inter_1) {
     return 1;
   }
 
-  printf("bridging %s <=> %s\n", inter_0, inter_1);
+  printf("bridging %s", ifnames[0]);
+  for (unsigned int i = 1; i < count; i++) {
+    printf(" <=> %s", ifnames[i]);
+  }
+  printf("\n");
 
-  local_bridge_run(bridge);
-  while (!terminated) {
-    sleep(1);
+  res = local_bridge_run(bridge);
+  if (res == -1) {
+    fprintf(stderr, "Bridge can't run.\n");
+    return 1;
   }
+
+  wait_terminated();
   local_bridge_stop(bridge);
   local_bridge_close(bridge);
   local_bridge_free(bridge);
@@ -110,14 +570,173 @@ static int local_bridge(const char* inter_0, const char* inter_1) {
   return 0;
 }
 
-int main(int argc, const char** argv) {
-  if (geteuid() != 0) {
-    fprintf(stderr, "You must be root!\n");
+// Строка конфигурации - команда одного моста, как у bridge_l2: опции, затем
+// интерфейсы, server или client. Опции строки применяются поверх опций
+// командной строки daemon. Все после # - комментарий.
+static int daemon_add_line(struct bridge_daemon_t* daemon,
+                           char* line,
+                           const struct inter_config_t* inter_defaults,
+                           const struct remote_config_t* remote_defaults) {
+  char* argv[DAEMON_MAX_ARGS + 1];
+  int argc = 0;
+  argv[argc++] = "bridge_l2";
+  for (char* token = strtok(line, " \t\r\n"); token && (*token != '#');
+       token = strtok(NULL, " \t\r\n")) {
+    if (argc >= DAEMON_MAX_ARGS) {
+      fprintf(stderr, "Too many arguments\n");
+      return -1;
+    }
+    argv[argc++] = token;
+  }
+  argv[argc] = NULL;
+  if (argc == 1) {
+    return 0;
+  }
+
+  struct inter_config_t inter_config = *inter_defaults;
+  struct remote_config_t remote_config = *remote_defaults;
+  optind = 0;
+  int first = parse_options(argc, argv, false, &inter_config, &remote_config);
+  if ((first == -1) || (first >= argc)) {
+    fprintf(stderr, "Incorrect bridge\n");
+    return -1;
+  }
+  char** args = argv + first;
+  int count = argc - first;
+  if (inter_config.backend == INTER_BACKEND_FILE) {
+    fprintf(stderr, "--backend=file is not supported by daemon\n");
+    return -1;
+  }
+
+  if (!strcmp(args[0], "server") || !strcmp(args[0], "client")) {
+    const char* addr = ADDR;
+    int port = PORT;
+    if (count < 2) {
+      fprintf(stderr, "Not set name interface\n");
+      return -1;
+    }
+    if (count >= 3) {
+      addr = args[2];
+    }
+    if (count >= 4) {
+      port = atoi(args[3]);
+    }
+
+    if (!strcmp(args[0], "server")) {
+      return daemon_add_server(daemon, args[1], addr, port, &inter_config,
+                               &remote_config);
+    }
+    if (client_check(&inter_config) == -1) {
+      return -1;
+    }
+    return daemon_add_client(daemon, args[1], addr, port, &inter_config,
+                             &remote_config);
+  }
+
+  if (count < 2) {
+    fprintf(stderr, "Not set name interface\n");
+    return -1;
+  }
+  if (local_check((const char**)args, count, &remote_config) == -1) {
+    return -1;
+  }
+  return daemon_add_local(daemon, (const char**)args, count, &inter_config,
+                          &remote_config);
+}
+
+static int daemon_bridges(const char* path,
+                          const struct inter_config_t* inter_config,
+                          const struct remote_config_t* remote_config) {
+  FILE* file = fopen(path, "r");
+  if (!file) {
+    fprintf(stderr, "Can't open config %s\n", path);
+    return 1;
+  }
+
+  unsigned int workers = daemon_workers ? daemon_workers : cpu_thread_count();
+  if (workers > WORKER_MAX_THREADS) {
+    workers = WORKER_MAX_THREADS;
+  }
+
+  static struct bridge_daemon_t daemon;
+  daemon_init(&daemon);
+  if (daemon_open(&daemon, workers, remote_config->engine.busy_poll) == -1) {
+    fclose(file);
+    return 1;
+  }
+
+  int res = 0;
+  char line[1024];
+  unsigned int number = 0;
+  while ((res == 0) && fgets(line, sizeof(line), file)) {
+    number++;
+    res = daemon_add_line(&daemon, line, inter_config, remote_config);
+    if (res == -1) {
+      fprintf(stderr, "%s:%u: bridge can't start\n", path, number);
+    }
+  }
+  fclose(file);
+
+  if ((res == 0) && (daemon_run(&daemon) == -1)) {
+    res = -1;
+  }
+  if (res == -1) {
+    daemon_close(&daemon);
     return 1;
   }
 
+  printf("bridging %u bridges on %u workers\n", daemon.bridge_count, workers);
+  wait_terminated();
+  daemon_close(&daemon);
+
+  return 0;
+}
+
+int main(int argc, char** argv) {
   signals_init();
 
+  struct inter_config_t inter_config;
+  inter_config_default(&inter_config);
+  struct remote_config_t remote_config;
+  remote_config_default(&remote_config);
+  cpu_config_default(&cpu_config);
+
+  int first = parse_options(argc, argv, true, &inter_config, &remote_config);
+  if (first == -1) {
+    usage();
+    return 1;
+  }
+
+  // Файлы и провода в памяти не требуют прав на интерфейсы.
+  if ((inter_config.backend != INTER_BACKEND_FILE) &&
+      (inter_config.backend != INTER_BACKEND_LOOP) && (geteuid() != 0)) {
+    fprintf(stderr, "You must be root!\n");
+    return 1;
+  }
+  argc -= first - 1;
+  argv += first - 1;
+
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+
+  // Ядра и узел NUMA выбираются по интерфейсу захвата, до выделения колец и
+  // запуска потоков.
+  const char* cpu_inter = argv[1];
+  if (!strcmp(argv[1], "server") || !strcmp(argv[1], "client")) {
+    cpu_inter = (argc >= 3) ? argv[2] : NULL;
+  } else if (!strcmp(argv[1], "daemon")) {
+    cpu_inter = NULL;
+  }
+  if (cpu_configure(&cpu_config, cpu_inter) == -1) {
+    return 1;
+  }
+  // В power-save потоки спят в epoll_wait, а не крутятся в опросе.
+  if (cpu_config.profile == CPU_PROFILE_POWER_SAVE) {
+    remote_config.engine.busy_poll = 0;
+  }
+
   int res = 0;
   if (!strcmp(argv[1], "server")) {
     const char* inter_name = NULL;
@@ -139,7 +758,8 @@ int main(int argc, const char** argv) {
       port = atoi(argv[4]);
     }
 
-    res = server_bridge(inter_name, name_addr, port);
+    res = server_bridge(inter_name, name_addr, port, &inter_config,
+                        &remote_config);
   } else if (!strcmp(argv[1], "client")) {
     const char* inter_name = NULL;
     const char* server_addr = ADDR;
@@ -160,13 +780,21 @@ int main(int argc, const char** argv) {
       server_port = atoi(argv[4]);
     }
 
-    res = client_bridge(inter_name, server_addr, server_port);
+    res = client_bridge(inter_name, server_addr, server_port, &inter_config,
+                        &remote_config);
+  } else if (!strcmp(argv[1], "daemon")) {
+    if (argc < 3) {
+      fprintf(stderr, "Not set config\n");
+      return 1;
+    }
+    res = daemon_bridges(argv[2], &inter_config, &remote_config);
   } else {
     if (argc < 3) {
-      fprintf(stderr, "Usage: bridge_l2 <if1> <if2>\n");
+      usage();
       return 1;
     }
-    res = local_bridge(argv[1], argv[2]);
+    res = local_bridge((const char**)&argv[1], argc - 1, &inter_config,
+                       &remote_config);
   }
   return res;
 }
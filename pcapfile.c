@@ -0,0 +1,410 @@
+#include "pcapfile.h"
+
+#include <byteswap.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define PCAPFILE_MAGIC 0xa1b2c3d4
+#define PCAPFILE_MAGIC_NSEC 0xa1b23c4d
+#define PCAPFILE_LINKTYPE_ETHERNET 1
+
+struct pcapfile_header_t {
+  uint32_t magic;
+  uint16_t version_major;
+  uint16_t version_minor;
+  int32_t thiszone;
+  uint32_t sigfigs;
+  uint32_t snaplen;
+  uint32_t linktype;
+};
+
+struct pcapfile_record_t {
+  uint32_t ts_sec;
+  uint32_t ts_frac;
+  uint32_t incl_len;
+  uint32_t orig_len;
+};
+
+void pcapfile_config_default(struct pcapfile_config_t* config) {
+  config->recorded = false;
+  config->repeat = 1;
+}
+
+void pcapfile_init(struct pcapfile_t* file) {
+  pcapfile_config_default(&file->config);
+  file->source = NULL;
+  file->map = NULL;
+  file->map_size = 0;
+  file->offset = 0;
+  file->swapped = false;
+  file->nanosec = false;
+  file->pcap = NULL;
+  file->pending = false;
+  file->pass = 0;
+  file->pass_frames = 0;
+  file->done = false;
+  file->pass_start = 0;
+  file->pass_ts = 0;
+  file->started = 0;
+  file->frames = 0;
+  file->bytes = 0;
+  file->truncated = 0;
+  file->sink = NULL;
+  file->written = 0;
+}
+
+static uint64_t pcapfile_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+static uint32_t pcapfile_u32(const struct pcapfile_t* file, uint32_t value) {
+  return file->swapped ? bswap_32(value) : value;
+}
+
+// Классический pcap с Ethernet отображается в память целиком, остальные
+// форматы (pcapng) остаются libpcap.
+static int pcapfile_map(struct pcapfile_t* file) {
+  int fd = open(file->source, O_RDONLY | O_CLOEXEC);
+  if (fd == -1) {
+    fprintf(stderr, "ERROR> %s open %s\n", __FUNCTION__, file->source);
+    return -1;
+  }
+
+  struct stat st;
+  if ((fstat(fd, &st) == -1) ||
+      ((size_t)st.st_size < sizeof(struct pcapfile_header_t))) {
+    close(fd);
+    return 0;
+  }
+
+  uint8_t* map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    fprintf(stderr, "ERROR> %s mmap %s\n", __FUNCTION__, file->source);
+    return -1;
+  }
+
+  const struct pcapfile_header_t* header = (const void*)map;
+  uint32_t magic = header->magic;
+  file->swapped = (magic == bswap_32(PCAPFILE_MAGIC)) ||
+                  (magic == bswap_32(PCAPFILE_MAGIC_NSEC));
+  magic = pcapfile_u32(file, magic);
+  if ((magic != PCAPFILE_MAGIC) && (magic != PCAPFILE_MAGIC_NSEC)) {
+    munmap(map, st.st_size);
+    file->swapped = false;
+    return 0;
+  }
+  if (pcapfile_u32(file, header->linktype) != PCAPFILE_LINKTYPE_ETHERNET) {
+    fprintf(stderr, "ERROR> %s %s is not Ethernet capture\n", __FUNCTION__,
+            file->source);
+    munmap(map, st.st_size);
+    return -1;
+  }
+
+  madvise(map, st.st_size, MADV_SEQUENTIAL);
+  file->map = map;
+  file->map_size = st.st_size;
+  file->offset = sizeof(*header);
+  file->nanosec = magic == PCAPFILE_MAGIC_NSEC;
+  return 0;
+}
+
+static int pcapfile_open_pcap(struct pcapfile_t* file) {
+  char eb[PCAP_ERRBUF_SIZE];
+  file->pcap = pcap_open_offline(file->source, eb);
+  if (!file->pcap) {
+    fprintf(stderr, "ERROR> %s pcap_open_offline(%s) failed\n\t %s\n",
+            __FUNCTION__, file->source, eb);
+    return -1;
+  }
+  if (pcap_datalink(file->pcap) != DLT_EN10MB) {
+    fprintf(stderr, "ERROR> %s %s is not Ethernet capture\n", __FUNCTION__,
+            file->source);
+    pcap_close(file->pcap);
+    file->pcap = NULL;
+    return -1;
+  }
+
+  return 0;
+}
+
+static int pcapfile_open_source(struct pcapfile_t* file) {
+  if (pcapfile_map(file) == -1) {
+    return -1;
+  }
+  if (!file->map && (pcapfile_open_pcap(file) == -1)) {
+    return -1;
+  }
+
+  return 0;
+}
+
+static int pcapfile_open_sink(struct pcapfile_t* file, const char* path) {
+  file->sink = fopen(path, "w");
+  if (!file->sink) {
+    fprintf(stderr, "ERROR> %s fopen %s\n", __FUNCTION__, path);
+    return -1;
+  }
+  setvbuf(file->sink, NULL, _IOFBF, PCAPFILE_SINK_BUFFER);
+
+  struct pcapfile_header_t header = {
+      PCAPFILE_MAGIC, 2, 4, 0, 0, PCAPFILE_SNAPLEN, PCAPFILE_LINKTYPE_ETHERNET,
+  };
+  if (fwrite(&header, sizeof(header), 1, file->sink) != 1) {
+    fprintf(stderr, "ERROR> %s fwrite %s\n", __FUNCTION__, path);
+    return -1;
+  }
+
+  return 0;
+}
+
+int pcapfile_open(struct pcapfile_t* file,
+                  const char* name,
+                  const struct pcapfile_config_t* config) {
+  file->config = *config;
+
+  const char* sink = strchr(name, ':');
+  size_t source_size = sink ? (size_t)(sink - name) : strlen(name);
+  if (source_size) {
+    file->source = strndup(name, source_size);
+    if (!file->source || (pcapfile_open_source(file) == -1)) {
+      pcapfile_close(file);
+      return -1;
+    }
+  } else {
+    file->done = true;
+  }
+
+  if (sink && sink[1] && (pcapfile_open_sink(file, sink + 1) == -1)) {
+    pcapfile_close(file);
+    return -1;
+  }
+
+  return 0;
+}
+
+void pcapfile_close(struct pcapfile_t* file) {
+  if (file->map) {
+    munmap(file->map, file->map_size);
+  }
+  if (file->pcap) {
+    pcap_close(file->pcap);
+  }
+  if (file->sink && (fclose(file->sink) != 0)) {
+    fprintf(stderr, "ERROR> %s fclose\n", __FUNCTION__);
+  }
+  free(file->source);
+  pcapfile_init(file);
+}
+
+// 1 - кадр в file->frame, 0 - проход по файлу закончился.
+static int pcapfile_next(struct pcapfile_t* file) {
+  if (file->pending) {
+    return 1;
+  }
+
+  while (file->map) {
+    const struct pcapfile_record_t* record =
+        (const void*)(file->map + file->offset);
+    if (file->offset + sizeof(*record) > file->map_size) {
+      return 0;
+    }
+    size_t size = pcapfile_u32(file, record->incl_len);
+    size_t offset = file->offset + sizeof(*record);
+    if (size > file->map_size - offset) {
+      fprintf(stderr, "WARNING> %s %s ends inside frame\n", __FUNCTION__,
+              file->source);
+      return 0;
+    }
+    file->offset = offset + size;
+    if (size < pcapfile_u32(file, record->orig_len)) {
+      __atomic_store_n(&file->truncated, file->truncated + 1,
+                       __ATOMIC_RELAXED);
+      continue;
+    }
+
+    uint64_t frac = pcapfile_u32(file, record->ts_frac);
+    file->frame.bytes = file->map + offset;
+    file->frame.size = size;
+    file->frame.ts = pcapfile_u32(file, record->ts_sec) * 1000000000ull +
+                     (file->nanosec ? frac : frac * 1000);
+    file->pending = true;
+    return 1;
+  }
+
+  while (file->pcap) {
+    struct pcap_pkthdr* header = NULL;
+    const u_char* data = NULL;
+    int res = pcap_next_ex(file->pcap, &header, &data);
+    if (res == -2) {
+      return 0;
+    }
+    if (res != 1) {
+      fprintf(stderr, "ERROR> %s pcap_next_ex %s\n", __FUNCTION__,
+              file->source);
+      return -1;
+    }
+    if (header->caplen < header->len) {
+      __atomic_store_n(&file->truncated, file->truncated + 1,
+                       __ATOMIC_RELAXED);
+      continue;
+    }
+
+    file->frame.bytes = data;
+    file->frame.size = header->caplen;
+    file->frame.ts =
+        header->ts.tv_sec * 1000000000ull + header->ts.tv_usec * 1000ull;
+    file->pending = true;
+    return 1;
+  }
+
+  return 0;
+}
+
+static void pcapfile_report(const struct pcapfile_t* file) {
+  double seconds =
+      file->started ? (pcapfile_now() - file->started) / 1e9 : 0;
+  if (seconds <= 0) {
+    seconds = 1e-9;
+  }
+  fprintf(stderr,
+          "%s replayed %" PRIu64 " frames %" PRIu64 " bytes truncated %" PRIu64
+          " in %.3f s, %.0f pps %.3f Gbit/s\n",
+          file->source, file->frames, file->bytes, file->truncated, seconds,
+          file->frames / seconds, file->bytes * 8 / seconds / 1e9);
+}
+
+// Следующий проход начинается с начала файла, его время отсчитывается
+// заново. После последнего прохода источник печатает итог и молчит. Проход
+// без единого кадра (пустой файл, все кадры обрезаны) тоже последний, иначе
+// --replay-count=0 перечитывал бы файл без конца.
+static int pcapfile_rewind(struct pcapfile_t* file) {
+  bool empty = !file->pass_frames;
+  file->pass++;
+  file->pass_frames = 0;
+  file->pass_start = 0;
+  if (empty || (file->config.repeat && (file->pass >= file->config.repeat))) {
+    if (empty) {
+      fprintf(stderr, "WARNING> %s %s has no frames to replay\n",
+              __FUNCTION__, file->source);
+    }
+    file->done = true;
+    pcapfile_report(file);
+    return 0;
+  }
+
+  if (file->map) {
+    file->offset = sizeof(struct pcapfile_header_t);
+    return 0;
+  }
+  pcap_close(file->pcap);
+  file->pcap = NULL;
+  return pcapfile_open_pcap(file);
+}
+
+static void pcapfile_sleep(uint64_t ns) {
+  struct timespec ts = {ns / 1000000000ull, ns % 1000000000ull};
+  nanosleep(&ts, NULL);
+}
+
+// С recorded кадр ждет своего времени от начала прохода. Уже отданные кадры
+// не задерживаются ожиданием следующего: dispatch возвращается, ждать
+// следующий вызов будет не дольше timeout. Конец прохода тоже возвращает
+// dispatch: за вызов файл перематывается не больше раза.
+int pcapfile_dispatch(struct pcapfile_t* file,
+                      int count,
+                      int timeout,
+                      pcapfile_handler_t handler,
+                      void* user) {
+  int processed = 0;
+  while (!file->done && (processed < count)) {
+    int res = pcapfile_next(file);
+    if (res == -1) {
+      return -1;
+    }
+    if (res == 0) {
+      if (pcapfile_rewind(file) == -1) {
+        return -1;
+      }
+      break;
+    }
+
+    uint64_t now = pcapfile_now();
+    if (!file->started) {
+      file->started = now;
+    }
+    if (!file->pass_start) {
+      file->pass_start = now;
+      file->pass_ts = file->frame.ts;
+    }
+    if (file->config.recorded) {
+      uint64_t due = file->pass_start + (file->frame.ts - file->pass_ts);
+      if ((file->frame.ts > file->pass_ts) && (due > now)) {
+        if (processed || (timeout <= 0)) {
+          break;
+        }
+        uint64_t wait = due - now;
+        if (wait > timeout * 1000000ull) {
+          pcapfile_sleep(timeout * 1000000ull);
+          break;
+        }
+        pcapfile_sleep(wait);
+      }
+    }
+
+    file->pending = false;
+    handler(user, file->frame.bytes, file->frame.size);
+    __atomic_store_n(&file->frames, file->frames + 1, __ATOMIC_RELAXED);
+    __atomic_store_n(&file->bytes, file->bytes + file->frame.size,
+                     __ATOMIC_RELAXED);
+    file->pass_frames++;
+    processed++;
+  }
+
+  // Проигранный источник и интерфейс без источника ведут себя как тихий
+  // интерфейс.
+  if (file->done && !processed && (timeout > 0)) {
+    pcapfile_sleep(timeout * 1000000ull);
+  }
+
+  return processed;
+}
+
+int pcapfile_write(struct pcapfile_t* file, const uint8_t* bytes, size_t size) {
+  if (!file->sink) {
+    return 0;
+  }
+
+  struct timespec ts;
+  clock_gettime(CLOCK_REALTIME, &ts);
+  struct pcapfile_record_t record = {
+      ts.tv_sec, ts.tv_nsec / 1000, size, size,
+  };
+  // Писать в порт могут несколько потоков моста, запись кадра не рвется.
+  int res = 0;
+  flockfile(file->sink);
+  if ((fwrite_unlocked(&record, sizeof(record), 1, file->sink) != 1) ||
+      (fwrite_unlocked(bytes, size, 1, file->sink) != 1)) {
+    res = -1;
+  } else {
+    file->written++;
+  }
+  funlockfile(file->sink);
+
+  return res;
+}
+
+// Сколько кадров проиграно и сколько пропущено обрезанными.
+void pcapfile_stats(struct pcapfile_t* file,
+                    uint64_t* received,
+                    uint64_t* dropped) {
+  *received = __atomic_load_n(&file->frames, __ATOMIC_RELAXED);
+  *dropped = __atomic_load_n(&file->truncated, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,77 @@
+#ifndef BRIDGE_PCAPFILE_H
+#define BRIDGE_PCAPFILE_H
+
+#include <inttypes.h>
+#include <pcap.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define PCAPFILE_SNAPLEN 262144
+#define PCAPFILE_SINK_BUFFER (1 << 20)
+
+typedef void (*pcapfile_handler_t)(void* user,
+                                   const uint8_t* bytes,
+                                   size_t size);
+
+struct pcapfile_config_t {
+  // Кадры отдаются с интервалами из файла, иначе - как можно быстрее.
+  bool recorded;
+  // Сколько раз проиграть файл, 0 - без конца.
+  unsigned int repeat;
+};
+
+struct pcapfile_frame_t {
+  const uint8_t* bytes;
+  size_t size;
+  uint64_t ts;
+};
+
+// Интерфейс из файлов: источник проигрывает захват pcap (классический
+// формат читается из mmap без копирования, pcapng и остальное - через
+// pcap_open_offline), приемник пишет кадры в классический pcap.
+struct pcapfile_t {
+  struct pcapfile_config_t config;
+  char* source;
+  uint8_t* map;
+  size_t map_size;
+  size_t offset;
+  bool swapped;
+  bool nanosec;
+  pcap_t* pcap;
+  struct pcapfile_frame_t frame;
+  bool pending;
+  unsigned int pass;
+  uint64_t pass_frames;
+  bool done;
+  uint64_t pass_start;
+  uint64_t pass_ts;
+  uint64_t started;
+  uint64_t frames;
+  uint64_t bytes;
+  uint64_t truncated;
+  FILE* sink;
+  uint64_t written;
+};
+
+void pcapfile_config_default(struct pcapfile_config_t* config);
+
+void pcapfile_init(struct pcapfile_t* file);
+// name - "<источник>", "<источник>:<приемник>" или ":<приемник>". Кадры,
+// записанные в интерфейс без приемника, выбрасываются.
+int pcapfile_open(struct pcapfile_t* file,
+                  const char* name,
+                  const struct pcapfile_config_t* config);
+void pcapfile_close(struct pcapfile_t* file);
+int pcapfile_dispatch(struct pcapfile_t* file,
+                      int count,
+                      int timeout,
+                      pcapfile_handler_t handler,
+                      void* user);
+int pcapfile_write(struct pcapfile_t* file, const uint8_t* bytes, size_t size);
+void pcapfile_stats(struct pcapfile_t* file,
+                    uint64_t* received,
+                    uint64_t* dropped);
+
+#endif  // BRIDGE_PCAPFILE_H
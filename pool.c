@@ -0,0 +1,139 @@
+#include "pool.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+
+#define POOL_HUGE_PAGE (2 << 20)
+
+static size_t pool_round(size_t size, size_t align) {
+  return (size + align - 1) & ~(align - 1);
+}
+
+// Память выделяется и заполняется сразу (MAP_POPULATE), чтобы при пересылке
+// не было page fault. Если huge pages не настроены (vm.nr_hugepages), пул
+// берет обычные страницы и просит у ядра transparent huge pages.
+static uint8_t* pool_map(size_t size, bool hugepages) {
+  int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_POPULATE;
+  if (hugepages) {
+    void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                        flags | MAP_HUGETLB, -1, 0);
+    if (memory != MAP_FAILED) {
+      return memory;
+    }
+    fprintf(stderr, "WARNING> %s MAP_HUGETLB %zu bytes unavailable\n",
+            __FUNCTION__, size);
+  }
+
+  void* memory = mmap(NULL, size, PROT_READ | PROT_WRITE, flags, -1, 0);
+  if (memory == MAP_FAILED) {
+    return NULL;
+  }
+  if (hugepages) {
+    madvise(memory, size, MADV_HUGEPAGE);
+  }
+
+  return memory;
+}
+
+int pool_init(struct pool_t* pool,
+              unsigned int count,
+              size_t buffer_size,
+              bool hugepages) {
+  pool->buffer_size = pool_round(buffer_size, POOL_HEADER);
+  pool->stride = POOL_HEADER + pool->buffer_size;
+  pool->count = count;
+  pool->memory_size = pool_round(pool->stride * count, POOL_HUGE_PAGE);
+  pool->free_count = 0;
+
+  pool->free = calloc(count, sizeof(*pool->free));
+  pool->memory = pool_map(pool->memory_size, hugepages);
+  if (!pool->free || !pool->memory) {
+    fprintf(stderr, "ERROR> %s %u buffers %zu bytes\n", __FUNCTION__, count,
+            pool->buffer_size);
+    free(pool->free);
+    if (pool->memory) {
+      munmap(pool->memory, pool->memory_size);
+    }
+    pool->free = NULL;
+    pool->memory = NULL;
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    pool->free[count - 1 - i] =
+        (struct pool_buffer_t*)(pool->memory + i * pool->stride);
+  }
+  pool->free_count = count;
+  pthread_mutex_init(&pool->lock, NULL);
+
+  return 0;
+}
+
+void pool_free(struct pool_t* pool) {
+  if (!pool->memory) {
+    return;
+  }
+
+  pthread_mutex_destroy(&pool->lock);
+  munmap(pool->memory, pool->memory_size);
+  free(pool->free);
+  pool->memory = NULL;
+  pool->free = NULL;
+}
+
+void pool_cache_init(struct pool_cache_t* cache, struct pool_t* pool) {
+  cache->pool = pool;
+  cache->count = 0;
+}
+
+static void pool_cache_release(struct pool_cache_t* cache, unsigned int keep) {
+  struct pool_t* pool = cache->pool;
+
+  pthread_mutex_lock(&pool->lock);
+  while (cache->count > keep) {
+    pool->free[pool->free_count++] = cache->buffers[--cache->count];
+  }
+  pthread_mutex_unlock(&pool->lock);
+}
+
+void pool_cache_flush(struct pool_cache_t* cache) {
+  if (cache->pool && cache->count) {
+    pool_cache_release(cache, 0);
+  }
+}
+
+// Возвращает буфер с одной ссылкой или NULL, если пул пуст.
+struct pool_buffer_t* pool_get(struct pool_cache_t* cache) {
+  if (!cache->count) {
+    struct pool_t* pool = cache->pool;
+    pthread_mutex_lock(&pool->lock);
+    while ((cache->count < POOL_CACHE / 2) && pool->free_count) {
+      cache->buffers[cache->count++] = pool->free[--pool->free_count];
+    }
+    pthread_mutex_unlock(&pool->lock);
+    if (!cache->count) {
+      return NULL;
+    }
+  }
+
+  struct pool_buffer_t* buffer = cache->buffers[--cache->count];
+  buffer->refs = 1;
+  buffer->size = 0;
+  return buffer;
+}
+
+void pool_ref(struct pool_buffer_t* buffer) {
+  __atomic_add_fetch(&buffer->refs, 1, __ATOMIC_RELAXED);
+}
+
+void pool_put(struct pool_cache_t* cache, struct pool_buffer_t* buffer) {
+  if (__atomic_sub_fetch(&buffer->refs, 1, __ATOMIC_ACQ_REL)) {
+    return;
+  }
+
+  if (cache->count == POOL_CACHE) {
+    pool_cache_release(cache, POOL_CACHE / 2);
+  }
+  cache->buffers[cache->count++] = buffer;
+}
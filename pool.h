@@ -0,0 +1,57 @@
+#ifndef BRIDGE_POOL_H
+#define BRIDGE_POOL_H
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define POOL_BUFFER_SIZE 2048
+#define POOL_COUNT 16384
+#define POOL_CACHE 64
+#define POOL_HEADER 64
+
+// Буфер кадра со счетчиком ссылок: один кадр может лежать сразу в
+// нескольких кольцах, буфер возвращается в пул последней ссылкой.
+struct pool_buffer_t {
+  uint32_t refs;
+  uint32_t size;
+  uint8_t bytes[] __attribute__((aligned(POOL_HEADER)));
+};
+
+// Буферы одного размера в заранее выделенной (по возможности на huge
+// pages) памяти. Свободные буферы лежат в общем стеке под мьютексом и в
+// кешах потоков, которые берут и возвращают их в общий стек половиной кеша.
+struct pool_t {
+  uint8_t* memory;
+  size_t memory_size;
+  size_t buffer_size;
+  size_t stride;
+  unsigned int count;
+  struct pool_buffer_t** free;
+  unsigned int free_count;
+  pthread_mutex_t lock;
+};
+
+// Кеш принадлежит одному потоку.
+struct pool_cache_t {
+  struct pool_t* pool;
+  unsigned int count;
+  struct pool_buffer_t* buffers[POOL_CACHE];
+};
+
+int pool_init(struct pool_t* pool,
+              unsigned int count,
+              size_t buffer_size,
+              bool hugepages);
+void pool_free(struct pool_t* pool);
+
+void pool_cache_init(struct pool_cache_t* cache, struct pool_t* pool);
+void pool_cache_flush(struct pool_cache_t* cache);
+
+struct pool_buffer_t* pool_get(struct pool_cache_t* cache);
+void pool_ref(struct pool_buffer_t* buffer);
+void pool_put(struct pool_cache_t* cache, struct pool_buffer_t* buffer);
+
+#endif  // BRIDGE_POOL_H
@@ -1,14 +1,19 @@
 #include "remote.h"
+#include "cpu.h"
 
+#include <arpa/inet.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <inttypes.h>
+#include <linux/filter.h>
 #include <linux/if_arp.h>
 #include <linux/if_tun.h>
 #include <netdb.h>
 #include <netinet/in.h>
 #include <netinet/udp.h>
+#include <poll.h>
 #include <signal.h>
+#include <stddef.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -17,202 +22,712 @@
 #include <sys/socket.h>
 #include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-static void* server_sendto_thread(void* thread_data) {
-  struct server_t* server = thread_data;
-  struct base_t* base = &server->base;
+static bool base_pipeline(const struct base_t* base) {
+  return base->config.engine.type == ENGINE_PIPELINE;
+}
 
-  uint8_t buffer[1600];
-  size_t buffer_size = sizeof(buffer);
+static void base_send(struct base_t* base, struct channel_t* channel) {
+  int res = udp_batch_send(&channel->tx_batch, channel->socket,
+                           &base->sock_addr, base->addr_len);
+  if (res == -1) {
+    static struct stats_limit_t limit;
+    int error = errno;
+    uint64_t count = stats_limit(&limit);
+    if (count) {
+      fprintf(stderr,
+              "ERROR> %s can't send addr %s:%d %s (%" PRIu64 " batches)\n",
+              __FUNCTION__, base->name_addr, base->port, strerror(error),
+              count);
+    }
+  }
+}
 
-  while (!base->terminated) {
-    ssize_t bytes_count = read(server->fd, buffer, buffer_size);
+// С IFF_VNET_HDR перед кадром tap идет virtio_net_hdr.
+static size_t server_mac(const struct server_t* server) {
+  return server->base.config.vnet_hdr ? TUNNEL_VNET_SIZE : 0;
+}
+
+// Кадр к известному MAC уходит только его клиенту, широковещательные и
+// кадры к неизвестным адресам рассылаются всем живым клиентам.
+static unsigned int server_route(void* user,
+                                 const uint8_t* bytes,
+                                 size_t size,
+                                 const struct sockaddr_in** addrs) {
+  struct server_queue_t* queue = user;
+  struct fdb_t* fdb = &queue->server->fdb;
+  size_t mac = server_mac(queue->server);
+  if (size < mac + ETH_HLEN) {
+    return 0;
+  }
+
+  int peer = fdb_lookup(fdb, bytes + mac);
+  if (peer != -1) {
+    addrs[0] = fdb_peer_addr(fdb, peer);
+    return 1;
+  }
+
+  uint32_t now = fdb_now();
+  unsigned int count = fdb_peer_count(fdb);
+  unsigned int routes = 0;
+  for (unsigned int i = 0; i < count; i++) {
+    if (fdb_peer_alive(fdb, i, now)) {
+      addrs[routes++] = fdb_peer_addr(fdb, i);
+    }
+  }
+  return routes;
+}
+
+static void server_queue_send(struct server_queue_t* queue) {
+  struct channel_t* channel = &queue->channel;
+
+  int res = udp_batch_send(&channel->tx_batch, channel->socket, NULL, 0);
+  if (res == -1) {
+    fprintf(stderr, "ERROR> %s can't send\n", __FUNCTION__);
+    perror("sendmmsg:");
+  }
+}
+
+static void server_queue_route_ptk(struct server_queue_t* queue,
+                                   const uint8_t* bytes,
+                                   size_t size) {
+  struct udp_batch_t* batch = &queue->channel.tx_batch;
+  const struct sockaddr_in* addrs[FDB_MAX_PEERS];
+
+  unsigned int routes = server_route(queue, bytes, size, addrs);
+  for (unsigned int i = 0; i < routes; i++) {
+    int res = udp_batch_add_to(batch, bytes, size, addrs[i]);
+    if ((res == -1) && batch->count) {
+      server_queue_send(queue);
+      res = udp_batch_add_to(batch, bytes, size, addrs[i]);
+    }
+    if (res == -1) {
+      static struct stats_limit_t limit;
+      stats_drop(queue->channel.stats.tunnel_tx);
+      uint64_t count = stats_limit(&limit);
+      if (count) {
+        fprintf(stderr,
+                "ERROR> %s frame %zu bytes dropped (%" PRIu64 " frames)\n",
+                __FUNCTION__, size, count);
+      }
+    }
+  }
+}
+
+static void server_queue_read_ptk(void* user,
+                                  const uint8_t* bytes,
+                                  size_t size) {
+  struct server_queue_t* queue = user;
+
+  stats_add(queue->channel.stats.local_rx, size);
+  server_queue_route_ptk(queue, bytes, size);
+}
+
+static int server_queue_read(void* user) {
+  struct server_queue_t* queue = user;
+  struct channel_t* channel = &queue->channel;
+  struct udp_batch_t* batch = &channel->tx_batch;
+
+  // tap открыт неблокирующим: кадры вычитываются пока они есть, затем пачка
+  // уходит одним sendmmsg.
+  int count = 0;
+  while (!udp_batch_full(batch)) {
+    int res = inter_dispatch(queue->tap, 1, server_queue_read_ptk, queue);
+    if (res == 0) {
+      break;
+    }
+    if (res == -1) {
+      stats_error(channel->stats.local_rx);
+      fprintf(stderr, "ERROR>%s inter_dispatch %s\n", __FUNCTION__,
+              queue->tap->name);
+      break;
+    }
+    count++;
+
+    if (udp_batch_due(batch)) {
+      break;
+    }
+  }
+
+  if (batch->count) {
+    server_queue_send(queue);
+  }
+
+  return count;
+}
+
+// Конвейер: поток tap только вычитывает кадры в кольцо, маршрут и отправку
+// в сокет делает поток отправки. Кадр читается сразу в буфер пула и
+// кладется в кольцо ссылкой. Хвост кадра больше буфера пула дочитывается в
+// буфер очереди, такой кадр собирается там и копируется в кольцо.
+static int server_queue_capture(void* user) {
+  struct server_queue_t* queue = user;
+  struct ring_t* ring = &queue->channel.tx_pipe.rings[0];
+  struct pool_cache_t* cache = &queue->cache;
+  struct stats_counter_t* stats = queue->channel.stats.local_rx;
+
+  int count = 0;
+  while (count < RING_BATCH) {
+    struct pool_buffer_t* buffer = cache->pool ? pool_get(cache) : NULL;
+    size_t head = buffer ? cache->pool->buffer_size : 0;
+    struct iovec iovs[2] = {
+        {buffer ? buffer->bytes : NULL, head},
+        {queue->buffer + head, REMOTE_BUFFER_SIZE - head},
+    };
+    ssize_t bytes_count = readv(queue->fd, iovs, 2);
+    if ((bytes_count > 0) && ((size_t)bytes_count <= head)) {
+      stats_add(stats, bytes_count);
+      buffer->size = bytes_count;
+      if (!ring_push_buffer(ring, buffer)) {
+        pool_put(cache, buffer);
+      }
+      count++;
+      continue;
+    }
+    if (buffer) {
+      if (bytes_count > 0) {
+        memcpy(queue->buffer, buffer->bytes, head);
+      }
+      pool_put(cache, buffer);
+    }
+
+    if ((bytes_count == -1) && ((errno == EAGAIN) || (errno == EWOULDBLOCK))) {
+      break;
+    }
     if (bytes_count == 0) {
       continue;
     }
     if (bytes_count == -1) {
+      stats_error(stats);
       fprintf(stderr, "ERROR>%s read \n", __FUNCTION__);
       perror("read:");
-      continue;
+      break;
     }
 
-    int res = sendto(base->socket, buffer, bytes_count, 0,
-                     (struct sockaddr*)&base->sock_addr, base->addr_len);
-    if (res == -1) {
-      fprintf(stderr, "ERROR> %s can't send addr %s:%d\n", __FUNCTION__,
-              inet_ntoa(base->sock_addr.sin_addr), base->sock_addr.sin_port);
-      perror("sendto:");
-    }
+    stats_add(stats, bytes_count);
+    ring_push(ring, queue->buffer, bytes_count);
+    count++;
+  }
+
+  if (count) {
+    ring_notify(ring);
+  }
+
+  return count;
+}
+
+static void server_queue_send_ptk(void* user,
+                                  const uint8_t* bytes,
+                                  size_t size) {
+  struct server_queue_t* queue = user;
+
+  server_queue_route_ptk(queue, bytes, size);
+  if (udp_batch_due(&queue->channel.tx_batch)) {
+    server_queue_send(queue);
+  }
+}
+
+static int server_queue_send_flush(void* user) {
+  struct server_queue_t* queue = user;
+
+  if (queue->channel.tx_batch.count) {
+    server_queue_send(queue);
   }
 
   return 0;
 }
 
-static void* server_recv_thread(void* thread_data) {
-  struct server_t* server = thread_data;
-  struct base_t* base = &server->base;
+static void* server_sendto_thread(void* thread_data) {
+  struct server_queue_t* queue = thread_data;
+  struct base_t* base = &queue->server->base;
+  engine_handler_t read_handler =
+      base_pipeline(base) ? server_queue_capture : server_queue_read;
 
-  uint8_t buffer[1600];
-  size_t buffer_size = sizeof(buffer);
-  struct sockaddr_in addr;
-  socklen_t addrlen = 0;
   while (!base->terminated) {
-    ssize_t bytes_count = recvfrom(base->socket, buffer, buffer_size, 0,
-                                   (struct sockaddr*)&addr, &addrlen);
-    if (bytes_count == -1) {
-      fprintf(stderr, "ERROR> %s recvfrom %s\n", __FUNCTION__, base->name_addr);
-      continue;
+    if (read_handler(queue) == 0) {
+      struct pollfd pfd = {queue->fd, POLLIN, 0};
+      poll(&pfd, 1, -1);
     }
+  }
 
-    if (memcmp(&addr, (struct sockaddr*)&base->sock_addr, addrlen)) {
-      //        inet_ntoa создает статический буффер в который записывается
-      //        строка адресса повторный вызов inet_ntoa перезаписывает этот
-      //        буффер поэтому вывод ошибки разбит на 2 функции. вызывает
-      //        опасение использование этой функции внутри потока, но другого
-      //        варианта приведения адресса не нашел.
-      fprintf(stderr,
-              "ERROR> %s package incorrect source address received:%s:%d ",
-              __FUNCTION__, inet_ntoa(addr.sin_addr), addr.sin_port);
-      fprintf(stderr, "expected:%s:%d\n ", inet_ntoa(base->sock_addr.sin_addr),
-              base->sock_addr.sin_port);
-      continue;
+  return 0;
+}
+
+static void server_learn(void* user, const uint8_t* bytes, size_t size) {
+  struct server_queue_t* queue = user;
+  size_t mac = server_mac(queue->server);
+
+  if (size >= mac + ETH_HLEN) {
+    fdb_learn(&queue->server->fdb, bytes + mac + ETH_ALEN, queue->peer);
+  }
+}
+
+static void server_tap_ptk(void* user, const uint8_t* bytes, size_t size) {
+  struct server_queue_t* queue = user;
+
+  uint64_t start = latency_start(queue->channel.inject);
+  int res = inter_write(queue->tap, bytes, size);
+  latency_record(queue->channel.inject, start);
+  if (res == -1) {
+    static struct stats_limit_t limit;
+    stats_error(queue->channel.stats.local_tx);
+    uint64_t count = stats_limit(&limit);
+    if (count) {
+      fprintf(stderr, "ERROR>%s inter_write %s (%" PRIu64 " frames)\n",
+              __FUNCTION__, queue->tap->name, count);
     }
+    return;
+  }
+  stats_add(queue->channel.stats.local_tx, size);
+}
 
-    bytes_count = write(server->fd, buffer, bytes_count);
-    if (bytes_count == -1) {
-      fprintf(stderr, "ERROR>%s write \n", __FUNCTION__);
-      perror("write:");
+static void server_write_ptk(void* user, const uint8_t* bytes, size_t size) {
+  server_learn(user, bytes, size);
+  server_tap_ptk(user, bytes, size);
+}
+
+// Адрес учится в потоке приема: номер пира известен только для текущей
+// датаграммы.
+static void server_push_ptk(void* user, const uint8_t* bytes, size_t size) {
+  struct server_queue_t* queue = user;
+  server_learn(queue, bytes, size);
+  ring_push(&queue->channel.rx_pipe.rings[0], bytes, size);
+}
+
+static bool server_queue_accept(void* user, const struct sockaddr_in* addr) {
+  struct server_queue_t* queue = user;
+
+  int peer = fdb_peer(&queue->server->fdb, addr, queue->peer);
+  if (peer == -1) {
+    return false;
+  }
+
+  queue->peer = peer;
+  return true;
+}
+
+static void server_queue_write(struct server_queue_t* queue, int count) {
+  struct udp_batch_t* batch = &queue->channel.rx_batch;
+  bool pipeline = base_pipeline(&queue->server->base);
+
+  for (int i = 0; i < count; i++) {
+    if (!server_queue_accept(queue, udp_batch_addr(batch, i))) {
+      stats_drop(queue->channel.stats.tunnel_rx);
       continue;
     }
+    udp_batch_split(batch, i, pipeline ? server_push_ptk : server_write_ptk,
+                    queue);
+  }
+
+  if (pipeline && count) {
+    ring_notify(&queue->channel.rx_pipe.rings[0]);
+  }
+}
+
+static int server_queue_recv(struct server_queue_t* queue, int flags) {
+  struct base_t* base = &queue->server->base;
+  struct channel_t* channel = &queue->channel;
+
+  int count = udp_batch_recv(&channel->rx_batch, channel->socket, flags);
+  if (count == -1) {
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK)) {
+      return 0;
+    }
+    fprintf(stderr, "ERROR> %s recvmmsg %s\n", __FUNCTION__, base->name_addr);
+    return -1;
+  }
+
+  server_queue_write(queue, count);
+  return count;
+}
+
+static int server_queue_event(void* user) {
+  return server_queue_recv(user, MSG_DONTWAIT);
+}
+
+static void* server_recv_thread(void* thread_data) {
+  struct server_queue_t* queue = thread_data;
+  struct base_t* base = &queue->server->base;
+
+  while (!base->terminated) {
+    server_queue_recv(queue, MSG_WAITFORONE);
   }
 
   return 0;
 }
 
+static void client_sendto_ptk(void* user, const uint8_t* bytes, size_t size) {
+  struct client_t* client = user;
+  struct channel_t* channel = &client->channel;
+
+  // Если фрагменты кадра не влезли в остаток пачки, она отправляется сразу.
+  int res = udp_batch_add(&channel->tx_batch, bytes, size);
+  if ((res == -1) && channel->tx_batch.count) {
+    base_send(&client->base, channel);
+    res = udp_batch_add(&channel->tx_batch, bytes, size);
+  }
+  if (res == -1) {
+    static struct stats_limit_t limit;
+    stats_drop(channel->stats.tunnel_tx);
+    uint64_t count = stats_limit(&limit);
+    if (count) {
+      fprintf(stderr,
+              "ERROR> %s frame %zu bytes dropped (%" PRIu64 " frames)\n",
+              __FUNCTION__, size, count);
+    }
+    return;
+  }
+  if (udp_batch_due(&channel->tx_batch)) {
+    base_send(&client->base, channel);
+  }
+}
+
+static int client_send_flush(void* user) {
+  struct client_t* client = user;
+
+  if (client->channel.tx_batch.count) {
+    base_send(&client->base, &client->channel);
+  }
+
+  return 0;
+}
+
+static void client_push_ptk(void* user, const uint8_t* bytes, size_t size) {
+  struct client_t* client = user;
+  ring_push(&client->channel.tx_pipe.rings[0], bytes, size);
+}
+
+static void client_capture_ptk(void* user, const uint8_t* bytes, size_t size) {
+  struct client_t* client = user;
+
+  stats_add(client->channel.stats.local_rx, size);
+  if (base_pipeline(&client->base)) {
+    client_push_ptk(client, bytes, size);
+  } else {
+    client_sendto_ptk(client, bytes, size);
+  }
+}
+
+static int client_capture(void* user) {
+  struct client_t* client = user;
+  bool pipeline = base_pipeline(&client->base);
+
+  int count = inter_dispatch(&client->inter, INTER_BATCH_SIZE,
+                             client_capture_ptk, client);
+  if (count == -1) {
+    fprintf(stderr, "ERROR>%s inter_dispatch %s\n", __FUNCTION__,
+            client->inter.name);
+    return -1;
+  }
+
+  if (!pipeline) {
+    client_send_flush(client);
+  } else if (count) {
+    ring_notify(&client->channel.tx_pipe.rings[0]);
+  }
+
+  return count;
+}
+
 static void* sendto_thread(void* thread_data) {
   struct client_t* client = thread_data;
   struct base_t* base = &client->base;
 
-  uint8_t buffer[1600];
-  size_t buffer_size = sizeof(buffer);
   while (!base->terminated) {
-    ssize_t bytes_count = inter_read(&client->inter, buffer, buffer_size);
-    if (bytes_count == 0) {
-      continue;
-    }
-    if (bytes_count == -1) {
-      fprintf(stderr, "ERROR>%s inter_read %s\n", __FUNCTION__,
-              client->inter.name);
-      continue;
-    }
+    client_capture(client);
+  }
 
-    int res = sendto(base->socket, buffer, bytes_count, 0,
-                     (struct sockaddr*)&base->sock_addr, base->addr_len);
-    if (res == -1) {
-      fprintf(stderr, "ERROR> %s can't send addr %s:%d\n", __FUNCTION__,
-              inet_ntoa(base->sock_addr.sin_addr), base->sock_addr.sin_port);
-      perror("sendto:");
+  return 0;
+}
+
+static void client_write_ptk(void* user, const uint8_t* bytes, size_t size) {
+  struct client_t* client = user;
+
+  uint64_t start = latency_start(client->channel.inject);
+  int res = inter_write(&client->inter, bytes, size);
+  latency_record(client->channel.inject, start);
+  if (res == -1) {
+    static struct stats_limit_t limit;
+    stats_error(client->channel.stats.local_tx);
+    uint64_t count = stats_limit(&limit);
+    if (count) {
+      fprintf(stderr, "ERROR> %s inter_write %s (%" PRIu64 " frames)\n",
+              __FUNCTION__, client->inter.name, count);
     }
+    return;
+  }
+  stats_add(client->channel.stats.local_tx, size);
+}
+
+static int client_flush(void* user) {
+  struct client_t* client = user;
+
+  if (inter_flush(&client->inter) == -1) {
+    fprintf(stderr, "ERROR> %s inter_flush %s\n", __FUNCTION__,
+            client->inter.name);
+    return -1;
   }
 
   return 0;
 }
 
-static void* recv_thread(void* thread_data) {
-  struct client_t* client = thread_data;
+static void client_rx_push_ptk(void* user, const uint8_t* bytes, size_t size) {
+  struct client_t* client = user;
+  ring_push(&client->channel.rx_pipe.rings[0], bytes, size);
+}
+
+static int client_recv(struct client_t* client, int flags) {
   struct base_t* base = &client->base;
+  struct channel_t* channel = &client->channel;
+  struct udp_batch_t* batch = &channel->rx_batch;
 
-  uint8_t buffer[1600];
-  size_t buffer_size = sizeof(buffer);
-  struct sockaddr_in addr;
-  socklen_t addrlen;
-  while (!base->terminated) {
-    ssize_t bytes_count = recvfrom(base->socket, buffer, buffer_size, 0,
-                                   (struct sockaddr*)&addr, &addrlen);
-    if (bytes_count == -1) {
-      fprintf(stderr, "ERROR> %s recvfrom %s\n", __FUNCTION__, base->name_addr);
-      continue;
+  int count = udp_batch_recv(batch, channel->socket, flags);
+  if (count == -1) {
+    // ECONNREFUSED: ICMP от сервера, который еще не запущен.
+    if ((errno == EAGAIN) || (errno == EWOULDBLOCK) ||
+        (errno == ECONNREFUSED)) {
+      return 0;
     }
+    fprintf(stderr, "ERROR> %s recvmmsg %s\n", __FUNCTION__, base->name_addr);
+    return -1;
+  }
 
-    if (memcmp(&addr, (struct sockaddr*)&base->sock_addr, addrlen)) {
-      //        inet_ntoa создает статический буффер в который записывается
-      //        строка адресса повторный вызов inet_ntoa перезаписывает этот
-      //        буффер поэтому вывод ошибки разбит на 2 функции. вызывает
-      //        опасение использование этой функции внутри потока, но другого
-      //        варианта приведения адресса не нашел.
-      fprintf(stderr,
-              "ERROR> %s package incorrect source address received:%s:%d ",
-              __FUNCTION__, inet_ntoa(addr.sin_addr), addr.sin_port);
-      fprintf(stderr, "expected:%s:%d\n ", inet_ntoa(base->sock_addr.sin_addr),
-              base->sock_addr.sin_port);
-      continue;
-    }
+  // Сокет подключен к серверу, датаграммы с других адресов отбрасывает ядро.
+  bool pipeline = base_pipeline(base);
+  for (int i = 0; i < count; i++) {
+    udp_batch_split(batch, i, pipeline ? client_rx_push_ptk : client_write_ptk,
+                    client);
+  }
 
-    int res = inter_write(&client->inter, buffer, bytes_count);
-    if (res == -1) {
-      fprintf(stderr, "ERROR> %s inter_write %s\n", __FUNCTION__,
-              client->inter.name);
+  if (pipeline) {
+    if (count) {
+      ring_notify(&channel->rx_pipe.rings[0]);
     }
+    return count;
   }
 
-  return 0;
+  client_flush(client);
+
+  return count;
 }
 
-static void* wait_for_client_thread(void* thread_data) {
-  struct server_t* server = thread_data;
+static int client_event(void* user) {
+  return client_recv(user, MSG_DONTWAIT);
+}
 
-  uint8_t buffer[1600];
-  size_t buffer_size = sizeof(buffer);
+static void* recv_thread(void* thread_data) {
+  struct client_t* client = thread_data;
+  struct base_t* base = &client->base;
 
-  struct base_t* base = &server->base;
-  ssize_t bytes_count =
-      recvfrom(server->base.socket, buffer, buffer_size, 0,
-               (struct sockaddr*)&base->sock_addr, &base->addr_len);
-  if (bytes_count == -1) {
-    fprintf(stderr, "ERROR> %s can't recvfrom\n", __FUNCTION__);
-    return 0;
+  while (!base->terminated) {
+    client_recv(client, MSG_WAITFORONE);
   }
 
-  bytes_count = write(server->fd, buffer, bytes_count);
-  if (bytes_count == -1) {
-    fprintf(stderr, "ERROR>%s write \n", __FUNCTION__);
-    perror("write:");
-  }
+  return 0;
+}
 
+static int channel_run(struct channel_t* channel,
+                       struct base_t* base,
+                       void* (*recv_routine)(void*),
+                       void* (*sendto_routine)(void*),
+                       void* thread_data) {
   int res =
-      pthread_create(&base->read_thread, NULL, server_recv_thread, server);
+      pthread_create(&channel->read_thread, NULL, recv_routine, thread_data);
   if (res != 0) {
     fprintf(stderr,
             "ERROR> %s pthread_create recv_thread addres: %s port: %d \n",
             __FUNCTION__, base->name_addr, base->port);
+    return res;
+  }
+  cpu_place_thread(channel->read_thread, "tunnel.rx");
+
+  if (!sendto_routine) {
     return 0;
   }
 
-  res = pthread_create(&base->write_thread, NULL, server_sendto_thread, server);
+  res =
+      pthread_create(&channel->write_thread, NULL, sendto_routine, thread_data);
   if (res != 0) {
     fprintf(stderr,
             "ERROR> %s pthread_create sendto_thread addres: %s port: %d \n",
             __FUNCTION__, base->name_addr, base->port);
-    return 0;
+    return res;
+  }
+  cpu_place_thread(channel->write_thread, "tunnel.tx");
+
+  return 0;
+}
+
+// Конвейер: потоки приема и захвата только кладут кадры в кольца, а пишут в
+// интерфейс и отправляют в сокет отдельные потоки, разбирая кольца пачками.
+// Если поток записи не успевает, кадры отбрасываются и считаются в кольце,
+// прием при этом не останавливается.
+static int channel_run_pipeline(struct channel_t* channel,
+                                struct base_t* base,
+                                ring_handler_t write_handler,
+                                ring_flush_t write_flush,
+                                ring_handler_t send_handler,
+                                ring_flush_t send_flush,
+                                void* user,
+                                struct pool_t* pool) {
+  size_t size = base->config.engine.ring_size;
+  if ((ring_reader_open(&channel->rx_pipe, stats_name(channel->stats.local_tx),
+                        1, size, write_handler, write_flush, user,
+                        pool) == -1) ||
+      (ring_reader_run(&channel->rx_pipe) == -1)) {
+    return -1;
+  }
+
+  if (send_handler &&
+      ((ring_reader_open(&channel->tx_pipe,
+                         stats_name(channel->stats.tunnel_tx), 1, size,
+                         send_handler, send_flush, user, pool) == -1) ||
+       (ring_reader_run(&channel->tx_pipe) == -1))) {
+    return -1;
   }
 
   return 0;
 }
 
-static int base_init(struct base_t* base, const char* addr, int server_port) {
-  int base_socket = socket(AF_INET, SOCK_DGRAM, 0);
-  if (base_socket < 0) {
+// Оба направления канала обслуживаются одним потоком: сокет туннеля и
+// источник кадров (tap или интерфейс) опрашиваются через epoll.
+static int channel_run_engine(struct channel_t* channel,
+                              struct base_t* base,
+                              engine_handler_t recv_handler,
+                              int fd,
+                              engine_handler_t read_handler,
+                              void* user) {
+  struct engine_t* engine = &channel->engine;
+  if (engine_open(engine, &base->config.engine) == -1) {
     return -1;
   }
 
+  if (engine_add(engine, channel->socket, recv_handler, user) == -1) {
+    return -1;
+  }
+  if (read_handler && (engine_add(engine, fd, read_handler, user) == -1)) {
+    return -1;
+  }
+
+  if (engine_run(engine) == -1) {
+    fprintf(stderr, "ERROR> %s engine_run addres: %s port: %d \n",
+            __FUNCTION__, base->name_addr, base->port);
+    return -1;
+  }
+
+  return 0;
+}
+
+// Если io_uring недоступен, канал обслуживается потоками.
+static int channel_open_uring(struct channel_t* channel,
+                              struct base_t* base,
+                              int fd,
+                              size_t fd_size,
+                              uring_accept_t accept,
+                              void* user) {
+  struct uring_channel_t* uring = &channel->uring;
+  size_t rx_size = channel->rx_batch.buffer_size;
+  if (uring_channel_open(uring, channel->socket, fd, rx_size, fd_size) == -1) {
+    fprintf(stderr, "WARNING> %s io_uring unavailable, using threads\n",
+            __FUNCTION__);
+    return -1;
+  }
+
+  uring->peer = &base->sock_addr;
+  uring->gso = channel->tx_batch.gso;
+  uring->mtu = channel->tx_batch.mtu;
+  uring->fragment_id = channel->tx_batch.fragment_id;
+  uring->flags = channel->tx_batch.flags;
+  uring->reasm = &channel->reasm;
+  uring->stats = &channel->stats;
+  uring->accept = accept;
+  uring->user = user;
+
+  return 0;
+}
+
+static int server_queue_run(struct server_queue_t* queue) {
+  struct base_t* base = &queue->server->base;
+  struct channel_t* channel = &queue->channel;
+  if ((base->config.engine.type == ENGINE_URING) &&
+      (channel_open_uring(channel, base, queue->fd,
+                          queue->tap_owner ? REMOTE_BUFFER_SIZE : 0,
+                          server_queue_accept, queue) == 0)) {
+    channel->uring.route = server_route;
+    channel->uring.learn_handler = server_learn;
+    return uring_channel_run(&channel->uring);
+  }
+  if (base->config.engine.type == ENGINE_EPOLL) {
+    return channel_run_engine(&queue->channel, base, server_queue_event,
+                              queue->fd,
+                              queue->tap_owner ? server_queue_read : NULL,
+                              queue);
+  }
+  if (base_pipeline(base) &&
+      (channel_run_pipeline(channel, base, server_tap_ptk, NULL,
+                            queue->tap_owner ? server_queue_send_ptk : NULL,
+                            server_queue_send_flush, queue,
+                            &queue->server->pool) == -1)) {
+    return -1;
+  }
+
+  return channel_run(&queue->channel, base, server_recv_thread,
+                     queue->tap_owner ? server_sendto_thread : NULL, queue);
+}
+
+void remote_config_default(struct remote_config_t* config) {
+  config->batch = 32;
+  config->gso = true;
+  config->gro = true;
+  config->queues = 1;
+  config->shards = 0;
+  config->steer = false;
+  config->fdb_age = FDB_AGE;
+  config->mtu = TUNNEL_MTU;
+  config->flush_delay = 100;
+  config->reasm_timeout = TUNNEL_REASM_TIMEOUT;
+  config->reasm_memory = TUNNEL_REASM_MEMORY;
+  config->socket_buffer = REMOTE_SOCKET_BUFFER;
+  config->vnet_hdr = false;
+  config->allow_peer_count = 0;
+  engine_config_default(&config->engine);
+}
+
+int remote_parse_peers(struct remote_config_t* config, const char* list) {
+  char* copy = strdup(list);
+  if (!copy) {
+    return -1;
+  }
+
+  int res = 0;
+  char* save = NULL;
+  for (char* addr = strtok_r(copy, ",", &save); addr;
+       addr = strtok_r(NULL, ",", &save)) {
+    if ((config->allow_peer_count >= REMOTE_MAX_ALLOW) ||
+        (inet_pton(AF_INET, addr,
+                   &config->allow_peers[config->allow_peer_count]) != 1)) {
+      fprintf(stderr, "ERROR> %s incorrect address %s\n", __FUNCTION__, addr);
+      res = -1;
+      break;
+    }
+    config->allow_peer_count++;
+  }
+
+  free(copy);
+  return res;
+}
+
+static int base_init(struct base_t* base,
+                     const char* addr,
+                     int server_port,
+                     const struct remote_config_t* config) {
   base->name_addr = strdup(addr);
   base->port = server_port;
-  base->socket = base_socket;
   base->terminated = false;
   base->addr_len = sizeof(base->sock_addr);
-  base->read_thread = 0;
-  base->write_thread = 0;
+  base->config = *config;
 
   struct hostent* hosten = gethostbyname(addr);
   if (!hosten) {
@@ -226,6 +741,7 @@ static int base_init(struct base_t* base, const char* addr, int server_port) {
     return -1;
   }
 
+  memset(&base->sock_addr, 0, sizeof(base->sock_addr));
   base->sock_addr.sin_family = AF_INET;
   base->sock_addr.sin_port = htons(server_port);
   base->sock_addr.sin_addr = *addr_list[0];
@@ -233,23 +749,226 @@ static int base_init(struct base_t* base, const char* addr, int server_port) {
   return 0;
 }
 
-static void base_stop(struct base_t* base) {
-  base->terminated = true;
+static void base_free(struct base_t* base) {
+  free(base->name_addr);
+}
+
+static uint32_t channel_count = 0;
 
-  pthread_cancel(base->read_thread);
-  pthread_cancel(base->write_thread);
+// Кадр в 64К режется на несколько десятков датаграмм, которые приходят
+// подряд: буфера сокета по умолчанию на это не хватает. Под root размер не
+// ограничен net.core.rmem_max.
+static void channel_socket_buffer(int socket, int size) {
+  if (size <= 0) {
+    return;
+  }
 
-  pthread_join(base->read_thread, NULL);
-  pthread_join(base->write_thread, NULL);
+  if ((setsockopt(socket, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) ==
+       -1) &&
+      (setsockopt(socket, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) == -1)) {
+    fprintf(stderr, "WARNING> %s SO_RCVBUF %d\n", __FUNCTION__, size);
+  }
+  if ((setsockopt(socket, SOL_SOCKET, SO_SNDBUFFORCE, &size, sizeof(size)) ==
+       -1) &&
+      (setsockopt(socket, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size)) == -1)) {
+    fprintf(stderr, "WARNING> %s SO_SNDBUF %d\n", __FUNCTION__, size);
+  }
 }
 
-static void base_free(struct base_t* base) {
-  free(base->name_addr);
+static void channel_init(struct channel_t* channel) {
+  channel->socket = -1;
+  channel->read_thread = 0;
+  channel->write_thread = 0;
+  channel->inject = NULL;
+  ring_reader_init(&channel->rx_pipe);
+  ring_reader_init(&channel->tx_pipe);
+  memset(&channel->rx_batch, 0, sizeof(channel->rx_batch));
+  memset(&channel->tx_batch, 0, sizeof(channel->tx_batch));
+  memset(&channel->reasm, 0, sizeof(channel->reasm));
+  engine_init(&channel->engine);
+  uring_channel_init(&channel->uring);
+}
+
+static struct latency_hist_t* channel_latency(const char* prefix,
+                                              const char* stage) {
+  char name[STATS_NAME_SIZE];
+  snprintf(name, sizeof(name), "%s%s", prefix, stage);
+  return latency_hist(name);
+}
+
+// Фильтр сокета отбрасывает в ядре датаграммы не нашего формата и с чужих
+// адресов, до копирования и пробуждения потока приема. Фильтр UDP сокета
+// видит датаграмму с заголовка UDP, адрес источника - через SKF_NET_OFF.
+static int channel_filter(struct channel_t* channel,
+                          const struct remote_config_t* config) {
+  const unsigned int header = sizeof(struct udphdr);
+  unsigned int peers = config->allow_peer_count;
+  struct sock_filter code[9 + REMOTE_MAX_ALLOW];
+  unsigned int count = 0;
+
+  // Проверка типа переходит на drop или accept в конце программы, между
+  // ними и типом лежит проверка адреса, если список задан.
+  unsigned int skip = peers ? peers + 1 : 0;
+  struct sock_filter check[] = {
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+               header + offsetof(struct tunnel_header_t, version)),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TUNNEL_VERSION, 1, 0),
+      BPF_STMT(BPF_RET | BPF_K, 0),
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+               header + offsetof(struct tunnel_header_t, type)),
+      BPF_STMT(BPF_ALU | BPF_AND | BPF_K, TUNNEL_TYPE_MASK),
+      BPF_JUMP(BPF_JMP | BPF_JGT | BPF_K, TUNNEL_FRAGMENT, skip,
+               peers ? 0 : 1),
+  };
+  memcpy(code, check, sizeof(check));
+  count = sizeof(check) / sizeof(check[0]);
+
+  if (peers) {
+    struct sock_filter load =
+        BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 12);
+    code[count++] = load;
+    for (unsigned int i = 0; i < peers; i++) {
+      struct sock_filter peer =
+          BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K,
+                   ntohl(config->allow_peers[i].s_addr), peers - i, 0);
+      code[count++] = peer;
+    }
+  }
+
+  struct sock_filter verdict[] = {
+      BPF_STMT(BPF_RET | BPF_K, 0),
+      BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+  };
+  memcpy(code + count, verdict, sizeof(verdict));
+  count += sizeof(verdict) / sizeof(verdict[0]);
+
+  struct sock_fprog prog = {count, code};
+  if (setsockopt(channel->socket, SOL_SOCKET, SO_ATTACH_FILTER, &prog,
+                 sizeof(prog)) == -1) {
+    fprintf(stderr, "ERROR> %s setsockopt SO_ATTACH_FILTER\n", __FUNCTION__);
+    return -1;
+  }
+
+  return 0;
+}
+
+// prefix и local - начало имен счетчиков канала и имя интерфейса или tap.
+static int channel_open(struct channel_t* channel,
+                        struct base_t* base,
+                        const char* prefix,
+                        const char* local) {
+  const struct remote_config_t* config = &base->config;
+  stats_tunnel_init(&channel->stats, prefix, local);
+
+  channel->socket = socket(AF_INET, SOCK_DGRAM, 0);
+  if (channel->socket < 0) {
+    fprintf(stderr, "ERROR> %s socket\n", __FUNCTION__);
+    return -1;
+  }
+  cpu_socket(channel->socket);
+
+  if (channel_filter(channel, config) == -1) {
+    return -1;
+  }
+
+  bool gso = config->gso;
+  bool gro = config->gro;
+  udp_socket_offload(channel->socket, &gso, &gro);
+  channel_socket_buffer(channel->socket, config->socket_buffer);
+
+  // Отправляемая датаграмма не больше mtu, кроме фрагментов не меньше
+  // TUNNEL_MIN_CHUNK. Пачка отправки вмещает все фрагменты самого большого
+  // кадра. Принимаются датаграммы любого размера, mtu у пира может быть
+  // другим.
+  size_t datagram_size = UDP_GRO_BUFFER_SIZE;
+  if (config->mtu) {
+    datagram_size = TUNNEL_FRAGMENT_OVERHEAD + TUNNEL_MIN_CHUNK;
+    if (config->mtu > datagram_size) {
+      datagram_size = config->mtu;
+    }
+  }
+  unsigned int tx_depth = tunnel_fragments(config->mtu, TUNNEL_MAX_FRAME_SIZE);
+  if (config->batch > tx_depth) {
+    tx_depth = config->batch;
+  }
+  if ((udp_batch_init(&channel->rx_batch, config->batch,
+                      UDP_GRO_BUFFER_SIZE) == -1) ||
+      (udp_batch_init(&channel->tx_batch, tx_depth, datagram_size) == -1)) {
+    return -1;
+  }
+  if (tunnel_reasm_init(&channel->reasm, TUNNEL_REASM_SLOTS,
+                        config->reasm_timeout, config->reasm_memory) == -1) {
+    return -1;
+  }
+  uint8_t flags = config->vnet_hdr ? TUNNEL_VNET : 0;
+  channel->rx_batch.stats = channel->stats.tunnel_rx;
+  channel->tx_batch.stats = channel->stats.tunnel_tx;
+  channel->rx_batch.latency = channel_latency(prefix, "tunnel.receive");
+  channel->tx_batch.encapsulate = channel_latency(prefix, "tunnel.encapsulate");
+  channel->tx_batch.latency = channel_latency(prefix, "tunnel.send");
+  char inject[STATS_NAME_SIZE];
+  snprintf(inject, sizeof(inject), "%.32s.inject", local);
+  channel->inject = channel_latency(prefix, inject);
+  channel->rx_batch.gro = gro;
+  channel->rx_batch.reasm = &channel->reasm;
+  channel->rx_batch.flags = flags;
+  channel->tx_batch.flags = flags;
+  channel->tx_batch.gso = gso;
+  channel->tx_batch.mtu = config->mtu;
+  channel->tx_batch.delay = config->flush_delay;
+  // Номера фрагментированных кадров у каналов не пересекаются: клиент
+  // собирает кадры от всех очередей сервера по одному адресу.
+  channel->tx_batch.fragment_id =
+      __atomic_fetch_add(&channel_count, 1, __ATOMIC_RELAXED) << 24;
+
+  return 0;
+}
+
+// Потоки отправки останавливаются после потоков, которые кладут кадры в их
+// кольца.
+static void channel_stop(struct channel_t* channel) {
+  engine_stop(&channel->engine);
+  uring_channel_stop(&channel->uring);
+  if (channel->read_thread) {
+    pthread_cancel(channel->read_thread);
+    pthread_join(channel->read_thread, NULL);
+    channel->read_thread = 0;
+  }
+  if (channel->write_thread) {
+    pthread_cancel(channel->write_thread);
+    pthread_join(channel->write_thread, NULL);
+    channel->write_thread = 0;
+  }
+
+  if (channel->rx_pipe.rings) {
+    ring_reader_stop(&channel->rx_pipe);
+    ring_reader_report(&channel->rx_pipe, stderr);
+  }
+  if (channel->tx_pipe.rings) {
+    ring_reader_stop(&channel->tx_pipe);
+    ring_reader_report(&channel->tx_pipe, stderr);
+  }
+}
+
+static void channel_close(struct channel_t* channel) {
+  if (channel->socket != -1) {
+    close(channel->socket);
+    channel->socket = -1;
+  }
+  udp_batch_free(&channel->rx_batch);
+  udp_batch_free(&channel->tx_batch);
+  tunnel_reasm_free(&channel->reasm);
+  ring_reader_close(&channel->rx_pipe);
+  ring_reader_close(&channel->tx_pipe);
+  engine_close(&channel->engine);
+  uring_channel_close(&channel->uring);
 }
 
 struct client_t* client_init(const char* inter_name,
                              const char* server_addr,
-                             int server_port) {
+                             int server_port,
+                             const struct inter_config_t* inter_config,
+                             const struct remote_config_t* config) {
   if ((strlen(inter_name) >= 4) && (inter_name[0] == 't') &&
       (inter_name[1] == 'a') && (inter_name[2] == 'p')) {
     fprintf(stderr, "ERROR>client not expects tap(%s) interface\n", inter_name);
@@ -265,12 +984,28 @@ struct client_t* client_init(const char* inter_name,
     fprintf(stderr, "ERROR> %s malloc %s\n", __FUNCTION__, server_addr);
     return NULL;
   }
-  int res = base_init(&client->base, server_addr, server_port);
+  channel_init(&client->channel);
+  inter_init(&client->inter, inter_name, inter_config);
+
+  int res = base_init(&client->base, server_addr, server_port, config);
+  if (res == -1) {
+    goto aborting;
+  }
+
+  res = channel_open(&client->channel, &client->base, "", inter_name);
+  if (res == -1) {
+    goto aborting;
+  }
+
+  // У подключенного сокета датаграммы с других адресов отбрасывает ядро.
+  res = connect(client->channel.socket,
+                (struct sockaddr*)&client->base.sock_addr,
+                client->base.addr_len);
   if (res == -1) {
+    fprintf(stderr, "ERROR> %s connect %s\n", __FUNCTION__, server_addr);
     goto aborting;
   }
 
-  inter_init(&client->inter, inter_name, 1);
   res = inter_open(&client->inter);
   if (res == -1) {
     goto aborting;
@@ -279,16 +1014,128 @@ struct client_t* client_init(const char* inter_name,
   return client;
 
 aborting:
-  close(client->base.socket);
+  channel_close(&client->channel);
   base_free(&client->base);
   free(client);
 
   return NULL;
 }
 
+static int server_queue_open(struct server_queue_t* queue,
+                             const char* inter_name) {
+  struct server_t* server = queue->server;
+  struct base_t* base = &server->base;
+
+  char prefix[16];
+  snprintf(prefix, sizeof(prefix), "queue%u.",
+           (unsigned int)(queue - server->queues));
+  int res = channel_open(&queue->channel, base, prefix, inter_name);
+  if (res == -1) {
+    return -1;
+  }
+
+  if (server->queue_count > 1) {
+    int one = 1;
+    res = setsockopt(queue->channel.socket, SOL_SOCKET, SO_REUSEPORT, &one,
+                     sizeof(one));
+    if (res == -1) {
+      fprintf(stderr, "ERROR> %s SO_REUSEPORT", __FUNCTION__);
+      return -1;
+    }
+  }
+
+  res = bind(queue->channel.socket, (struct sockaddr*)&base->sock_addr,
+             base->addr_len);
+  if (res != 0) {
+    fprintf(stderr, "ERROR> %s bind", __FUNCTION__);
+    return -1;
+  }
+
+  // Лишние шарды только принимают и пишут в уже открытую очередь tap.
+  queue->tap = &server->taps[(queue - server->queues) % server->tap_count];
+  if (!queue->tap_owner) {
+    queue->fd = inter_get_fd(queue->tap);
+    return 0;
+  }
+
+  queue->buffer = malloc(REMOTE_BUFFER_SIZE);
+  if (!queue->buffer) {
+    fprintf(stderr, "ERROR> %s malloc", __FUNCTION__);
+    return -1;
+  }
+  pool_cache_init(&queue->cache, server->pool.memory ? &server->pool : NULL);
+
+  // Поток tap сам ждет кадры в poll, чтение не должно блокироваться.
+  if ((inter_open(queue->tap) == -1) ||
+      (inter_setnonblock(queue->tap) == -1)) {
+    fprintf(stderr, "ERROR> %s inter_open %s\n", __FUNCTION__, inter_name);
+    return -1;
+  }
+  queue->fd = inter_get_fd(queue->tap);
+
+  return 0;
+}
+
+static void server_queue_close(struct server_queue_t* queue) {
+  channel_close(&queue->channel);
+  if (queue->tap_owner && queue->tap) {
+    inter_close(queue->tap);
+  }
+  queue->fd = -1;
+  free(queue->buffer);
+  queue->buffer = NULL;
+}
+
+#define SERVER_STEER_HASH(mac, count)                 \
+  BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (mac)),          \
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),                \
+      BPF_STMT(BPF_LD | BPF_W | BPF_ABS, (mac) + 6),  \
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),         \
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),                \
+      BPF_STMT(BPF_LD | BPF_H | BPF_ABS, (mac) + 4),  \
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),         \
+      BPF_STMT(BPF_MISC | BPF_TAX, 0),                \
+      BPF_STMT(BPF_LD | BPF_H | BPF_ABS, (mac) + 10), \
+      BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0),         \
+      BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, (count)),   \
+      BPF_STMT(BPF_RET | BPF_A, 0)
+#define SERVER_STEER_HASH_SIZE 12
+
+// Датаграмма распределяется по сокетам группы SO_REUSEPORT по хешу MAC адресов
+// первого вложенного кадра. Хеш симметричный, поэтому оба направления одного
+// потока попадают в один шард и порядок кадров сохраняется. У фрагментов MAC
+// адреса лежат в заголовке фрагмента, у кадров с virtio_net_hdr - после него.
+static int server_steer(struct server_t* server) {
+  unsigned int mac = TUNNEL_OVERHEAD;
+  if (server->base.config.vnet_hdr) {
+    mac += TUNNEL_VNET_SIZE;
+  }
+  struct sock_filter code[] = {
+      BPF_STMT(BPF_LD | BPF_B | BPF_ABS,
+               offsetof(struct tunnel_header_t, type)),
+      BPF_STMT(BPF_ALU | BPF_AND | BPF_K, TUNNEL_TYPE_MASK),
+      BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, TUNNEL_FRAGMENT,
+               SERVER_STEER_HASH_SIZE, 0),
+      SERVER_STEER_HASH(mac, server->queue_count),
+      SERVER_STEER_HASH(TUNNEL_OVERHEAD, server->queue_count),
+  };
+  struct sock_fprog prog = {sizeof(code) / sizeof(code[0]), code};
+
+  int res = setsockopt(server->queues[0].channel.socket, SOL_SOCKET,
+                       SO_ATTACH_REUSEPORT_CBPF, &prog, sizeof(prog));
+  if (res == -1) {
+    fprintf(stderr, "WARNING> %s SO_ATTACH_REUSEPORT_CBPF unsupported\n",
+            __FUNCTION__);
+  }
+
+  return res;
+}
+
 struct server_t* server_init(const char* inter_name,
                              const char* name_addr,
-                             int port) {
+                             int port,
+                             const struct filter_config_t* filter,
+                             const struct remote_config_t* config) {
   if ((strlen(inter_name) < 4) || (inter_name[0] != 't') ||
       (inter_name[1] != 'a') || (inter_name[2] != 'p')) {
     fprintf(stderr, "ERROR>server expects tap(%s) interface\n", inter_name);
@@ -300,40 +1147,87 @@ struct server_t* server_init(const char* inter_name,
     fprintf(stderr, "ERROR> %s malloc %s\n", __FUNCTION__, name_addr);
     return NULL;
   }
+  server->tap_count = config->queues ? config->queues : 1;
+  server->queue_count = server->tap_count;
+  if (config->shards > server->queue_count) {
+    server->queue_count = config->shards;
+  }
+  server->queues = calloc(server->queue_count, sizeof(*server->queues));
+  server->taps = calloc(server->tap_count, sizeof(*server->taps));
+  if (!server->queues || !server->taps) {
+    fprintf(stderr, "ERROR> %s malloc queues %u\n", __FUNCTION__,
+            server->queue_count);
+    free(server->queues);
+    free(server->taps);
+    free(server);
+    return NULL;
+  }
+
+  // tap - обычный интерфейс с бэкендом tap: очередь multiqueue устройства
+  // на каждый поток tap. Фильтр захвата проверяет кадры, которые ядро
+  // отдает в tap.
+  struct inter_config_t tap_config;
+  inter_config_default(&tap_config);
+  tap_config.backend = INTER_BACKEND_TAP;
+  tap_config.filter = *filter;
+  tap_config.multi_queue = server->tap_count > 1;
+  tap_config.afpacket.vnet_hdr = config->vnet_hdr;
+  for (unsigned int i = 0; i < server->tap_count; i++) {
+    inter_init(&server->taps[i], inter_name, &tap_config);
+  }
+  for (unsigned int i = 0; i < server->queue_count; i++) {
+    server->queues[i].server = server;
+    server->queues[i].fd = -1;
+    server->queues[i].tap_owner = i < server->tap_count;
+    server->queues[i].peer = -1;
+    channel_init(&server->queues[i].channel);
+  }
+
+  server->fdb.table = NULL;
+  server->pool.memory = NULL;
 
-  int res = base_init(&server->base, name_addr, port);
+  int res = base_init(&server->base, name_addr, port, config);
   if (res == -1) {
     goto aborting;
   }
 
-  res = bind(server->base.socket, (struct sockaddr*)&server->base.sock_addr,
-             server->base.addr_len);
-  if (res != 0) {
-    fprintf(stderr, "ERROR> %s bind", __FUNCTION__);
+  res = fdb_init(&server->fdb, config->fdb_age);
+  if (res == -1) {
     goto aborting;
   }
-  server->wait_thread = 0;
 
-  server->fd = open("/dev/net/tun", O_RDWR);
-  if (server->fd == -1) {
-    fprintf(stderr, "ERROR> %s open", __FUNCTION__);
-    goto aborting;
+  // Пулом буферов пользуется только конвейер: кадры из tap лежат в нем, пока
+  // их не разберет поток отправки.
+  if ((config->engine.type == ENGINE_PIPELINE) && config->engine.pool_count) {
+    res = pool_init(&server->pool, config->engine.pool_count,
+                    config->engine.pool_buffer_size, config->engine.hugepages);
+    if (res == -1) {
+      goto aborting;
+    }
   }
 
-  struct ifreq ifr = {0};
-  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
-  strncpy(ifr.ifr_name, inter_name, IFNAMSIZ);
-  res = ioctl(server->fd, TUNSETIFF, &ifr);
-  if (res == -1) {
-    fprintf(stderr, "ERROR> %s ioctl", __FUNCTION__);
-    goto aborting;
+  for (unsigned int i = 0; i < server->queue_count; i++) {
+    res = server_queue_open(&server->queues[i], inter_name);
+    if (res == -1) {
+      goto aborting;
+    }
+  }
+
+  if (config->steer && (server->queue_count > 1)) {
+    server_steer(server);
   }
 
   return server;
 
 aborting:
-  close(server->base.socket);
+  for (unsigned int i = 0; i < server->queue_count; i++) {
+    server_queue_close(&server->queues[i]);
+  }
   base_free(&server->base);
+  fdb_free(&server->fdb);
+  pool_free(&server->pool);
+  free(server->queues);
+  free(server->taps);
   free(server);
 
   return NULL;
@@ -341,54 +1235,116 @@ aborting:
 
 int client_run(struct client_t* client) {
   struct base_t* base = &client->base;
-  int res = pthread_create(&base->read_thread, NULL, recv_thread, client);
-  if (res != 0) {
-    fprintf(stderr,
-            "ERROR> %s pthread_create recv_thread addres: %s port: %d \n",
-            __FUNCTION__, base->name_addr, base->port);
-    return res;
+  struct channel_t* channel = &client->channel;
+  if ((base->config.engine.type == ENGINE_URING) &&
+      (channel_open_uring(channel, base, -1, 0, NULL, client) == 0)) {
+    if (inter_setnonblock(&client->inter) == -1) {
+      return -1;
+    }
+    channel->uring.frame_handler = client_write_ptk;
+    channel->uring.poll_fd = inter_get_fd(&client->inter);
+    channel->uring.poll_handler = client_capture;
+    channel->uring.flush_handler = client_flush;
+    return uring_channel_run(&channel->uring);
   }
-
-  res = pthread_create(&base->write_thread, NULL, sendto_thread, client);
-  if (res != 0) {
-    fprintf(stderr,
-            "ERROR> %s pthread_create sendto_thread addres: %s port: %d \n",
-            __FUNCTION__, base->name_addr, base->port);
-    return res;
+  if (base->config.engine.type == ENGINE_EPOLL) {
+    if (inter_setnonblock(&client->inter) == -1) {
+      return -1;
+    }
+    return channel_run_engine(&client->channel, base, client_event,
+                              inter_get_fd(&client->inter), client_capture,
+                              client);
+  }
+  if (base_pipeline(base) &&
+      (channel_run_pipeline(channel, base, client_write_ptk, client_flush,
+                            client_sendto_ptk, client_send_flush, client,
+                            NULL) == -1)) {
+    return -1;
   }
 
-  return res;
+  return channel_run(&client->channel, base, recv_thread, sendto_thread,
+                     client);
 }
 
+// Клиенты подключаются в любой момент: пир запоминается по первой его
+// датаграмме, поэтому все очереди запускаются сразу.
 int server_run(struct server_t* server) {
-  int res = pthread_create(&server->wait_thread, NULL, wait_for_client_thread,
-                           server);
-  if (res != 0) {
-    fprintf(stderr, "ERROR> %s pthread_create wait_for_client_thread",
-            __FUNCTION__);
+  for (unsigned int i = 0; i < server->queue_count; i++) {
+    if (server_queue_run(&server->queues[i]) != 0) {
+      return -1;
+    }
   }
 
   return 0;
 }
 
-void server_stop(struct server_t* server) {
-  base_stop(&server->base);
+int client_attach(struct client_t* client, struct worker_pool_t* pool) {
+  if (client->base.config.engine.type != ENGINE_THREADS) {
+    fprintf(stderr, "ERROR> %s engine is set by worker pool\n", __FUNCTION__);
+    return -1;
+  }
+  if (inter_setnonblock(&client->inter) == -1) {
+    return -1;
+  }
 
-  pthread_cancel(server->wait_thread);
-  pthread_join(server->wait_thread, NULL);
+  if ((worker_pool_add(pool, client->channel.socket, client_event, client) ==
+       -1) ||
+      (worker_pool_add(pool, inter_get_fd(&client->inter), client_capture,
+                       client) == -1)) {
+    return -1;
+  }
+
+  return 0;
+}
 
-  close(server->base.socket);
+int server_attach(struct server_t* server, struct worker_pool_t* pool) {
+  if (server->base.config.engine.type != ENGINE_THREADS) {
+    fprintf(stderr, "ERROR> %s engine is set by worker pool\n", __FUNCTION__);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < server->queue_count; i++) {
+    struct server_queue_t* queue = &server->queues[i];
+    if (worker_pool_add(pool, queue->channel.socket, server_queue_event,
+                        queue) == -1) {
+      return -1;
+    }
+    if (queue->tap_owner && (worker_pool_add(pool, queue->fd,
+                                             server_queue_read, queue) == -1)) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+void server_stop(struct server_t* server) {
+  server->base.terminated = true;
+
+  // Шарды пишут в tap очереди-владельца: tap закрывается только после
+  // остановки всех очередей.
+  for (unsigned int i = 0; i < server->queue_count; i++) {
+    channel_stop(&server->queues[i].channel);
+  }
+  for (unsigned int i = 0; i < server->queue_count; i++) {
+    server_queue_close(&server->queues[i]);
+  }
 }
 
 void client_stop(struct client_t* client) {
-  base_stop(&client->base);
+  client->base.terminated = true;
+  channel_stop(&client->channel);
 
-  close(client->base.socket);
+  channel_close(&client->channel);
   inter_close(&client->inter);
 }
 
 void server_free(struct server_t* server) {
   base_free(&server->base);
+  fdb_free(&server->fdb);
+  pool_free(&server->pool);
+  free(server->queues);
+  free(server->taps);
   free(server);
 }
 
@@ -1,46 +1,118 @@
 #ifndef REMOTE_H
 #define REMOTE_H
 
+#include "engine.h"
+#include "fdb.h"
 #include "interface.h"
+#include "latency.h"
+#include "ring.h"
+#include "stats.h"
+#include "udp.h"
+#include "uring.h"
+#include "worker.h"
 
 #include <inttypes.h>
 #include <pcap.h>
 #include <pthread.h>
 #include <stdbool.h>
 
+#define REMOTE_BUFFER_SIZE TUNNEL_MAX_FRAME_SIZE
+#define REMOTE_SOCKET_BUFFER (4 << 20)
+#define REMOTE_MAX_ALLOW 64
+
+struct remote_config_t {
+  unsigned int batch;
+  bool gso;
+  bool gro;
+  unsigned int queues;
+  unsigned int shards;
+  bool steer;
+  unsigned int fdb_age;
+  unsigned int mtu;
+  unsigned int flush_delay;
+  unsigned int reasm_timeout;
+  size_t reasm_memory;
+  int socket_buffer;
+  bool vnet_hdr;
+  // Адреса, с которых сокет туннеля принимает датаграммы, пустой список -
+  // с любых.
+  struct in_addr allow_peers[REMOTE_MAX_ALLOW];
+  unsigned int allow_peer_count;
+  struct engine_config_t engine;
+};
+
+struct channel_t {
+  int socket;
+  struct udp_batch_t rx_batch;
+  struct udp_batch_t tx_batch;
+  struct tunnel_reasm_t reasm;
+  pthread_t read_thread;
+  pthread_t write_thread;
+  struct ring_reader_t rx_pipe;
+  struct ring_reader_t tx_pipe;
+  struct stats_tunnel_t stats;
+  struct latency_hist_t* inject;
+  struct engine_t engine;
+  struct uring_channel_t uring;
+};
+
 struct base_t {
   struct sockaddr_in sock_addr;
   socklen_t addr_len;
   char* name_addr;
   int port;
-  int socket;
   bool terminated;
-  pthread_t read_thread;
-  pthread_t write_thread;
+  struct remote_config_t config;
+};
+
+struct server_queue_t {
+  struct server_t* server;
+  struct channel_t channel;
+  struct interface_bridge_t* tap;
+  int fd;
+  uint8_t* buffer;
+  struct pool_cache_t cache;
+  bool tap_owner;
+  int peer;
 };
 
 struct server_t {
   struct base_t base;
-  pthread_t wait_thread;
-  int fd;
+  struct fdb_t fdb;
+  struct pool_t pool;
+  struct server_queue_t* queues;
+  unsigned int queue_count;
+  struct interface_bridge_t* taps;
+  unsigned int tap_count;
 };
 
 struct client_t {
   struct base_t base;
+  struct channel_t channel;
   struct interface_bridge_t inter;
 };
 
+void remote_config_default(struct remote_config_t* config);
+int remote_parse_peers(struct remote_config_t* config, const char* list);
+
 struct client_t* client_init(const char* inter_name,
                              const char* serv_addr,
-                             int serv_port);
+                             int serv_port,
+                             const struct inter_config_t* inter_config,
+                             const struct remote_config_t* config);
 int client_run(struct client_t* client);
+// Оба направления моста обслуживает общий пул потоков.
+int client_attach(struct client_t* client, struct worker_pool_t* pool);
 void client_stop(struct client_t* client);
 void client_free(struct client_t* client);
 
 struct server_t* server_init(const char* inter_name,
                              const char* name_addr,
-                             int port);
+                             int port,
+                             const struct filter_config_t* filter,
+                             const struct remote_config_t* config);
 int server_run(struct server_t* server);
+int server_attach(struct server_t* server, struct worker_pool_t* pool);
 void server_stop(struct server_t* server);
 void server_free(struct server_t* server);
 
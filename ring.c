@@ -0,0 +1,340 @@
+#include "ring.h"
+#include "cpu.h"
+
+#include <linux/futex.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define RING_RECORD 16
+#define RING_ALIGN 8
+#define RING_WRAP UINT32_MAX
+#define RING_INLINE 0
+#define RING_BUFFER 1
+#define RING_WAIT_NS 100000000
+
+static size_t ring_record(size_t size) {
+  return RING_RECORD + ((size + RING_ALIGN - 1) & ~(size_t)(RING_ALIGN - 1));
+}
+
+static void ring_futex_wait(uint32_t* word, uint32_t value) {
+  struct timespec timeout = {0, RING_WAIT_NS};
+  syscall(SYS_futex, word, FUTEX_WAIT_PRIVATE, value, &timeout, NULL, 0);
+}
+
+static void ring_futex_wake(uint32_t* word) {
+  syscall(SYS_futex, word, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+// Запись - длина, тип, метка времени постановки в кольцо (0 без --latency)
+// и байты кадра или указатель на буфер пула.
+// Записи не переходят через конец кольца: если до конца места мало, там
+// ставится метка и запись начинается с начала кольца.
+static uint8_t* ring_reserve(struct ring_t* ring, size_t* record) {
+  uint64_t tail = ring->tail;
+  size_t offset = tail & (ring->size - 1);
+  size_t skip = (offset + *record > ring->size) ? ring->size - offset : 0;
+
+  bool fits = *record <= ring->size / 4;
+  if (fits && (tail + skip + *record - ring->head_cache > ring->size)) {
+    ring->head_cache = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+    fits = tail + skip + *record - ring->head_cache <= ring->size;
+  }
+  if (!fits) {
+    __atomic_store_n(&ring->dropped, ring->dropped + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  if (skip) {
+    *(uint32_t*)(ring->bytes + offset) = RING_WRAP;
+    *record += skip;
+    offset = 0;
+  }
+
+  return ring->bytes + offset;
+}
+
+static void ring_entry(uint8_t* entry, uint32_t size, uint32_t type) {
+  uint64_t stamp = latency_stamp();
+  ((uint32_t*)entry)[0] = size;
+  ((uint32_t*)entry)[1] = type;
+  memcpy(entry + sizeof(uint64_t), &stamp, sizeof(stamp));
+}
+
+static void ring_commit(struct ring_t* ring, size_t record) {
+  __atomic_store_n(&ring->tail, ring->tail + record, __ATOMIC_RELEASE);
+  __atomic_store_n(&ring->pushed, ring->pushed + 1, __ATOMIC_RELAXED);
+}
+
+bool ring_push(struct ring_t* ring, const uint8_t* bytes, size_t size) {
+  size_t record = ring_record(size);
+  uint8_t* entry = ring_reserve(ring, &record);
+  if (!entry) {
+    return false;
+  }
+
+  ring_entry(entry, size, RING_INLINE);
+  memcpy(entry + RING_RECORD, bytes, size);
+  ring_commit(ring, record);
+
+  return true;
+}
+
+// В кольцо кладется только указатель, ссылку на буфер забирает читатель.
+// Если места нет, ссылка остается у писателя.
+bool ring_push_buffer(struct ring_t* ring, struct pool_buffer_t* buffer) {
+  size_t record = ring_record(sizeof(buffer));
+  uint8_t* entry = ring_reserve(ring, &record);
+  if (!entry) {
+    return false;
+  }
+
+  ring_entry(entry, sizeof(buffer), RING_BUFFER);
+  memcpy(entry + RING_RECORD, &buffer, sizeof(buffer));
+  ring_commit(ring, record);
+
+  return true;
+}
+
+// Писатель будит читателя один раз после пачки кадров. Барьер парный
+// барьеру в ring_reader_wait: либо читатель увидит новые кадры, либо
+// писатель увидит, что читатель заснул.
+void ring_notify(struct ring_t* ring) {
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(ring->waiting, __ATOMIC_RELAXED) &&
+      __atomic_exchange_n(ring->waiting, 0, __ATOMIC_RELAXED)) {
+    ring_futex_wake(ring->waiting);
+  }
+}
+
+uint64_t ring_depth(const struct ring_t* ring) {
+  return __atomic_load_n(&ring->pushed, __ATOMIC_RELAXED) -
+         __atomic_load_n(&ring->popped, __ATOMIC_RELAXED);
+}
+
+// Место записи освобождается сразу после обработки кадра, чтобы писатель
+// не отбрасывал кадры, пока читатель разбирает пачку.
+static unsigned int ring_drain(struct ring_reader_t* reader,
+                               struct ring_t* ring) {
+  uint64_t depth = ring_depth(ring);
+  if (depth > ring->peak) {
+    __atomic_store_n(&ring->peak, depth, __ATOMIC_RELAXED);
+  }
+
+  uint64_t head = ring->head;
+  unsigned int count = 0;
+  while (count < reader->batch) {
+    if (head == ring->tail_cache) {
+      ring->tail_cache = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+      if (head == ring->tail_cache) {
+        break;
+      }
+    }
+
+    size_t offset = head & (ring->size - 1);
+    const uint32_t* entry = (const uint32_t*)(ring->bytes + offset);
+    uint32_t size = entry[0];
+    if (size == RING_WRAP) {
+      head += ring->size - offset;
+      continue;
+    }
+
+    if (reader->queue) {
+      uint64_t stamp;
+      memcpy(&stamp, entry + 2, sizeof(stamp));
+      latency_record(reader->queue, stamp);
+    }
+
+    const uint8_t* bytes = ring->bytes + offset + RING_RECORD;
+    if (entry[1] == RING_BUFFER) {
+      struct pool_buffer_t* buffer;
+      memcpy(&buffer, bytes, sizeof(buffer));
+      reader->handler(reader->user, buffer->bytes, buffer->size);
+      pool_put(&reader->cache, buffer);
+    } else {
+      reader->handler(reader->user, bytes, size);
+    }
+    head += ring_record(size);
+    count++;
+    __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+  }
+  __atomic_store_n(&ring->head, head, __ATOMIC_RELEASE);
+
+  if (count) {
+    __atomic_store_n(&ring->popped, ring->popped + count, __ATOMIC_RELAXED);
+  }
+
+  return count;
+}
+
+static bool ring_reader_ready(struct ring_reader_t* reader) {
+  for (unsigned int i = 0; i < reader->count; i++) {
+    struct ring_t* ring = &reader->rings[i];
+    if (__atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE) != ring->head) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static void ring_reader_wait(struct ring_reader_t* reader) {
+  __atomic_store_n(&reader->waiting, 1, __ATOMIC_SEQ_CST);
+  if (!ring_reader_ready(reader) &&
+      !__atomic_load_n(&reader->terminated, __ATOMIC_RELAXED)) {
+    ring_futex_wait(&reader->waiting, 1);
+  }
+  __atomic_store_n(&reader->waiting, 0, __ATOMIC_RELAXED);
+}
+
+static void* ring_reader_thread(void* thread_data) {
+  struct ring_reader_t* reader = thread_data;
+
+  while (!__atomic_load_n(&reader->terminated, __ATOMIC_RELAXED)) {
+    unsigned int count = 0;
+    for (unsigned int i = 0; i < reader->count; i++) {
+      count += ring_drain(reader, &reader->rings[i]);
+    }
+
+    if (!count) {
+      ring_reader_wait(reader);
+    } else if (reader->flush) {
+      reader->flush(reader->user);
+    }
+  }
+
+  return NULL;
+}
+
+void ring_reader_init(struct ring_reader_t* reader) {
+  reader->name[0] = 0;
+  reader->rings = NULL;
+  reader->count = 0;
+  reader->batch = RING_BATCH;
+  reader->handler = NULL;
+  reader->flush = NULL;
+  reader->user = NULL;
+  reader->queue = NULL;
+  reader->waiting = 0;
+  reader->terminated = false;
+  reader->thread = 0;
+  pool_cache_init(&reader->cache, NULL);
+}
+
+static void ring_reader_source(void* user, FILE* out) {
+  ring_reader_report(user, out);
+}
+
+// name - имя ступени, которая разбирает кольца. size - размер каждого кольца
+// в байтах, округляется вверх до степени двойки.
+int ring_reader_open(struct ring_reader_t* reader,
+                     const char* name,
+                     unsigned int count,
+                     size_t size,
+                     ring_handler_t handler,
+                     ring_flush_t flush,
+                     void* user,
+                     struct pool_t* pool) {
+  size_t ring_size = RING_MIN_SIZE;
+  while (ring_size < size) {
+    ring_size <<= 1;
+  }
+
+  reader->rings =
+      aligned_alloc(RING_CACHE_LINE, count * sizeof(*reader->rings));
+  if (!reader->rings) {
+    fprintf(stderr, "ERROR> %s malloc\n", __FUNCTION__);
+    return -1;
+  }
+  memset(reader->rings, 0, count * sizeof(*reader->rings));
+  snprintf(reader->name, sizeof(reader->name), "%s", name);
+  reader->count = count;
+  reader->handler = handler;
+  reader->flush = flush;
+  reader->user = user;
+  pool_cache_init(&reader->cache, pool);
+
+  char queue[STATS_NAME_SIZE];
+  snprintf(queue, sizeof(queue), "%.32s.queue", name);
+  reader->queue = latency_hist(queue);
+
+  for (unsigned int i = 0; i < count; i++) {
+    struct ring_t* ring = &reader->rings[i];
+    ring->bytes = aligned_alloc(RING_CACHE_LINE, ring_size);
+    if (!ring->bytes) {
+      fprintf(stderr, "ERROR> %s malloc ring %zu bytes\n", __FUNCTION__,
+              ring_size);
+      ring_reader_close(reader);
+      return -1;
+    }
+    ring->size = ring_size;
+    ring->waiting = &reader->waiting;
+  }
+
+  stats_source(ring_reader_source, reader);
+  return 0;
+}
+
+int ring_reader_run(struct ring_reader_t* reader) {
+  reader->terminated = false;
+  if (pthread_create(&reader->thread, NULL, ring_reader_thread, reader) != 0) {
+    fprintf(stderr, "ERROR> %s pthread_create\n", __FUNCTION__);
+    reader->thread = 0;
+    return -1;
+  }
+  cpu_place_thread(reader->thread, reader->name);
+
+  return 0;
+}
+
+void ring_reader_stop(struct ring_reader_t* reader) {
+  if (!reader->thread) {
+    return;
+  }
+
+  __atomic_store_n(&reader->terminated, true, __ATOMIC_RELAXED);
+  __atomic_store_n(&reader->waiting, 0, __ATOMIC_SEQ_CST);
+  ring_futex_wake(&reader->waiting);
+  pthread_join(reader->thread, NULL);
+  reader->thread = 0;
+}
+
+// Буферы пула из неразобранных записей не возвращаются: кольца
+// закрываются вместе с пулом.
+void ring_reader_close(struct ring_reader_t* reader) {
+  ring_reader_stop(reader);
+  pool_cache_flush(&reader->cache);
+  for (unsigned int i = 0; reader->rings && (i < reader->count); i++) {
+    free(reader->rings[i].bytes);
+  }
+  free(reader->rings);
+  reader->rings = NULL;
+  reader->count = 0;
+}
+
+// Счетчики колец читателя: сколько кадров прошло, сколько отброшено из-за
+// переполнения, текущая и наибольшая замеченная очередь.
+void ring_reader_report(const struct ring_reader_t* reader, FILE* out) {
+  uint64_t pushed = 0;
+  uint64_t dropped = 0;
+  uint64_t depth = 0;
+  uint64_t peak = 0;
+  for (unsigned int i = 0; i < reader->count; i++) {
+    const struct ring_t* ring = &reader->rings[i];
+    pushed += __atomic_load_n(&ring->pushed, __ATOMIC_RELAXED);
+    dropped += __atomic_load_n(&ring->dropped, __ATOMIC_RELAXED);
+    depth += ring_depth(ring);
+    uint64_t ring_peak = __atomic_load_n(&ring->peak, __ATOMIC_RELAXED);
+    if (ring_peak > peak) {
+      peak = ring_peak;
+    }
+  }
+
+  fprintf(out,
+          "%s.ring frames %" PRIu64 " dropped %" PRIu64 " depth %" PRIu64
+          " peak %" PRIu64 "\n",
+          reader->name, pushed, dropped, depth, peak);
+}
@@ -0,0 +1,84 @@
+#ifndef BRIDGE_RING_H
+#define BRIDGE_RING_H
+
+#include "latency.h"
+#include "pool.h"
+#include "stats.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define RING_CACHE_LINE 64
+#define RING_SIZE (1 << 20)
+#define RING_MIN_SIZE (256 << 10)
+#define RING_BATCH 64
+
+typedef void (*ring_handler_t)(void* user, const uint8_t* bytes, size_t size);
+typedef int (*ring_flush_t)(void* user);
+
+// Кольцо с одним писателем и одним читателем без блокировок. Кадры лежат в
+// кольце подряд записями переменной длины: байты кадра или указатель на
+// буфер пула с кадром. Поля писателя и читателя на разных кеш линиях,
+// каждый держит копию чужой позиции и перечитывает ее только когда по копии
+// места или кадров нет. Если места нет, кадр отбрасывается и считается,
+// писатель не ждет.
+struct ring_t {
+  uint64_t tail __attribute__((aligned(RING_CACHE_LINE)));
+  uint64_t head_cache;
+  uint64_t pushed;
+  uint64_t dropped;
+
+  uint64_t head __attribute__((aligned(RING_CACHE_LINE)));
+  uint64_t tail_cache;
+  uint64_t popped;
+  uint64_t peak;
+
+  uint8_t* bytes __attribute__((aligned(RING_CACHE_LINE)));
+  size_t size;
+  uint32_t* waiting;
+};
+
+// Поток читателя одного или нескольких колец (по кольцу на писателя):
+// кадры разбираются пачками по batch с каждого кольца, после прохода по
+// кольцам вызывается flush. Пустые кольца читатель ждет на futex. Буферы
+// пула после обработки возвращаются в кеш читателя. queue - сколько кадры
+// ждали в кольцах.
+struct ring_reader_t {
+  char name[STATS_NAME_SIZE];
+  struct ring_t* rings;
+  unsigned int count;
+  unsigned int batch;
+  ring_handler_t handler;
+  ring_flush_t flush;
+  void* user;
+  struct pool_cache_t cache;
+  struct latency_hist_t* queue;
+  uint32_t waiting __attribute__((aligned(RING_CACHE_LINE)));
+  bool terminated;
+  pthread_t thread;
+};
+
+bool ring_push(struct ring_t* ring, const uint8_t* bytes, size_t size);
+bool ring_push_buffer(struct ring_t* ring, struct pool_buffer_t* buffer);
+void ring_notify(struct ring_t* ring);
+uint64_t ring_depth(const struct ring_t* ring);
+
+void ring_reader_init(struct ring_reader_t* reader);
+int ring_reader_open(struct ring_reader_t* reader,
+                     const char* name,
+                     unsigned int count,
+                     size_t size,
+                     ring_handler_t handler,
+                     ring_flush_t flush,
+                     void* user,
+                     struct pool_t* pool);
+int ring_reader_run(struct ring_reader_t* reader);
+void ring_reader_stop(struct ring_reader_t* reader);
+void ring_reader_close(struct ring_reader_t* reader);
+void ring_reader_report(const struct ring_reader_t* reader, FILE* out);
+
+#endif  // BRIDGE_RING_H
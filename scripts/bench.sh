@@ -0,0 +1,112 @@
+#!/bin/sh
+# Замер моста в одноразовых network namespace.
+#
+#   scripts/bench.sh local|remote [опции bridge_l2]
+#   scripts/bench.sh loop [--engine=threads|pipeline]
+#
+# local:  bl2gen(gen0) <-> bl2br(br0) bridge_l2 bl2br(br1) <-> bl2gen(gen1)
+# remote: bl2gen(gen0) <-> bl2cli(br0) bridge_l2 client == udp ==
+#         bl2srv(tap0) bridge_l2 server
+# loop:   мост в процессе bridge_l2_bench на проводах loop, без namespace
+#         и системных вызовов: замер пересылки и FDB
+#
+# В remote кадры гоняются в обе стороны: gen0 -> tap0 (up) и tap0 -> gen0
+# (down). На каждый размер кадра и количество потоков bridge_l2_bench
+# печатает строку JSON.
+#
+# Переменные: BUILD (каталог сборки), SIZES, FLOWS, DURATION, RATE,
+# BACKEND (по умолчанию afpacket).
+
+set -u
+
+MODE=${1:-local}
+[ $# -gt 0 ] && shift
+BUILD=${BUILD:-build}
+BRIDGE=${BRIDGE:-$BUILD/bridge_l2}
+BENCH=${BENCH:-$BUILD/bridge_l2_bench}
+SIZES=${SIZES:-"64 128 512 1024 1518 4096 9000"}
+FLOWS=${FLOWS:-"1 64"}
+DURATION=${DURATION:-5}
+RATE=${RATE:-0}
+BACKEND=${BACKEND:-afpacket}
+MTU=9500
+PORT=8214
+
+cleanup() {
+  [ -n "${BRIDGE_PIDS:-}" ] && kill -INT $BRIDGE_PIDS 2>/dev/null
+  sleep 1
+  [ -n "${BRIDGE_PIDS:-}" ] && kill -9 $BRIDGE_PIDS 2>/dev/null
+  for ns in bl2gen bl2br bl2cli bl2srv; do
+    ip netns del $ns 2>/dev/null
+  done
+}
+
+# veth_pair <ns1> <if1> <ns2> <if2>
+veth_pair() {
+  ip link add $2 netns $1 type veth peer name $4 netns $3
+  ip -n $1 link set $2 mtu $MTU up
+  ip -n $3 link set $4 mtu $MTU up
+}
+
+run_bench() {
+  label=$1
+  shift
+  for size in $SIZES; do
+    for flows in $FLOWS; do
+      ip netns exec bl2gen $BENCH --label=$label --size=$size \
+          --flows=$flows --duration=$DURATION --rate=$RATE "$@"
+    done
+  done
+}
+
+if [ "$MODE" = loop ]; then
+  for size in $SIZES; do
+    for flows in $FLOWS; do
+      $BENCH --loop --label=loop --size=$size --flows=$flows \
+          --duration=$DURATION --rate=$RATE "$@" loop0 loop1
+    done
+  done
+  exit 0
+fi
+
+trap cleanup EXIT INT TERM
+cleanup
+BRIDGE_PIDS=""
+
+ip netns add bl2gen
+ip -n bl2gen link set lo up
+
+case $MODE in
+  local)
+    ip netns add bl2br
+    veth_pair bl2gen gen0 bl2br br0
+    veth_pair bl2gen gen1 bl2br br1
+    ip netns exec bl2br $BRIDGE --backend=$BACKEND "$@" br0 br1 \
+        >&2 &
+    BRIDGE_PIDS=$!
+    sleep 1
+    run_bench local gen0 gen1
+    ;;
+  remote)
+    ip netns add bl2cli
+    ip netns add bl2srv
+    veth_pair bl2gen gen0 bl2cli br0
+    veth_pair bl2cli tun0 bl2srv tun1
+    ip -n bl2cli addr add 10.201.0.1/24 dev tun0
+    ip -n bl2srv addr add 10.201.0.2/24 dev tun1
+    ip netns exec bl2srv $BRIDGE "$@" server tap0 10.201.0.2 $PORT >&2 &
+    BRIDGE_PIDS=$!
+    sleep 1
+    ip -n bl2srv link set tap0 mtu $MTU up
+    ip netns exec bl2cli $BRIDGE --backend=$BACKEND "$@" client br0 \
+        10.201.0.2 $PORT >&2 &
+    BRIDGE_PIDS="$BRIDGE_PIDS $!"
+    sleep 1
+    run_bench remote-up --rx-netns=bl2srv gen0 tap0
+    run_bench remote-down --tx-netns=bl2srv tap0 gen0
+    ;;
+  *)
+    echo "Usage: $0 local|remote|loop [bridge_l2 options]" >&2
+    exit 1
+    ;;
+esac
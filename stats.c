@@ -0,0 +1,207 @@
+#include "stats.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+struct stats_source_entry_t {
+  stats_source_t source;
+  void* user;
+};
+
+// Счетчики только добавляются и живут до конца процесса, поэтому указатели
+// на них можно держать без блокировок. Регистрация идет при открытии мостов,
+// под мьютексом.
+static struct stats_counter_t stats_counters[STATS_MAX_COUNTERS];
+static char stats_names[STATS_MAX_COUNTERS][STATS_NAME_SIZE];
+static unsigned int stats_counter_count = 0;
+static struct stats_counter_t stats_spare;
+static struct stats_source_entry_t stats_sources[STATS_MAX_SOURCES];
+static unsigned int stats_source_count = 0;
+static pthread_mutex_t stats_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static int stats_fd = -1;
+static char stats_path[sizeof(((struct sockaddr_un*)0)->sun_path)];
+static pthread_t stats_thread = 0;
+static bool stats_terminated = false;
+
+// Если счетчики кончились, ступень пишет в общий запасной счетчик, который
+// не выводится.
+struct stats_counter_t* stats_counter(const char* name) {
+  struct stats_counter_t* counter = &stats_spare;
+
+  pthread_mutex_lock(&stats_lock);
+  if (stats_counter_count < STATS_MAX_COUNTERS) {
+    unsigned int index = stats_counter_count;
+    snprintf(stats_names[index], STATS_NAME_SIZE, "%s", name);
+    counter = &stats_counters[index];
+    __atomic_store_n(&stats_counter_count, index + 1, __ATOMIC_RELEASE);
+  } else {
+    fprintf(stderr, "WARNING> %s too many counters, %s not shown\n",
+            __FUNCTION__, name);
+  }
+  pthread_mutex_unlock(&stats_lock);
+
+  return counter;
+}
+
+const char* stats_name(const struct stats_counter_t* counter) {
+  if (counter == &stats_spare) {
+    return "spare";
+  }
+  return stats_names[counter - stats_counters];
+}
+
+void stats_tunnel_init(struct stats_tunnel_t* stats,
+                       const char* prefix,
+                       const char* local) {
+  char name[STATS_NAME_SIZE];
+
+  snprintf(name, sizeof(name), "%s%s.rx", prefix, local);
+  stats->local_rx = stats_counter(name);
+  snprintf(name, sizeof(name), "%stunnel.tx", prefix);
+  stats->tunnel_tx = stats_counter(name);
+  snprintf(name, sizeof(name), "%stunnel.rx", prefix);
+  stats->tunnel_rx = stats_counter(name);
+  snprintf(name, sizeof(name), "%s%s.tx", prefix, local);
+  stats->local_tx = stats_counter(name);
+}
+
+// 0 - строку печатать рано, иначе сколько раз ошибка случилась с прошлой
+// строки.
+uint64_t stats_limit(struct stats_limit_t* limit) {
+  __atomic_add_fetch(&limit->count, 1, __ATOMIC_RELAXED);
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  uint32_t now = ts.tv_sec;
+  uint32_t logged = __atomic_load_n(&limit->logged, __ATOMIC_RELAXED);
+  if ((logged == now) ||
+      !__atomic_compare_exchange_n(&limit->logged, &logged, now, false,
+                                   __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+    return 0;
+  }
+
+  return __atomic_exchange_n(&limit->count, 0, __ATOMIC_RELAXED);
+}
+
+void stats_source(stats_source_t source, void* user) {
+  pthread_mutex_lock(&stats_lock);
+  if (stats_source_count < STATS_MAX_SOURCES) {
+    stats_sources[stats_source_count].source = source;
+    stats_sources[stats_source_count].user = user;
+    stats_source_count++;
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// Строка на счетчик: имя и значения, затем строки источников.
+void stats_dump(FILE* out) {
+  unsigned int count =
+      __atomic_load_n(&stats_counter_count, __ATOMIC_ACQUIRE);
+  for (unsigned int i = 0; i < count; i++) {
+    const struct stats_counter_t* counter = &stats_counters[i];
+    fprintf(out,
+            "%s packets %" PRIu64 " bytes %" PRIu64 " errors %" PRIu64
+            " drops %" PRIu64 "\n",
+            stats_names[i],
+            __atomic_load_n(&counter->packets, __ATOMIC_RELAXED),
+            __atomic_load_n(&counter->bytes, __ATOMIC_RELAXED),
+            __atomic_load_n(&counter->errors, __ATOMIC_RELAXED),
+            __atomic_load_n(&counter->drops, __ATOMIC_RELAXED));
+  }
+
+  pthread_mutex_lock(&stats_lock);
+  for (unsigned int i = 0; i < stats_source_count; i++) {
+    stats_sources[i].source(stats_sources[i].user, out);
+  }
+  pthread_mutex_unlock(&stats_lock);
+}
+
+// На каждое подключение отдается снимок счетчиков и соединение закрывается:
+// socat - UNIX-CONNECT:<path>.
+static void* stats_serve(void* thread_data) {
+  while (!stats_terminated) {
+    int fd = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC);
+    if (fd == -1) {
+      if ((errno == EINTR) || (errno == ECONNABORTED)) {
+        continue;
+      }
+      break;
+    }
+
+    FILE* out = fdopen(fd, "w");
+    if (!out) {
+      close(fd);
+      continue;
+    }
+    stats_dump(out);
+    fclose(out);
+  }
+
+  return NULL;
+}
+
+int stats_open(const char* path) {
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "ERROR> %s path too long %s\n", __FUNCTION__, path);
+    return -1;
+  }
+  strcpy(addr.sun_path, path);
+
+  stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (stats_fd == -1) {
+    fprintf(stderr, "ERROR> %s socket\n", __FUNCTION__);
+    return -1;
+  }
+
+  unlink(path);
+  if ((bind(stats_fd, (struct sockaddr*)&addr, sizeof(addr)) == -1) ||
+      (listen(stats_fd, 8) == -1)) {
+    fprintf(stderr, "ERROR> %s bind %s: %s\n", __FUNCTION__, path,
+            strerror(errno));
+    goto aborting;
+  }
+  strcpy(stats_path, path);
+
+  stats_terminated = false;
+  if (pthread_create(&stats_thread, NULL, stats_serve, NULL) != 0) {
+    fprintf(stderr, "ERROR> %s pthread_create\n", __FUNCTION__);
+    stats_thread = 0;
+    unlink(stats_path);
+    goto aborting;
+  }
+
+  return 0;
+
+aborting:
+  close(stats_fd);
+  stats_fd = -1;
+  return -1;
+}
+
+// Закрывается до остановки мостов: источники ссылаются на их интерфейсы и
+// кольца.
+void stats_close(void) {
+  if (stats_fd == -1) {
+    return;
+  }
+
+  stats_terminated = true;
+  shutdown(stats_fd, SHUT_RDWR);
+  if (stats_thread) {
+    pthread_join(stats_thread, NULL);
+    stats_thread = 0;
+  }
+  close(stats_fd);
+  stats_fd = -1;
+  unlink(stats_path);
+}
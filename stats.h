@@ -0,0 +1,78 @@
+#ifndef BRIDGE_STATS_H
+#define BRIDGE_STATS_H
+
+#include <inttypes.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define STATS_CACHE_LINE 64
+#define STATS_MAX_COUNTERS 512
+#define STATS_MAX_SOURCES 128
+#define STATS_NAME_SIZE 48
+
+// Счетчики одной ступени (чтение интерфейса, отправка в туннель, ...).
+// У ступени один пишущий поток, поэтому счетчики меняются без атомарных
+// сложений, а читаются из потока статистики. Каждая ступень на своей кеш
+// линии.
+struct stats_counter_t {
+  uint64_t packets;
+  uint64_t bytes;
+  uint64_t errors;
+  uint64_t drops;
+} __attribute__((aligned(STATS_CACHE_LINE)));
+
+// Счетчики канала туннеля: кадры из интерфейса или tap, датаграммы в
+// туннель и из туннеля, кадры в интерфейс или tap.
+struct stats_tunnel_t {
+  struct stats_counter_t* local_rx;
+  struct stats_counter_t* tunnel_tx;
+  struct stats_counter_t* tunnel_rx;
+  struct stats_counter_t* local_tx;
+};
+
+// Источник строк статистики, которые не лежат в счетчиках: счетчики ядра,
+// очереди колец.
+typedef void (*stats_source_t)(void* user, FILE* out);
+
+// Ошибка на пути кадров печатается не чаще раза в секунду, а все случаи
+// видны в счетчиках. Один ограничитель на место в коде, его меняют любые
+// потоки.
+struct stats_limit_t {
+  uint32_t logged;
+  uint64_t count;
+};
+
+struct stats_counter_t* stats_counter(const char* name);
+const char* stats_name(const struct stats_counter_t* counter);
+void stats_tunnel_init(struct stats_tunnel_t* stats,
+                       const char* prefix,
+                       const char* local);
+void stats_source(stats_source_t source, void* user);
+uint64_t stats_limit(struct stats_limit_t* limit);
+
+int stats_open(const char* path);
+void stats_close(void);
+void stats_dump(FILE* out);
+
+static inline void stats_add_n(struct stats_counter_t* counter,
+                               unsigned int packets,
+                               size_t bytes) {
+  __atomic_store_n(&counter->packets, counter->packets + packets,
+                   __ATOMIC_RELAXED);
+  __atomic_store_n(&counter->bytes, counter->bytes + bytes, __ATOMIC_RELAXED);
+}
+
+static inline void stats_add(struct stats_counter_t* counter, size_t bytes) {
+  stats_add_n(counter, 1, bytes);
+}
+
+static inline void stats_error(struct stats_counter_t* counter) {
+  __atomic_store_n(&counter->errors, counter->errors + 1, __ATOMIC_RELAXED);
+}
+
+static inline void stats_drop(struct stats_counter_t* counter) {
+  __atomic_store_n(&counter->drops, counter->drops + 1, __ATOMIC_RELAXED);
+}
+
+#endif  // BRIDGE_STATS_H
@@ -0,0 +1,155 @@
+#include "tap.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <linux/if_ether.h>
+#include <linux/if_tun.h>
+#include <net/if.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <unistd.h>
+
+#ifndef TUN_F_USO4
+#define TUN_F_USO4 0x20
+#endif
+#ifndef TUN_F_USO6
+#define TUN_F_USO6 0x40
+#endif
+
+void tap_init(struct tap_t* tap) {
+  tap->fd = -1;
+  tap->buffer = NULL;
+}
+
+// Ядро отдает в tap большие GSO кадры без подсчета контрольных сумм и
+// принимает такие же. Если ядро не знает USO, включаются только TSO.
+static void tap_offload(int fd) {
+  unsigned int tso = TUN_F_CSUM | TUN_F_TSO4 | TUN_F_TSO6;
+  if ((ioctl(fd, TUNSETOFFLOAD, tso | TUN_F_USO4 | TUN_F_USO6) == -1) &&
+      (ioctl(fd, TUNSETOFFLOAD, tso) == -1)) {
+    fprintf(stderr, "WARNING> %s TUNSETOFFLOAD unsupported\n", __FUNCTION__);
+  }
+}
+
+// fd открывается неблокирующим: ожидание кадров идет через poll.
+// Фильтр проверяет кадры, которые ядро отдает в tap, на всех очередях
+// устройства. Он ставится сразу после подключения очереди, а кадры,
+// попавшие в очередь до него, выбрасываются непрочитанными.
+static int tap_attach_filter(struct tap_t* tap,
+                             const struct sock_fprog* prog) {
+  if (!prog) {
+    return 0;
+  }
+  if (ioctl(tap->fd, TUNATTACHFILTER, prog) == -1) {
+    fprintf(stderr, "ERROR> %s TUNATTACHFILTER\n", __FUNCTION__);
+    return -1;
+  }
+
+  uint8_t frame[ETH_FRAME_LEN];
+  while (read(tap->fd, frame, sizeof(frame)) > 0) {
+  }
+  return 0;
+}
+
+int tap_open(struct tap_t* tap,
+             const char* ifname,
+             bool multi_queue,
+             bool vnet_hdr,
+             const struct sock_fprog* filter) {
+  tap->fd = open("/dev/net/tun", O_RDWR | O_NONBLOCK);
+  if (tap->fd == -1) {
+    fprintf(stderr, "ERROR> %s open", __FUNCTION__);
+    return -1;
+  }
+
+  struct ifreq ifr = {0};
+  ifr.ifr_flags = IFF_TAP | IFF_NO_PI;
+  if (multi_queue) {
+    ifr.ifr_flags |= IFF_MULTI_QUEUE;
+  }
+  if (vnet_hdr) {
+    ifr.ifr_flags |= IFF_VNET_HDR;
+  }
+  strncpy(ifr.ifr_name, ifname, IFNAMSIZ);
+  if (ioctl(tap->fd, TUNSETIFF, &ifr) == -1) {
+    fprintf(stderr, "ERROR> %s ioctl", __FUNCTION__);
+    goto aborting;
+  }
+  if (tap_attach_filter(tap, filter) == -1) {
+    goto aborting;
+  }
+
+  if (vnet_hdr) {
+    tap_offload(tap->fd);
+  }
+
+  return 0;
+
+aborting:
+  tap_close(tap);
+  return -1;
+}
+
+void tap_close(struct tap_t* tap) {
+  if (tap->fd != -1) {
+    close(tap->fd);
+  }
+  free(tap->buffer);
+  tap_init(tap);
+}
+
+// Кадры вычитываются, пока они есть, но не больше count. Если кадров нет,
+// ждет первый не дольше timeout миллисекунд.
+int tap_dispatch(struct tap_t* tap,
+                 int count,
+                 int timeout,
+                 tap_handler_t handler,
+                 void* user) {
+  if ((tap->fd == -1) || !handler) {
+    return -1;
+  }
+  if (!tap->buffer) {
+    tap->buffer = malloc(TAP_BUFFER_SIZE);
+    if (!tap->buffer) {
+      fprintf(stderr, "ERROR> %s malloc\n", __FUNCTION__);
+      return -1;
+    }
+  }
+
+  int processed = 0;
+  while (processed < count) {
+    ssize_t size = read(tap->fd, tap->buffer, TAP_BUFFER_SIZE);
+    if (size > 0) {
+      handler(user, tap->buffer, size);
+      processed++;
+      continue;
+    }
+    if ((size == -1) && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      return (errno == EINTR) ? processed : -1;
+    }
+    if (processed || !timeout) {
+      break;
+    }
+
+    struct pollfd pfd = {tap->fd, POLLIN, 0};
+    int res = poll(&pfd, 1, timeout);
+    if (res <= 0) {
+      return ((res == -1) && (errno != EINTR)) ? -1 : 0;
+    }
+    timeout = 0;
+  }
+
+  return processed;
+}
+
+int tap_write(struct tap_t* tap, const uint8_t* bytes, size_t size) {
+  if (write(tap->fd, bytes, size) != (ssize_t)size) {
+    return -1;
+  }
+
+  return 0;
+}
+
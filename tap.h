@@ -0,0 +1,38 @@
+#ifndef BRIDGE_TAP_H
+#define BRIDGE_TAP_H
+
+#include <inttypes.h>
+#include <linux/filter.h>
+#include <linux/virtio_net.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// virtio_net_hdr, заголовок Ethernet и 64К данных (TSO).
+#define TAP_BUFFER_SIZE (sizeof(struct virtio_net_hdr) + 14 + 0xffff)
+
+typedef void (*tap_handler_t)(void* user, const uint8_t* bytes, size_t size);
+
+// Очередь tap устройства (/dev/net/tun). С multi_queue каждое открытие
+// того же имени добавляет очередь, с vnet_hdr перед кадром идет
+// virtio_net_hdr и включается offload.
+struct tap_t {
+  int fd;
+  uint8_t* buffer;
+};
+
+void tap_init(struct tap_t* tap);
+int tap_open(struct tap_t* tap,
+             const char* ifname,
+             bool multi_queue,
+             bool vnet_hdr,
+             const struct sock_fprog* filter);
+void tap_close(struct tap_t* tap);
+int tap_dispatch(struct tap_t* tap,
+                 int count,
+                 int timeout,
+                 tap_handler_t handler,
+                 void* user);
+int tap_write(struct tap_t* tap, const uint8_t* bytes, size_t size);
+
+#endif  // BRIDGE_TAP_H
@@ -0,0 +1,377 @@
+#include "tunnel.h"
+
+#include <arpa/inet.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+void tunnel_header_init(struct tunnel_header_t* header, uint8_t flags) {
+  header->version = TUNNEL_VERSION;
+  header->type = TUNNEL_FRAMES | flags;
+  header->count = 0;
+}
+
+// used == 0 - буфер пуст, в него сначала пишется заголовок. Возвращает новый
+// размер датаграммы.
+size_t tunnel_append(uint8_t* buffer,
+                     size_t used,
+                     uint8_t flags,
+                     const uint8_t* bytes,
+                     size_t size) {
+  struct tunnel_header_t header;
+  if (used == 0) {
+    tunnel_header_init(&header, flags);
+    used = TUNNEL_HEADER_SIZE;
+  } else {
+    memcpy(&header, buffer, sizeof(header));
+  }
+  header.count = htons(ntohs(header.count) + 1);
+  memcpy(buffer, &header, sizeof(header));
+
+  uint16_t length = htons(size);
+  memcpy(buffer + used, &length, sizeof(length));
+  memcpy(buffer + used + sizeof(length), bytes, size);
+
+  return used + sizeof(length) + size;
+}
+
+unsigned int tunnel_count(const uint8_t* buffer) {
+  struct tunnel_header_t header;
+  memcpy(&header, buffer, sizeof(header));
+  return ntohs(header.count);
+}
+
+enum tunnel_type_t tunnel_type(const uint8_t* buffer) {
+  struct tunnel_header_t header;
+  memcpy(&header, buffer, sizeof(header));
+  return header.type & TUNNEL_TYPE_MASK;
+}
+
+// mtu == 0 - кадры не склеиваются, а режутся только если не влезают в
+// датаграмму UDP.
+// Датаграмма больше TUNNEL_MAX_DATAGRAM не уйдет, а длина кадра в ней
+// не влезла бы в TUNNEL_LENGTH_SIZE.
+static size_t tunnel_limit(size_t mtu) {
+  return (mtu && (mtu < TUNNEL_MAX_DATAGRAM)) ? mtu : TUNNEL_MAX_DATAGRAM;
+}
+
+bool tunnel_fragmented(size_t mtu, size_t size) {
+  return TUNNEL_OVERHEAD + size > tunnel_limit(mtu);
+}
+
+size_t tunnel_chunk(size_t mtu, size_t size) {
+  size_t limit = tunnel_limit(mtu);
+  size_t chunk = (limit > TUNNEL_FRAGMENT_OVERHEAD)
+                     ? limit - TUNNEL_FRAGMENT_OVERHEAD
+                     : 0;
+  if (chunk < TUNNEL_MIN_CHUNK) {
+    chunk = TUNNEL_MIN_CHUNK;
+  }
+  return (chunk < size) ? chunk : size;
+}
+
+unsigned int tunnel_fragments(size_t mtu, size_t size) {
+  if (!tunnel_fragmented(mtu, size)) {
+    return 1;
+  }
+
+  size_t chunk = tunnel_chunk(mtu, size);
+  return (size + chunk - 1) / chunk;
+}
+
+void tunnel_fragment_init(struct tunnel_header_t* header,
+                          struct tunnel_fragment_t* fragment,
+                          uint8_t flags,
+                          const uint8_t* bytes,
+                          size_t size,
+                          size_t chunk,
+                          uint32_t id,
+                          size_t offset) {
+  header->version = TUNNEL_VERSION;
+  header->type = TUNNEL_FRAGMENT | flags;
+  header->count = htons(1);
+
+  memset(fragment, 0, sizeof(*fragment));
+  fragment->chunk = htons(chunk);
+  size_t mac = (flags & TUNNEL_VNET) ? TUNNEL_VNET_SIZE : 0;
+  if (size >= mac + sizeof(fragment->macs)) {
+    memcpy(fragment->macs, bytes + mac, sizeof(fragment->macs));
+  }
+  fragment->id = htonl(id);
+  fragment->offset = htonl(offset);
+  fragment->length = htonl(size);
+}
+
+static uint64_t tunnel_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+int tunnel_reasm_init(struct tunnel_reasm_t* reasm,
+                      unsigned int count,
+                      unsigned int timeout,
+                      size_t memory) {
+  reasm->count = count;
+  reasm->timeout = timeout;
+  reasm->memory = memory;
+  reasm->used = 0;
+  reasm->slots = calloc(count, sizeof(*reasm->slots));
+  if (!reasm->slots) {
+    fprintf(stderr, "ERROR> %s malloc %u slots\n", __FUNCTION__, count);
+    return -1;
+  }
+
+  return 0;
+}
+
+void tunnel_reasm_free(struct tunnel_reasm_t* reasm) {
+  if (!reasm->slots) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < reasm->count; i++) {
+    free(reasm->slots[i].bytes);
+  }
+  free(reasm->slots);
+  reasm->slots = NULL;
+  reasm->used = 0;
+}
+
+static bool tunnel_slot_expired(const struct tunnel_reasm_t* reasm,
+                                const struct tunnel_slot_t* slot,
+                                uint64_t now) {
+  return now - slot->started_ns > reasm->timeout * 1000000ull;
+}
+
+static void tunnel_slot_release(struct tunnel_reasm_t* reasm,
+                                struct tunnel_slot_t* slot) {
+  reasm->used -= slot->capacity;
+  free(slot->bytes);
+  slot->bytes = NULL;
+  slot->capacity = 0;
+  slot->length = 0;
+}
+
+// Буфер слота переиспользуется, если его хватает. Иначе место под новый
+// буфер освобождается у свободных слотов, а затем у самых старых.
+static int tunnel_slot_reserve(struct tunnel_reasm_t* reasm,
+                               struct tunnel_slot_t* slot,
+                               size_t size) {
+  if (slot->capacity >= size) {
+    return 0;
+  }
+  tunnel_slot_release(reasm, slot);
+
+  while (reasm->used + size > reasm->memory) {
+    struct tunnel_slot_t* victim = NULL;
+    for (unsigned int i = 0; i < reasm->count; i++) {
+      struct tunnel_slot_t* other = &reasm->slots[i];
+      if ((other == slot) || !other->capacity) {
+        continue;
+      }
+      if (!other->length) {
+        victim = other;
+        break;
+      }
+      if (!victim || (other->started_ns < victim->started_ns)) {
+        victim = other;
+      }
+    }
+    if (!victim) {
+      return -1;
+    }
+    if (victim->length) {
+      fprintf(stderr, "ERROR> %s frame %u evicted, reassembly memory full\n",
+              __FUNCTION__, victim->id);
+    }
+    tunnel_slot_release(reasm, victim);
+  }
+
+  slot->bytes = malloc(size);
+  if (!slot->bytes) {
+    fprintf(stderr, "ERROR> %s malloc %zu\n", __FUNCTION__, size);
+    return -1;
+  }
+  slot->capacity = size;
+  reasm->used += size;
+
+  return 0;
+}
+
+static bool tunnel_source_equal(const struct sockaddr_in* a,
+                                const struct sockaddr_in* b) {
+  return (a->sin_port == b->sin_port) &&
+         (a->sin_addr.s_addr == b->sin_addr.s_addr);
+}
+
+static struct tunnel_slot_t* tunnel_slot_find(
+    struct tunnel_reasm_t* reasm,
+    const struct sockaddr_in* source,
+    const struct tunnel_fragment_t* fragment,
+    uint64_t now) {
+  uint32_t id = ntohl(fragment->id);
+  uint32_t length = ntohl(fragment->length);
+  uint32_t chunk = ntohs(fragment->chunk);
+  struct tunnel_slot_t* free_slot = NULL;
+  struct tunnel_slot_t* oldest = NULL;
+  for (unsigned int i = 0; i < reasm->count; i++) {
+    struct tunnel_slot_t* slot = &reasm->slots[i];
+    if (slot->length && (slot->id == id) &&
+        tunnel_source_equal(&slot->source, source)) {
+      if ((slot->length == length) && (slot->chunk == chunk) &&
+          !tunnel_slot_expired(reasm, slot, now)) {
+        return slot;
+      }
+      slot->length = 0;
+    }
+    if (slot->length && tunnel_slot_expired(reasm, slot, now)) {
+      fprintf(stderr, "ERROR> %s frame %u timed out\n", __FUNCTION__,
+              slot->id);
+      slot->length = 0;
+    }
+    if (!slot->length) {
+      // Из свободных предпочтительнее слот с уже выделенным буфером.
+      if (!free_slot || (!free_slot->capacity && slot->capacity)) {
+        free_slot = slot;
+      }
+    } else if (!oldest || (slot->started_ns < oldest->started_ns)) {
+      oldest = slot;
+    }
+  }
+
+  struct tunnel_slot_t* slot = free_slot;
+  if (!slot) {
+    fprintf(stderr, "ERROR> %s frame %u evicted, reassembly table full\n",
+            __FUNCTION__, oldest->id);
+    slot = oldest;
+  }
+  slot->length = 0;
+  if (tunnel_slot_reserve(reasm, slot, length) == -1) {
+    return NULL;
+  }
+
+  slot->source = *source;
+  slot->id = id;
+  slot->length = length;
+  slot->chunk = chunk;
+  unsigned int count = (length + chunk - 1) / chunk;
+  slot->missing = (count == 64) ? ~0ull : ((1ull << count) - 1);
+  slot->started_ns = now;
+
+  return slot;
+}
+
+static int tunnel_reassemble(struct tunnel_reasm_t* reasm,
+                             const struct sockaddr_in* source,
+                             const uint8_t* bytes,
+                             size_t size,
+                             tunnel_handler_t handler,
+                             void* user) {
+  struct tunnel_fragment_t fragment;
+  if (size < TUNNEL_FRAGMENT_OVERHEAD) {
+    goto malformed;
+  }
+  memcpy(&fragment, bytes + TUNNEL_HEADER_SIZE, sizeof(fragment));
+  bytes += TUNNEL_FRAGMENT_OVERHEAD;
+  size -= TUNNEL_FRAGMENT_OVERHEAD;
+
+  size_t chunk = ntohs(fragment.chunk);
+  size_t offset = ntohl(fragment.offset);
+  size_t length = ntohl(fragment.length);
+  if ((length > TUNNEL_MAX_FRAME_SIZE) || (chunk < TUNNEL_MIN_CHUNK) ||
+      (offset % chunk) || (offset >= length) || (offset + size > length) ||
+      ((size != chunk) && (offset + size != length))) {
+    goto malformed;
+  }
+  if (!reasm) {
+    fprintf(stderr, "ERROR> %s fragment without reassembly table\n",
+            __FUNCTION__);
+    return -1;
+  }
+
+  struct tunnel_slot_t* slot =
+      tunnel_slot_find(reasm, source, &fragment, tunnel_now());
+  if (!slot) {
+    return -1;
+  }
+
+  uint64_t bit = 1ull << (offset / chunk);
+  if (!(slot->missing & bit)) {
+    return 0;
+  }
+  memcpy(slot->bytes + offset, bytes, size);
+  slot->missing &= ~bit;
+  if (slot->missing) {
+    return 0;
+  }
+
+  slot->length = 0;
+  handler(user, slot->bytes, length);
+  return 1;
+
+malformed:
+  fprintf(stderr, "ERROR> %s malformed fragment\n", __FUNCTION__);
+  return -1;
+}
+
+// Фрагменты собираются в reasm по адресу source, собранный кадр передается в
+// handler как обычный. Возвращает количество переданных кадров.
+int tunnel_unpack(struct tunnel_reasm_t* reasm,
+                  const struct sockaddr_in* source,
+                  uint8_t flags,
+                  const uint8_t* bytes,
+                  size_t size,
+                  tunnel_handler_t handler,
+                  void* user) {
+  struct tunnel_header_t header;
+  if (size < TUNNEL_HEADER_SIZE) {
+    fprintf(stderr, "ERROR> %s short datagram %zu bytes\n", __FUNCTION__,
+            size);
+    return -1;
+  }
+  memcpy(&header, bytes, sizeof(header));
+  uint8_t type = header.type & TUNNEL_TYPE_MASK;
+  if ((header.version != TUNNEL_VERSION) ||
+      ((type != TUNNEL_FRAMES) && (type != TUNNEL_FRAGMENT))) {
+    fprintf(stderr, "ERROR> %s unsupported version %u type %u\n",
+            __FUNCTION__, header.version, header.type);
+    return -1;
+  }
+  // Кадры с virtio_net_hdr и без него не совместимы: режим у клиента и
+  // сервера должен совпадать.
+  if ((header.type & TUNNEL_VNET) != flags) {
+    fprintf(stderr, "ERROR> %s peer %s virtio_net_hdr\n", __FUNCTION__,
+            flags ? "without" : "with");
+    return -1;
+  }
+  if (type == TUNNEL_FRAGMENT) {
+    return tunnel_reassemble(reasm, source, bytes, size, handler, user);
+  }
+
+  const uint8_t* end = bytes + size;
+  bytes += TUNNEL_HEADER_SIZE;
+  unsigned int count = ntohs(header.count);
+  for (unsigned int i = 0; i < count; i++) {
+    uint16_t length = 0;
+    if (end - bytes < (ptrdiff_t)sizeof(length)) {
+      goto truncated;
+    }
+    memcpy(&length, bytes, sizeof(length));
+    length = ntohs(length);
+    bytes += sizeof(length);
+    if (end - bytes < length) {
+      goto truncated;
+    }
+
+    handler(user, bytes, length);
+    bytes += length;
+  }
+
+  return count;
+
+truncated:
+  fprintf(stderr, "ERROR> %s truncated datagram\n", __FUNCTION__);
+  return -1;
+}
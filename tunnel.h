@@ -0,0 +1,125 @@
+#ifndef BRIDGE_TUNNEL_H
+#define BRIDGE_TUNNEL_H
+
+#include <inttypes.h>
+#include <linux/virtio_net.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define TUNNEL_VERSION 1
+#define TUNNEL_MTU 1472
+// Наибольшая полезная нагрузка UDP поверх IPv4.
+#define TUNNEL_MAX_DATAGRAM 65507
+#define TUNNEL_MAX_FRAMES 32
+// Флаг в поле type: перед каждым кадром идет virtio_net_hdr (IFF_VNET_HDR).
+#define TUNNEL_VNET 0x80
+#define TUNNEL_TYPE_MASK 0x7f
+#define TUNNEL_VNET_SIZE sizeof(struct virtio_net_hdr)
+// Наибольший кадр: virtio_net_hdr, заголовок Ethernet и 64К данных (jumbo MTU
+// или TSO).
+#define TUNNEL_MAX_FRAME_SIZE (TUNNEL_VNET_SIZE + 14 + 0xffff)
+#define TUNNEL_MAX_FRAGMENTS 64
+#define TUNNEL_REASM_SLOTS 64
+#define TUNNEL_REASM_TIMEOUT 200
+#define TUNNEL_REASM_MEMORY (4 << 20)
+
+typedef void (*tunnel_handler_t)(void* user,
+                                 const uint8_t* bytes,
+                                 size_t size);
+
+enum tunnel_type_t {
+  TUNNEL_FRAMES,
+  TUNNEL_FRAGMENT,
+};
+
+// Датаграмма туннеля: заголовок, затем count кадров, перед каждым кадром его
+// длина. Все поля в сетевом порядке байт.
+struct tunnel_header_t {
+  uint8_t version;
+  uint8_t type;
+  uint16_t count;
+};
+
+// Кадр больше mtu режется на фрагменты, каждый в своей датаграмме после
+// заголовка с типом TUNNEL_FRAGMENT. Все фрагменты кроме последнего по chunk
+// байт. MAC адреса кадра повторяются в каждом фрагменте на том же смещении,
+// что и у целого кадра, чтобы BPF распределял их в тот же шард.
+struct tunnel_fragment_t {
+  uint16_t chunk;
+  uint8_t macs[12];
+  uint16_t reserved;
+  uint32_t id;
+  uint32_t offset;
+  uint32_t length;
+};
+
+#define TUNNEL_HEADER_SIZE sizeof(struct tunnel_header_t)
+#define TUNNEL_LENGTH_SIZE sizeof(uint16_t)
+#define TUNNEL_OVERHEAD (TUNNEL_HEADER_SIZE + TUNNEL_LENGTH_SIZE)
+#define TUNNEL_FRAGMENT_OVERHEAD \
+  (TUNNEL_HEADER_SIZE + sizeof(struct tunnel_fragment_t))
+// Фрагмент не меньше этого, чтобы кадр любого размера уложился в
+// TUNNEL_MAX_FRAGMENTS фрагментов.
+#define TUNNEL_MIN_CHUNK \
+  ((TUNNEL_MAX_FRAME_SIZE + TUNNEL_MAX_FRAGMENTS - 1) / TUNNEL_MAX_FRAGMENTS)
+
+struct tunnel_slot_t {
+  struct sockaddr_in source;
+  uint32_t id;
+  uint32_t length;
+  uint32_t chunk;
+  uint64_t missing;
+  uint64_t started_ns;
+  uint8_t* bytes;
+  size_t capacity;
+};
+
+// Таблица сборки фиксированного размера, своя у каждого потока приема.
+// Недособранный кадр выбрасывается через timeout миллисекунд или когда его
+// место нужно новому кадру, буферы слотов в сумме не больше memory байт.
+struct tunnel_reasm_t {
+  struct tunnel_slot_t* slots;
+  unsigned int count;
+  unsigned int timeout;
+  size_t memory;
+  size_t used;
+};
+
+void tunnel_header_init(struct tunnel_header_t* header, uint8_t flags);
+size_t tunnel_append(uint8_t* buffer,
+                     size_t used,
+                     uint8_t flags,
+                     const uint8_t* bytes,
+                     size_t size);
+unsigned int tunnel_count(const uint8_t* buffer);
+enum tunnel_type_t tunnel_type(const uint8_t* buffer);
+
+bool tunnel_fragmented(size_t mtu, size_t size);
+size_t tunnel_chunk(size_t mtu, size_t size);
+unsigned int tunnel_fragments(size_t mtu, size_t size);
+void tunnel_fragment_init(struct tunnel_header_t* header,
+                          struct tunnel_fragment_t* fragment,
+                          uint8_t flags,
+                          const uint8_t* bytes,
+                          size_t size,
+                          size_t chunk,
+                          uint32_t id,
+                          size_t offset);
+
+int tunnel_reasm_init(struct tunnel_reasm_t* reasm,
+                      unsigned int count,
+                      unsigned int timeout,
+                      size_t memory);
+void tunnel_reasm_free(struct tunnel_reasm_t* reasm);
+
+int tunnel_unpack(struct tunnel_reasm_t* reasm,
+                  const struct sockaddr_in* source,
+                  uint8_t flags,
+                  const uint8_t* bytes,
+                  size_t size,
+                  tunnel_handler_t handler,
+                  void* user);
+
+#endif  // BRIDGE_TUNNEL_H
@@ -0,0 +1,414 @@
+#include "udp.h"
+
+#include <errno.h>
+#include <netinet/udp.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+#define UDP_CONTROL_SIZE CMSG_SPACE(sizeof(int))
+
+void udp_socket_offload(int socket, bool* gso, bool* gro) {
+  if (*gso) {
+    // UDP_SEGMENT со значением 0 ничего не включает, но проверяет что ядро
+    // знает эту опцию.
+    int size = 0;
+    if (setsockopt(socket, SOL_UDP, UDP_SEGMENT, &size, sizeof(size)) == -1) {
+      fprintf(stderr, "WARNING> %s UDP_SEGMENT unsupported\n", __FUNCTION__);
+      *gso = false;
+    }
+  }
+
+  if (*gro) {
+    int one = 1;
+    if (setsockopt(socket, SOL_UDP, UDP_GRO, &one, sizeof(one)) == -1) {
+      fprintf(stderr, "WARNING> %s UDP_GRO unsupported\n", __FUNCTION__);
+      *gro = false;
+    }
+  }
+}
+
+int udp_batch_init(struct udp_batch_t* batch,
+                   unsigned int depth,
+                   size_t buffer_size) {
+  memset(batch, 0, sizeof(*batch));
+  if (depth == 0) {
+    depth = 1;
+  }
+
+  batch->depth = depth;
+  batch->buffer_size = buffer_size;
+  batch->buffers = malloc(depth * buffer_size);
+  batch->controls = calloc(depth, UDP_CONTROL_SIZE);
+  batch->msgs = calloc(depth, sizeof(*batch->msgs));
+  batch->iovs = calloc(depth, sizeof(*batch->iovs));
+  batch->addrs = calloc(depth, sizeof(*batch->addrs));
+  batch->segments = calloc(depth, sizeof(*batch->segments));
+  if (!batch->buffers || !batch->controls || !batch->msgs || !batch->iovs ||
+      !batch->addrs || !batch->segments) {
+    fprintf(stderr, "ERROR> %s malloc depth %u\n", __FUNCTION__, depth);
+    udp_batch_free(batch);
+    return -1;
+  }
+
+  return 0;
+}
+
+void udp_batch_free(struct udp_batch_t* batch) {
+  free(batch->buffers);
+  free(batch->controls);
+  free(batch->msgs);
+  free(batch->iovs);
+  free(batch->addrs);
+  free(batch->segments);
+  memset(batch, 0, sizeof(*batch));
+}
+
+uint8_t* udp_batch_buffer(struct udp_batch_t* batch, unsigned int index) {
+  return batch->buffers + index * batch->buffer_size;
+}
+
+size_t udp_batch_size(struct udp_batch_t* batch, unsigned int index) {
+  return batch->msgs[index].msg_len;
+}
+
+const struct sockaddr_in* udp_batch_addr(struct udp_batch_t* batch,
+                                         unsigned int index) {
+  return &batch->addrs[index];
+}
+
+static uint8_t* udp_batch_control(struct udp_batch_t* batch,
+                                  unsigned int index) {
+  return batch->controls + index * UDP_CONTROL_SIZE;
+}
+
+static uint16_t udp_batch_parse_gro(struct msghdr* hdr) {
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr); cmsg;
+       cmsg = CMSG_NXTHDR(hdr, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+      int size = 0;
+      memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+      return size;
+    }
+  }
+
+  return 0;
+}
+
+int udp_batch_recv(struct udp_batch_t* batch, int socket, int flags) {
+  for (unsigned int i = 0; i < batch->depth; i++) {
+    batch->iovs[i].iov_base = udp_batch_buffer(batch, i);
+    batch->iovs[i].iov_len = batch->buffer_size;
+
+    struct msghdr* hdr = &batch->msgs[i].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = &batch->addrs[i];
+    hdr->msg_namelen = sizeof(batch->addrs[i]);
+    hdr->msg_iov = &batch->iovs[i];
+    hdr->msg_iovlen = 1;
+    if (batch->gro) {
+      hdr->msg_control = udp_batch_control(batch, i);
+      hdr->msg_controllen = UDP_CONTROL_SIZE;
+    }
+  }
+
+  int count = recvmmsg(socket, batch->msgs, batch->depth, flags, NULL);
+  if (count == -1) {
+    if (batch->stats && (errno != EAGAIN) && (errno != EWOULDBLOCK)) {
+      stats_error(batch->stats);
+    }
+    batch->count = 0;
+    return -1;
+  }
+
+  size_t bytes = 0;
+  for (int i = 0; i < count; i++) {
+    batch->segments[i] =
+        batch->gro ? udp_batch_parse_gro(&batch->msgs[i].msg_hdr) : 0;
+    bytes += batch->msgs[i].msg_len;
+  }
+  if (batch->stats) {
+    stats_add_n(batch->stats, count, bytes);
+  }
+
+  batch->count = count;
+  batch->stamp = latency_start(batch->latency);
+  return count;
+}
+
+// Каждая датаграмма (в том числе сегмент склеенной GRO) разбирается на
+// кадры туннеля.
+int udp_batch_split(struct udp_batch_t* batch,
+                    unsigned int index,
+                    udp_handler_t handler,
+                    void* user) {
+  const uint8_t* bytes = udp_batch_buffer(batch, index);
+  size_t size = udp_batch_size(batch, index);
+  size_t segment = batch->segments[index];
+  if (segment == 0) {
+    segment = size;
+  }
+
+  int count = 0;
+  while (size) {
+    size_t bytes_count = (size < segment) ? size : segment;
+    int frames = tunnel_unpack(batch->reasm, udp_batch_addr(batch, index),
+                               batch->flags, bytes, bytes_count, handler, user);
+    if (frames > 0) {
+      count += frames;
+    }
+    bytes += bytes_count;
+    size -= bytes_count;
+  }
+  latency_record(batch->latency, batch->stamp);
+
+  return count;
+}
+
+int udp_batch_full(struct udp_batch_t* batch) {
+  return batch->count >= batch->depth;
+}
+
+static uint64_t udp_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Пачку пора отправлять, если она заполнена или первый кадр в ней ждет
+// дольше delay микросекунд.
+bool udp_batch_due(struct udp_batch_t* batch) {
+  if (!batch->count) {
+    return false;
+  }
+  if (udp_batch_full(batch)) {
+    return true;
+  }
+
+  return batch->delay &&
+         (udp_now() - batch->first_ns >= batch->delay * 1000ull);
+}
+
+static bool udp_addr_equal(const struct sockaddr_in* a,
+                           const struct sockaddr_in* b) {
+  return (a->sin_port == b->sin_port) &&
+         (a->sin_addr.s_addr == b->sin_addr.s_addr);
+}
+
+static uint8_t* udp_batch_next(struct udp_batch_t* batch,
+                               const struct sockaddr_in* addr) {
+  unsigned int index = batch->count++;
+  if (index == 0) {
+    batch->first_ns = batch->delay ? udp_now() : 0;
+    batch->stamp = latency_start(batch->latency);
+  }
+  if (addr) {
+    batch->addrs[index] = *addr;
+  }
+  batch->iovs[index].iov_base = udp_batch_buffer(batch, index);
+  return batch->iovs[index].iov_base;
+}
+
+// Фрагменты кадра добавляются в пачку только все вместе: если места не
+// хватает, пачку нужно отправить и добавить кадр заново.
+static int udp_batch_fragment(struct udp_batch_t* batch,
+                              const uint8_t* bytes,
+                              size_t size,
+                              const struct sockaddr_in* addr) {
+  size_t chunk = tunnel_chunk(batch->mtu, size);
+  unsigned int count = tunnel_fragments(batch->mtu, size);
+  if ((size > TUNNEL_MAX_FRAME_SIZE) ||
+      (TUNNEL_FRAGMENT_OVERHEAD + chunk > batch->buffer_size) ||
+      (batch->count + count > batch->depth)) {
+    return -1;
+  }
+
+  uint32_t id = batch->fragment_id++;
+  for (size_t offset = 0; offset < size; offset += chunk) {
+    size_t bytes_count = (size - offset < chunk) ? size - offset : chunk;
+    uint8_t* buffer = udp_batch_next(batch, addr);
+    struct tunnel_header_t header;
+    struct tunnel_fragment_t fragment;
+    tunnel_fragment_init(&header, &fragment, batch->flags, bytes, size, chunk,
+                         id, offset);
+    memcpy(buffer, &header, sizeof(header));
+    memcpy(buffer + sizeof(header), &fragment, sizeof(fragment));
+    memcpy(buffer + TUNNEL_FRAGMENT_OVERHEAD, bytes + offset, bytes_count);
+    batch->iovs[batch->count - 1].iov_len =
+        TUNNEL_FRAGMENT_OVERHEAD + bytes_count;
+  }
+
+  return 0;
+}
+
+// Мелкие кадры дописываются в последнюю датаграмму пачки, пока она не
+// превышает mtu, иначе кадр занимает новую датаграмму.
+static int udp_batch_append(struct udp_batch_t* batch,
+                            const uint8_t* bytes,
+                            size_t size,
+                            const struct sockaddr_in* addr) {
+  if (tunnel_fragmented(batch->mtu, size)) {
+    return udp_batch_fragment(batch, bytes, size, addr);
+  }
+
+  if (batch->count) {
+    unsigned int last = batch->count - 1;
+    struct iovec* iov = &batch->iovs[last];
+    if ((iov->iov_len + TUNNEL_LENGTH_SIZE + size <= batch->mtu) &&
+        (tunnel_type(iov->iov_base) == TUNNEL_FRAMES) &&
+        (tunnel_count(iov->iov_base) < TUNNEL_MAX_FRAMES) &&
+        (!addr || udp_addr_equal(&batch->addrs[last], addr))) {
+      iov->iov_len = tunnel_append(iov->iov_base, iov->iov_len, batch->flags,
+                                   bytes, size);
+      return 0;
+    }
+  }
+
+  if (udp_batch_full(batch) || (TUNNEL_OVERHEAD + size > batch->buffer_size)) {
+    return -1;
+  }
+
+  uint8_t* buffer = udp_batch_next(batch, addr);
+  batch->iovs[batch->count - 1].iov_len =
+      tunnel_append(buffer, 0, batch->flags, bytes, size);
+
+  return 0;
+}
+
+int udp_batch_add(struct udp_batch_t* batch,
+                  const uint8_t* bytes,
+                  size_t size) {
+  uint64_t start = latency_start(batch->encapsulate);
+  int res = udp_batch_append(batch, bytes, size, NULL);
+  latency_record(batch->encapsulate, start);
+  return res;
+}
+
+int udp_batch_add_to(struct udp_batch_t* batch,
+                     const uint8_t* bytes,
+                     size_t size,
+                     const struct sockaddr_in* addr) {
+  uint64_t start = latency_start(batch->encapsulate);
+  int res = udp_batch_append(batch, bytes, size, addr);
+  latency_record(batch->encapsulate, start);
+  return res;
+}
+
+// Соседние кадры одного размера (последний может быть короче) склеиваются в
+// одно сообщение с UDP_SEGMENT, ядро само нарежет его на датаграммы.
+static unsigned int udp_batch_group(struct udp_batch_t* batch,
+                                    unsigned int first,
+                                    const struct sockaddr_in* addr) {
+  size_t segment = batch->iovs[first].iov_len;
+  size_t total = segment;
+  unsigned int last = first + 1;
+  while (batch->gso && (last < batch->count) &&
+         (last - first < UDP_GSO_MAX_SEGMENTS) &&
+         (batch->iovs[last - 1].iov_len == segment) &&
+         (batch->iovs[last].iov_len <= segment) &&
+         (total + batch->iovs[last].iov_len <= UDP_GSO_MAX_SIZE) &&
+         (addr || udp_addr_equal(&batch->addrs[first], &batch->addrs[last]))) {
+    total += batch->iovs[last].iov_len;
+    last++;
+  }
+
+  return last - first;
+}
+
+static unsigned int udp_batch_prepare(struct udp_batch_t* batch,
+                                      unsigned int first,
+                                      const struct sockaddr_in* addr,
+                                      socklen_t addr_len) {
+  unsigned int count = 0;
+  for (unsigned int i = first; i < batch->count; count++) {
+    unsigned int frames = udp_batch_group(batch, i, addr);
+
+    struct msghdr* hdr = &batch->msgs[count].msg_hdr;
+    memset(hdr, 0, sizeof(*hdr));
+    hdr->msg_name = addr ? (void*)addr : &batch->addrs[i];
+    hdr->msg_namelen = addr ? addr_len : sizeof(batch->addrs[i]);
+    hdr->msg_iov = &batch->iovs[i];
+    hdr->msg_iovlen = frames;
+    if (frames > 1) {
+      uint8_t* control = udp_batch_control(batch, count);
+      memset(control, 0, UDP_CONTROL_SIZE);
+      hdr->msg_control = control;
+      hdr->msg_controllen = CMSG_SPACE(sizeof(uint16_t));
+
+      struct cmsghdr* cmsg = CMSG_FIRSTHDR(hdr);
+      cmsg->cmsg_level = SOL_UDP;
+      cmsg->cmsg_type = UDP_SEGMENT;
+      cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+      uint16_t segment = batch->iovs[i].iov_len;
+      memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+    }
+
+    i += frames;
+  }
+
+  return count;
+}
+
+// Без addr каждая датаграмма уходит по адресу, сохраненному udp_batch_add_to.
+int udp_batch_send(struct udp_batch_t* batch,
+                   int socket,
+                   const struct sockaddr_in* addr,
+                   socklen_t addr_len) {
+  if (batch->stats) {
+    size_t bytes = 0;
+    for (unsigned int i = 0; i < batch->count; i++) {
+      bytes += batch->iovs[i].iov_len;
+    }
+    stats_add_n(batch->stats, batch->count, bytes);
+  }
+
+  unsigned int count = udp_batch_prepare(batch, 0, addr, addr_len);
+  unsigned int sent = 0;
+  int res = 0;
+  while (sent < count) {
+    int sent_count = sendmmsg(socket, batch->msgs + sent, count - sent, 0);
+    if (sent_count != -1) {
+      sent += sent_count;
+      continue;
+    }
+    // Подключенный сокет отдает ошибку ICMP от пира один раз, датаграммы
+    // отправляются повторно.
+    if ((errno == EINTR) || (errno == ECONNREFUSED)) {
+      continue;
+    }
+
+    unsigned int frame = batch->msgs[sent].msg_hdr.msg_iov - batch->iovs;
+    if (batch->gso && (errno == EIO)) {
+      // Устройство не умеет считать контрольные суммы для GSO: дальше
+      // отправляем по одной датаграмме на кадр.
+      fprintf(stderr, "WARNING> %s UDP GSO disabled\n", __FUNCTION__);
+      batch->gso = false;
+      count = udp_batch_prepare(batch, frame, addr, addr_len);
+      sent = 0;
+      continue;
+    }
+
+    // Сообщение, на котором споткнулся sendmmsg, отбрасывается, остальные
+    // отправляются следующим вызовом.
+    if (batch->stats) {
+      stats_error(batch->stats);
+    }
+    res = -1;
+    sent++;
+  }
+  latency_record(batch->latency, batch->stamp);
+
+  batch->count = 0;
+  return res;
+}
@@ -0,0 +1,79 @@
+#ifndef BRIDGE_UDP_H
+#define BRIDGE_UDP_H
+
+#include "latency.h"
+#include "stats.h"
+#include "tunnel.h"
+
+#include <inttypes.h>
+#include <netinet/in.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define UDP_GRO_BUFFER_SIZE 65535
+#define UDP_GSO_MAX_SEGMENTS 64
+#define UDP_GSO_MAX_SIZE 65000
+
+typedef void (*udp_handler_t)(void* user, const uint8_t* bytes, size_t size);
+
+struct udp_batch_t {
+  unsigned int depth;
+  unsigned int count;
+  size_t buffer_size;
+  bool gso;
+  bool gro;
+  size_t mtu;
+  unsigned int delay;
+  uint64_t first_ns;
+  uint32_t fragment_id;
+  uint8_t flags;
+  struct tunnel_reasm_t* reasm;
+  struct stats_counter_t* stats;
+  // Пачка отправки: время упаковки кадра (encapsulate) и от первого кадра
+  // пачки до конца sendmmsg (latency). Пачка приема: от recvmmsg до разбора
+  // датаграммы (latency).
+  struct latency_hist_t* encapsulate;
+  struct latency_hist_t* latency;
+  uint64_t stamp;
+  uint8_t* buffers;
+  uint8_t* controls;
+  struct mmsghdr* msgs;
+  struct iovec* iovs;
+  struct sockaddr_in* addrs;
+  uint16_t* segments;
+};
+
+void udp_socket_offload(int socket, bool* gso, bool* gro);
+
+int udp_batch_init(struct udp_batch_t* batch,
+                   unsigned int depth,
+                   size_t buffer_size);
+void udp_batch_free(struct udp_batch_t* batch);
+
+int udp_batch_recv(struct udp_batch_t* batch, int socket, int flags);
+uint8_t* udp_batch_buffer(struct udp_batch_t* batch, unsigned int index);
+size_t udp_batch_size(struct udp_batch_t* batch, unsigned int index);
+const struct sockaddr_in* udp_batch_addr(struct udp_batch_t* batch,
+                                         unsigned int index);
+int udp_batch_split(struct udp_batch_t* batch,
+                    unsigned int index,
+                    udp_handler_t handler,
+                    void* user);
+
+int udp_batch_add(struct udp_batch_t* batch,
+                  const uint8_t* bytes,
+                  size_t size);
+int udp_batch_add_to(struct udp_batch_t* batch,
+                     const uint8_t* bytes,
+                     size_t size,
+                     const struct sockaddr_in* addr);
+int udp_batch_full(struct udp_batch_t* batch);
+bool udp_batch_due(struct udp_batch_t* batch);
+int udp_batch_send(struct udp_batch_t* batch,
+                   int socket,
+                   const struct sockaddr_in* addr,
+                   socklen_t addr_len);
+
+#endif  // BRIDGE_UDP_H
@@ -0,0 +1,951 @@
+#include "uring.h"
+#include "cpu.h"
+
+#include <arpa/inet.h>
+#include <errno.h>
+#include <netinet/udp.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#ifndef SOL_UDP
+#define SOL_UDP 17
+#endif
+#ifndef UDP_SEGMENT
+#define UDP_SEGMENT 103
+#endif
+#ifndef UDP_GRO
+#define UDP_GRO 104
+#endif
+
+// Появился в ядре 6.7, заголовки могут его еще не знать.
+#define URING_OP_READ_MULTISHOT 49
+
+#define URING_RX_GROUP 0
+#define URING_FD_GROUP 1
+
+#define URING_FILE_SOCKET 0
+#define URING_FILE_FD 1
+
+enum {
+  URING_RECV = 1,
+  URING_READ,
+  URING_SEND,
+  URING_WRITE,
+  URING_POLL,
+  URING_STOP,
+};
+
+static uint64_t uring_data(unsigned int type, unsigned int bid) {
+  return ((uint64_t)type << 32) | bid;
+}
+
+static int uring_setup(unsigned int entries, struct io_uring_params* params) {
+  return syscall(__NR_io_uring_setup, entries, params);
+}
+
+static int uring_enter(int fd,
+                       unsigned int to_submit,
+                       unsigned int min_complete,
+                       unsigned int flags) {
+  return syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL,
+                 0);
+}
+
+static int uring_register(int fd,
+                          unsigned int opcode,
+                          const void* arg,
+                          unsigned int nr_args) {
+  return syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+static void uring_close(struct uring_t* ring) {
+  if (ring->sqes) {
+    munmap(ring->sqes, ring->sqes_size);
+  }
+  if (ring->cq_ring && (ring->cq_ring != ring->sq_ring)) {
+    munmap(ring->cq_ring, ring->cq_ring_size);
+  }
+  if (ring->sq_ring) {
+    munmap(ring->sq_ring, ring->sq_ring_size);
+  }
+  if (ring->fd != -1) {
+    close(ring->fd);
+  }
+  memset(ring, 0, sizeof(*ring));
+  ring->fd = -1;
+}
+
+static int uring_open(struct uring_t* ring, unsigned int entries) {
+  struct io_uring_params params;
+  memset(&params, 0, sizeof(params));
+  params.flags = IORING_SETUP_COOP_TASKRUN;
+  ring->fd = uring_setup(entries, &params);
+  if ((ring->fd == -1) && (errno == EINVAL)) {
+    params.flags = 0;
+    ring->fd = uring_setup(entries, &params);
+  }
+  if (ring->fd == -1) {
+    fprintf(stderr, "ERROR> %s io_uring_setup\n", __FUNCTION__);
+    perror("io_uring_setup:");
+    return -1;
+  }
+
+  ring->sq_ring_size =
+      params.sq_off.array + params.sq_entries * sizeof(unsigned int);
+  ring->cq_ring_size =
+      params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) {
+      ring->sq_ring_size = ring->cq_ring_size;
+    }
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE,
+                       MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto aborting;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring =
+        mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE,
+             MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto aborting;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE,
+                    MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto aborting;
+  }
+
+  ring->sq_head = (unsigned int*)(ring->sq_ring + params.sq_off.head);
+  ring->sq_tail = (unsigned int*)(ring->sq_ring + params.sq_off.tail);
+  ring->sq_array = (unsigned int*)(ring->sq_ring + params.sq_off.array);
+  ring->sq_mask = *(unsigned int*)(ring->sq_ring + params.sq_off.ring_mask);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head = (unsigned int*)(ring->cq_ring + params.cq_off.head);
+  ring->cq_tail = (unsigned int*)(ring->cq_ring + params.cq_off.tail);
+  ring->cq_mask = *(unsigned int*)(ring->cq_ring + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe*)(ring->cq_ring + params.cq_off.cqes);
+  ring->pending = 0;
+
+  return 0;
+
+aborting:
+  fprintf(stderr, "ERROR> %s mmap\n", __FUNCTION__);
+  uring_close(ring);
+  return -1;
+}
+
+// GETEVENTS передается всегда: с COOP_TASKRUN завершения, в том числе
+// multishot приема, публикуются только при входе в ядро.
+static int uring_submit(struct uring_t* ring, unsigned int wait) {
+  int res =
+      uring_enter(ring->fd, ring->pending, wait, IORING_ENTER_GETEVENTS);
+  if (res == -1) {
+    return (errno == EINTR) ? 0 : -1;
+  }
+
+  ring->pending -= ((unsigned int)res < ring->pending) ? (unsigned int)res
+                                                      : ring->pending;
+  return res;
+}
+
+static struct io_uring_sqe* uring_sqe(struct uring_t* ring) {
+  unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+  unsigned int tail = *ring->sq_tail;
+  if (tail - head >= ring->sq_entries) {
+    uring_submit(ring, 0);
+    head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+    if (tail - head >= ring->sq_entries) {
+      return NULL;
+    }
+  }
+
+  unsigned int index = tail & ring->sq_mask;
+  struct io_uring_sqe* sqe = &ring->sqes[index];
+  memset(sqe, 0, sizeof(*sqe));
+  ring->sq_array[index] = index;
+  __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+  ring->pending++;
+
+  return sqe;
+}
+
+static bool uring_probe(struct uring_t* ring, unsigned int op) {
+  size_t size = sizeof(struct io_uring_probe) +
+                256 * sizeof(struct io_uring_probe_op);
+  struct io_uring_probe* probe = calloc(1, size);
+  if (!probe) {
+    return false;
+  }
+
+  bool supported = false;
+  if ((uring_register(ring->fd, IORING_REGISTER_PROBE, probe, 256) == 0) &&
+      (op <= probe->last_op) && (op < probe->ops_len)) {
+    supported = probe->ops[op].flags & IO_URING_OP_SUPPORTED;
+  }
+
+  free(probe);
+  return supported;
+}
+
+static uint8_t* uring_buffer(struct uring_buffers_t* buffers,
+                             unsigned int bid) {
+  return buffers->buffers + (size_t)bid * buffers->buffer_size;
+}
+
+static void uring_buffers_add(struct uring_buffers_t* buffers,
+                              unsigned int bid) {
+  struct io_uring_buf* buf =
+      &buffers->ring->bufs[buffers->tail & (buffers->count - 1)];
+  buf->addr = (uint64_t)(uintptr_t)uring_buffer(buffers, bid);
+  buf->len = buffers->buffer_size;
+  buf->bid = bid;
+  buffers->tail++;
+}
+
+static void uring_buffers_commit(struct uring_buffers_t* buffers) {
+  if (buffers->ring) {
+    __atomic_store_n(&buffers->ring->tail, buffers->tail, __ATOMIC_RELEASE);
+  }
+}
+
+static void uring_buffers_close(struct uring_buffers_t* buffers) {
+  if (buffers->ring) {
+    munmap(buffers->ring, buffers->ring_size);
+  }
+  if (buffers->buffers) {
+    munmap(buffers->buffers, buffers->count * buffers->buffer_size);
+  }
+  memset(buffers, 0, sizeof(*buffers));
+}
+
+static int uring_buffers_open(struct uring_t* ring,
+                              struct uring_buffers_t* buffers,
+                              uint16_t group,
+                              unsigned int count,
+                              size_t buffer_size) {
+  buffers->group = group;
+  buffers->count = count;
+  buffers->buffer_size = buffer_size;
+  buffers->tail = 0;
+
+  buffers->ring_size = count * sizeof(struct io_uring_buf);
+  buffers->ring = mmap(NULL, buffers->ring_size, PROT_READ | PROT_WRITE,
+                       MAP_ANONYMOUS | MAP_PRIVATE, -1, 0);
+  buffers->buffers = mmap(NULL, count * buffer_size, PROT_READ | PROT_WRITE,
+                          MAP_ANONYMOUS | MAP_PRIVATE | MAP_POPULATE, -1, 0);
+  if ((buffers->ring == MAP_FAILED) || (buffers->buffers == MAP_FAILED)) {
+    buffers->ring = (buffers->ring == MAP_FAILED) ? NULL : buffers->ring;
+    buffers->buffers =
+        (buffers->buffers == MAP_FAILED) ? NULL : buffers->buffers;
+    fprintf(stderr, "ERROR> %s mmap\n", __FUNCTION__);
+    uring_buffers_close(buffers);
+    return -1;
+  }
+
+  struct io_uring_buf_reg reg;
+  memset(&reg, 0, sizeof(reg));
+  reg.ring_addr = (uint64_t)(uintptr_t)buffers->ring;
+  reg.ring_entries = count;
+  reg.bgid = group;
+  if (uring_register(ring->fd, IORING_REGISTER_PBUF_RING, &reg, 1) == -1) {
+    fprintf(stderr, "ERROR> %s IORING_REGISTER_PBUF_RING\n", __FUNCTION__);
+    uring_buffers_close(buffers);
+    return -1;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    uring_buffers_add(buffers, i);
+  }
+  uring_buffers_commit(buffers);
+
+  return 0;
+}
+
+void uring_channel_init(struct uring_channel_t* channel) {
+  memset(channel, 0, sizeof(*channel));
+  channel->ring.fd = -1;
+  channel->socket = -1;
+  channel->fd = -1;
+  channel->poll_fd = -1;
+  channel->event_fd = -1;
+}
+
+int uring_channel_open(struct uring_channel_t* channel,
+                       int socket,
+                       int fd,
+                       size_t rx_size,
+                       size_t fd_size) {
+  channel->socket = socket;
+  channel->fd = fd;
+
+  if (uring_open(&channel->ring, URING_ENTRIES) == -1) {
+    return -1;
+  }
+  struct uring_t* ring = &channel->ring;
+
+  if (!uring_probe(ring, IORING_OP_RECVMSG) ||
+      !uring_probe(ring, IORING_OP_SENDMSG)) {
+    fprintf(stderr, "ERROR> %s io_uring without RECVMSG/SENDMSG\n",
+            __FUNCTION__);
+    goto aborting;
+  }
+  channel->read_multishot = uring_probe(ring, URING_OP_READ_MULTISHOT);
+
+  int files[2] = {socket, fd};
+  if (uring_register(ring->fd, IORING_REGISTER_FILES, files,
+                     (fd == -1) ? 1 : 2) == -1) {
+    fprintf(stderr, "ERROR> %s IORING_REGISTER_FILES\n", __FUNCTION__);
+    goto aborting;
+  }
+
+  // Перед данными датаграммы ядро кладет io_uring_recvmsg_out, адрес и cmsg.
+  channel->recv_msg.msg_namelen = sizeof(struct sockaddr_in);
+  channel->recv_msg.msg_controllen = CMSG_SPACE(sizeof(int));
+  size_t rx_head = sizeof(struct io_uring_recvmsg_out) +
+                   channel->recv_msg.msg_namelen +
+                   channel->recv_msg.msg_controllen;
+  if (uring_buffers_open(ring, &channel->rx_buffers, URING_RX_GROUP,
+                         URING_BUFFER_COUNT, rx_head + rx_size) == -1) {
+    goto aborting;
+  }
+
+  channel->rx_refs = calloc(URING_BUFFER_COUNT, sizeof(*channel->rx_refs));
+  if (!channel->rx_refs) {
+    goto aborting;
+  }
+
+  // При fd_size == 0 fd используется только для записи.
+  if ((fd != -1) && fd_size) {
+    if (uring_buffers_open(ring, &channel->fd_buffers, URING_FD_GROUP,
+                           URING_BUFFER_COUNT, fd_size) == -1) {
+      goto aborting;
+    }
+
+    channel->sends = calloc(URING_SENDS, sizeof(*channel->sends));
+    channel->free_sends = calloc(URING_SENDS, sizeof(*channel->free_sends));
+    channel->fd_refs = calloc(URING_BUFFER_COUNT, sizeof(*channel->fd_refs));
+    if (!channel->sends || !channel->free_sends || !channel->fd_refs) {
+      goto aborting;
+    }
+    for (unsigned int i = 0; i < URING_SENDS; i++) {
+      channel->free_sends[i] = i;
+    }
+    channel->free_count = URING_SENDS;
+  }
+
+  if (fd != -1) {
+    // Буферы приема зарегистрированы целиком одним фиксированным буфером, из
+    // них кадры пишутся в tap через WRITE_FIXED без повторного pin страниц.
+    struct iovec iov = {channel->rx_buffers.buffers,
+                        URING_BUFFER_COUNT * channel->rx_buffers.buffer_size};
+    channel->write_fixed =
+        uring_register(ring->fd, IORING_REGISTER_BUFFERS, &iov, 1) == 0;
+  }
+
+  channel->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (channel->event_fd == -1) {
+    goto aborting;
+  }
+
+  return 0;
+
+aborting:
+  uring_channel_close(channel);
+  return -1;
+}
+
+void uring_channel_close(struct uring_channel_t* channel) {
+  uring_buffers_close(&channel->rx_buffers);
+  uring_buffers_close(&channel->fd_buffers);
+  uring_close(&channel->ring);
+  free(channel->sends);
+  free(channel->free_sends);
+  free(channel->fd_refs);
+  free(channel->rx_refs);
+  if (channel->event_fd != -1) {
+    close(channel->event_fd);
+  }
+  uring_channel_init(channel);
+}
+
+static void uring_arm_recv(struct uring_channel_t* channel) {
+  struct io_uring_sqe* sqe = uring_sqe(&channel->ring);
+  if (!sqe) {
+    return;
+  }
+
+  sqe->opcode = IORING_OP_RECVMSG;
+  sqe->fd = URING_FILE_SOCKET;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->addr = (uint64_t)(uintptr_t)&channel->recv_msg;
+  sqe->len = 1;
+  sqe->ioprio = IORING_RECV_MULTISHOT;
+  sqe->buf_group = URING_RX_GROUP;
+  sqe->user_data = uring_data(URING_RECV, 0);
+}
+
+static void uring_arm_read(struct uring_channel_t* channel) {
+  struct io_uring_sqe* sqe = uring_sqe(&channel->ring);
+  if (!sqe) {
+    return;
+  }
+
+  sqe->opcode =
+      channel->read_multishot ? URING_OP_READ_MULTISHOT : IORING_OP_READ;
+  sqe->fd = URING_FILE_FD;
+  sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+  sqe->off = (uint64_t)-1;
+  sqe->buf_group = URING_FD_GROUP;
+  sqe->user_data = uring_data(URING_READ, 0);
+}
+
+static void uring_arm_poll(struct uring_channel_t* channel,
+                           int fd,
+                           unsigned int type,
+                           bool multishot) {
+  struct io_uring_sqe* sqe = uring_sqe(&channel->ring);
+  if (!sqe) {
+    return;
+  }
+
+  sqe->opcode = IORING_OP_POLL_ADD;
+  sqe->fd = fd;
+  sqe->poll32_events = POLLIN;
+  sqe->len = multishot ? IORING_POLL_ADD_MULTI : 0;
+  sqe->user_data = uring_data(type, 0);
+}
+
+static void uring_recycle_rx(struct uring_channel_t* channel,
+                             unsigned int bid) {
+  if (channel->rx_refs[bid] == 0) {
+    uring_buffers_add(&channel->rx_buffers, bid);
+  }
+}
+
+static void uring_write_frame(struct uring_channel_t* channel,
+                              unsigned int bid,
+                              const uint8_t* bytes,
+                              size_t size) {
+  struct io_uring_sqe* sqe = uring_sqe(&channel->ring);
+  if (!sqe) {
+    fprintf(stderr, "ERROR> %s submission queue full\n", __FUNCTION__);
+    return;
+  }
+
+  sqe->opcode = channel->write_fixed ? IORING_OP_WRITE_FIXED : IORING_OP_WRITE;
+  sqe->fd = URING_FILE_FD;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)bytes;
+  sqe->len = size;
+  sqe->off = (uint64_t)-1;
+  sqe->buf_index = 0;
+  sqe->user_data = uring_data(URING_WRITE, bid);
+  channel->rx_refs[bid]++;
+}
+
+static void uring_frame(void* user, const uint8_t* bytes, size_t size) {
+  struct uring_channel_t* channel = user;
+
+  if (channel->learn_handler) {
+    channel->learn_handler(channel->user, bytes, size);
+  }
+  if (channel->frame_handler) {
+    channel->frame_handler(channel->user, bytes, size);
+    return;
+  }
+
+  // Собранный из фрагментов кадр лежит в таблице сборки, а не в буфере
+  // приема, и будет перезаписан, поэтому пишется сразу.
+  uint8_t* buffer = uring_buffer(&channel->rx_buffers, channel->rx_bid);
+  if ((bytes < buffer) ||
+      (bytes >= buffer + channel->rx_buffers.buffer_size)) {
+    if (write(channel->fd, bytes, size) == -1) {
+      static struct stats_limit_t limit;
+      stats_error(channel->stats->local_tx);
+      uint64_t count = stats_limit(&limit);
+      if (count) {
+        fprintf(stderr, "ERROR> %s write %s (%" PRIu64 " frames)\n",
+                __FUNCTION__, strerror(errno), count);
+      }
+      return;
+    }
+    stats_add(channel->stats->local_tx, size);
+    return;
+  }
+  uring_write_frame(channel, channel->rx_bid, bytes, size);
+}
+
+static int uring_handle_recv(struct uring_channel_t* channel,
+                             struct io_uring_cqe* cqe) {
+  if (!(cqe->flags & IORING_CQE_F_MORE)) {
+    uring_arm_recv(channel);
+  }
+  if (cqe->res < 0) {
+    // ECONNREFUSED: ICMP от пира подключенного сокета.
+    if ((cqe->res != -ENOBUFS) && (cqe->res != -ECONNREFUSED)) {
+      stats_error(channel->stats->tunnel_rx);
+      fprintf(stderr, "ERROR> %s recvmsg %s\n", __FUNCTION__,
+              strerror(-cqe->res));
+    }
+    return 0;
+  }
+  if (!(cqe->flags & IORING_CQE_F_BUFFER)) {
+    return 0;
+  }
+
+  unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  uint8_t* buffer = uring_buffer(&channel->rx_buffers, bid);
+  struct io_uring_recvmsg_out* out = (struct io_uring_recvmsg_out*)buffer;
+  uint8_t* name = buffer + sizeof(*out);
+  uint8_t* control = name + channel->recv_msg.msg_namelen;
+  uint8_t* payload = control + channel->recv_msg.msg_controllen;
+
+  struct sockaddr_in addr;
+  memset(&addr, 0, sizeof(addr));
+  memcpy(&addr, name,
+         out->namelen < sizeof(addr) ? out->namelen : sizeof(addr));
+  stats_add(channel->stats->tunnel_rx, out->payloadlen);
+  if ((out->flags & MSG_TRUNC) ||
+      (channel->accept && !channel->accept(channel->user, &addr))) {
+    stats_drop(channel->stats->tunnel_rx);
+    uring_recycle_rx(channel, bid);
+    return 0;
+  }
+
+  size_t segment = 0;
+  struct msghdr hdr;
+  memset(&hdr, 0, sizeof(hdr));
+  hdr.msg_control = control;
+  hdr.msg_controllen = out->controllen;
+  for (struct cmsghdr* cmsg = CMSG_FIRSTHDR(&hdr); cmsg;
+       cmsg = CMSG_NXTHDR(&hdr, cmsg)) {
+    if ((cmsg->cmsg_level == SOL_UDP) && (cmsg->cmsg_type == UDP_GRO)) {
+      int size = 0;
+      memcpy(&size, CMSG_DATA(cmsg), sizeof(size));
+      segment = size;
+    }
+  }
+
+  size_t size = out->payloadlen;
+  if (segment == 0) {
+    segment = size;
+  }
+
+  int count = 0;
+  channel->rx_bid = bid;
+  while (size) {
+    size_t bytes_count = (size < segment) ? size : segment;
+    int frames = tunnel_unpack(channel->reasm, &addr, channel->flags, payload,
+                               bytes_count, uring_frame, channel);
+    if (frames > 0) {
+      count += frames;
+    }
+    payload += bytes_count;
+    size -= bytes_count;
+  }
+
+  uring_recycle_rx(channel, bid);
+  return count;
+}
+
+static void uring_release_fd(struct uring_channel_t* channel,
+                             unsigned int bid) {
+  if (--channel->fd_refs[bid] == 0) {
+    uring_buffers_add(&channel->fd_buffers, bid);
+  }
+}
+
+static void uring_send_free(struct uring_channel_t* channel,
+                            struct uring_send_t* send) {
+  for (unsigned int i = 0; i < send->count; i++) {
+    uring_release_fd(channel, send->bids[i]);
+  }
+  channel->free_sends[channel->free_count++] = send - channel->sends;
+}
+
+static void uring_send_flush(struct uring_channel_t* channel) {
+  struct uring_send_t* send = channel->send;
+  if (!send) {
+    return;
+  }
+  channel->send = NULL;
+
+  memset(&send->msg, 0, sizeof(send->msg));
+  send->msg.msg_name = (void*)send->addr;
+  send->msg.msg_namelen = sizeof(*send->addr);
+  send->msg.msg_iov = send->iovs;
+  send->msg.msg_iovlen = send->iov_count;
+  if (send->datagrams > 1) {
+    send->msg.msg_control = send->control;
+    send->msg.msg_controllen = sizeof(send->control);
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&send->msg);
+    cmsg->cmsg_level = SOL_UDP;
+    cmsg->cmsg_type = UDP_SEGMENT;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(uint16_t));
+    uint16_t segment = send->segment;
+    memcpy(CMSG_DATA(cmsg), &segment, sizeof(segment));
+  }
+
+  struct io_uring_sqe* sqe = uring_sqe(&channel->ring);
+  if (!sqe) {
+    static struct stats_limit_t limit;
+    stats_drop(channel->stats->tunnel_tx);
+    uint64_t count = stats_limit(&limit);
+    if (count) {
+      fprintf(stderr, "ERROR> %s submission queue full (%" PRIu64 " times)\n",
+              __FUNCTION__, count);
+    }
+    uring_send_free(channel, send);
+    return;
+  }
+  sqe->opcode = IORING_OP_SENDMSG;
+  sqe->fd = URING_FILE_SOCKET;
+  sqe->flags = IOSQE_FIXED_FILE;
+  sqe->addr = (uint64_t)(uintptr_t)&send->msg;
+  sqe->len = 1;
+  sqe->user_data = uring_data(URING_SEND, send - channel->sends);
+}
+
+static void uring_send_datagram(struct uring_channel_t* channel,
+                                struct uring_send_t* send) {
+  struct tunnel_header_t* header = &send->headers[send->datagrams++];
+  tunnel_header_init(header, channel->flags);
+  send->iovs[send->iov_count].iov_base = header;
+  send->iovs[send->iov_count].iov_len = TUNNEL_HEADER_SIZE;
+  send->iov_count++;
+  send->datagram = TUNNEL_HEADER_SIZE;
+  send->size += TUNNEL_HEADER_SIZE;
+}
+
+static void uring_send_iov(struct uring_send_t* send,
+                           void* base,
+                           size_t size) {
+  send->iovs[send->iov_count].iov_base = base;
+  send->iovs[send->iov_count].iov_len = size;
+  send->iov_count++;
+  send->datagram += size;
+  send->size += size;
+  if (send->datagrams == 1) {
+    send->segment = send->datagram;
+  }
+}
+
+// Кадр дописывается в текущую датаграмму, пока она не больше mtu. С GSO все
+// датаграммы, кроме последней, должны быть одного размера.
+static bool uring_send_fits(struct uring_channel_t* channel,
+                            struct uring_send_t* send,
+                            const struct sockaddr_in* addr,
+                            size_t size) {
+  struct tunnel_header_t* header = &send->headers[send->datagrams - 1];
+  size_t need = TUNNEL_LENGTH_SIZE + size;
+  return (send->addr == addr) && (send->count < URING_SEND_FRAMES) &&
+         ((header->type & TUNNEL_TYPE_MASK) == TUNNEL_FRAMES) &&
+         (send->datagram + need <= channel->mtu) &&
+         (ntohs(header->count) < TUNNEL_MAX_FRAMES) &&
+         ((send->datagrams == 1) ||
+          ((send->datagram + need <= send->segment) &&
+           (send->size + need <= UDP_GSO_MAX_SIZE)));
+}
+
+// Новая датаграмма размером до size байт начинается в текущей отправке, если
+// та остается цепочкой GSO, иначе в новой.
+static struct uring_send_t* uring_send_next(struct uring_channel_t* channel,
+                                            const struct sockaddr_in* addr,
+                                            size_t size,
+                                            bool gso) {
+  struct uring_send_t* send = channel->send;
+  if (send &&
+      (!gso || (send->addr != addr) || (send->count == URING_SEND_FRAMES) ||
+       (send->datagrams == UDP_GSO_MAX_SEGMENTS) ||
+       (send->datagram != send->segment) || (size > send->segment) ||
+       (send->size + size > UDP_GSO_MAX_SIZE))) {
+    uring_send_flush(channel);
+    send = NULL;
+  }
+
+  if (!send) {
+    if (!channel->free_count) {
+      static struct stats_limit_t limit;
+      stats_drop(channel->stats->tunnel_tx);
+      uint64_t count = stats_limit(&limit);
+      if (count) {
+        fprintf(stderr, "ERROR> %s no free send slots (%" PRIu64 " frames)\n",
+                __FUNCTION__, count);
+      }
+      return NULL;
+    }
+    send = &channel->sends[channel->free_sends[--channel->free_count]];
+    send->addr = addr;
+    send->count = 0;
+    send->iov_count = 0;
+    send->datagrams = 0;
+    send->size = 0;
+    channel->send = send;
+  }
+
+  uring_send_datagram(channel, send);
+  return send;
+}
+
+static void uring_send_add(struct uring_channel_t* channel,
+                           unsigned int bid,
+                           size_t size,
+                           const struct sockaddr_in* addr,
+                           bool gso) {
+  struct uring_send_t* send = channel->send;
+  if (!send || !uring_send_fits(channel, send, addr, size)) {
+    send = uring_send_next(channel, addr, TUNNEL_OVERHEAD + size, gso);
+    if (!send) {
+      return;
+    }
+  }
+
+  struct tunnel_header_t* header = &send->headers[send->datagrams - 1];
+  header->count = htons(ntohs(header->count) + 1);
+  send->lengths[send->count] = htons(size);
+  uring_send_iov(send, &send->lengths[send->count], TUNNEL_LENGTH_SIZE);
+  uring_send_iov(send, uring_buffer(&channel->fd_buffers, bid), size);
+  send->bids[send->count++] = bid;
+  channel->fd_refs[bid]++;
+}
+
+// Фрагменты одного размера идут цепочкой GSO, последний может быть короче.
+static void uring_send_fragments(struct uring_channel_t* channel,
+                                 unsigned int bid,
+                                 size_t size,
+                                 const struct sockaddr_in* addr,
+                                 bool gso) {
+  uint8_t* bytes = uring_buffer(&channel->fd_buffers, bid);
+  size_t chunk = tunnel_chunk(channel->mtu, size);
+  uint32_t id = channel->fragment_id++;
+  for (size_t offset = 0; offset < size; offset += chunk) {
+    size_t bytes_count = (size - offset < chunk) ? size - offset : chunk;
+    struct uring_send_t* send = uring_send_next(
+        channel, addr, TUNNEL_FRAGMENT_OVERHEAD + bytes_count, gso);
+    if (!send) {
+      return;
+    }
+
+    unsigned int index = send->datagrams - 1;
+    struct tunnel_fragment_t* fragment = &send->fragments[index];
+    tunnel_fragment_init(&send->headers[index], fragment, channel->flags, bytes,
+                         size, chunk, id, offset);
+    uring_send_iov(send, fragment, sizeof(*fragment));
+    uring_send_iov(send, bytes + offset, bytes_count);
+    send->bids[send->count++] = bid;
+    channel->fd_refs[bid]++;
+  }
+}
+
+static void uring_send_frame(struct uring_channel_t* channel,
+                             unsigned int bid,
+                             size_t size) {
+  const struct sockaddr_in* addrs[URING_MAX_ROUTES];
+  unsigned int count = 1;
+  if (channel->route) {
+    uint8_t* bytes = uring_buffer(&channel->fd_buffers, bid);
+    count = channel->route(channel->user, bytes, size, addrs);
+  } else {
+    addrs[0] = channel->peer;
+  }
+
+  // Ссылка удерживает буфер, пока кадр ставится в очередь всем адресатам.
+  channel->fd_refs[bid]++;
+  bool gso = channel->gso && (count == 1);
+  bool fragmented = tunnel_fragmented(channel->mtu, size);
+  for (unsigned int i = 0; i < count; i++) {
+    if (fragmented) {
+      uring_send_fragments(channel, bid, size, addrs[i], channel->gso);
+    } else {
+      uring_send_add(channel, bid, size, addrs[i], gso);
+    }
+  }
+  uring_release_fd(channel, bid);
+}
+
+static int uring_handle_read(struct uring_channel_t* channel,
+                             struct io_uring_cqe* cqe) {
+  if (!channel->read_multishot || !(cqe->flags & IORING_CQE_F_MORE)) {
+    uring_arm_read(channel);
+  }
+  if (cqe->res <= 0) {
+    if ((cqe->res < 0) && (cqe->res != -ENOBUFS) && (cqe->res != -EAGAIN)) {
+      stats_error(channel->stats->local_rx);
+      fprintf(stderr, "ERROR> %s read %s\n", __FUNCTION__,
+              strerror(-cqe->res));
+    }
+    if (cqe->flags & IORING_CQE_F_BUFFER) {
+      uring_buffers_add(&channel->fd_buffers,
+                        cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+    }
+    return 0;
+  }
+
+  unsigned int bid = cqe->flags >> IORING_CQE_BUFFER_SHIFT;
+  stats_add(channel->stats->local_rx, cqe->res);
+  uring_send_frame(channel, bid, cqe->res);
+
+  return 1;
+}
+
+static int uring_handle_send(struct uring_channel_t* channel,
+                             struct io_uring_cqe* cqe,
+                             struct uring_send_t* send) {
+  if (cqe->res < 0) {
+    stats_error(channel->stats->tunnel_tx);
+    fprintf(stderr, "ERROR> %s sendmsg %s\n", __FUNCTION__,
+            strerror(-cqe->res));
+    // Устройство не умеет сегментировать, дальше кадры отправляются по одному.
+    if ((cqe->res == -EIO) && (send->datagrams > 1)) {
+      channel->gso = false;
+    }
+  } else {
+    stats_add_n(channel->stats->tunnel_tx, send->datagrams, cqe->res);
+  }
+
+  uring_send_free(channel, send);
+  return 0;
+}
+
+static int uring_handle_cqe(struct uring_channel_t* channel,
+                            struct io_uring_cqe* cqe) {
+  unsigned int type = cqe->user_data >> 32;
+  unsigned int bid = cqe->user_data & 0xffff;
+
+  switch (type) {
+    case URING_RECV:
+      return uring_handle_recv(channel, cqe);
+    case URING_READ:
+      return uring_handle_read(channel, cqe);
+    case URING_SEND:
+      return uring_handle_send(channel, cqe, &channel->sends[bid]);
+    case URING_WRITE:
+      if (cqe->res < 0) {
+        static struct stats_limit_t limit;
+        stats_error(channel->stats->local_tx);
+        uint64_t count = stats_limit(&limit);
+        if (count) {
+          fprintf(stderr, "ERROR> %s write %s (%" PRIu64 " frames)\n",
+                  __FUNCTION__, strerror(-cqe->res), count);
+        }
+      } else {
+        stats_add(channel->stats->local_tx, cqe->res);
+      }
+      channel->rx_refs[bid]--;
+      uring_recycle_rx(channel, bid);
+      return 0;
+    case URING_POLL:
+      if (!(cqe->flags & IORING_CQE_F_MORE)) {
+        uring_arm_poll(channel, channel->poll_fd, URING_POLL, true);
+      }
+      channel->poll_ready = true;
+      return 0;
+    case URING_STOP:
+      channel->terminated = true;
+      return 0;
+  }
+
+  return 0;
+}
+
+// Все отправки и записи, поставленные при разборе пачки завершений, уходят в
+// ядро одним io_uring_enter вместе с ожиданием следующих событий.
+static void* uring_channel_thread(void* thread_data) {
+  struct uring_channel_t* channel = thread_data;
+  struct uring_t* ring = &channel->ring;
+
+  uring_arm_recv(channel);
+  if (channel->fd_buffers.ring) {
+    int reads = channel->read_multishot ? 1 : URING_READS;
+    for (int i = 0; i < reads; i++) {
+      uring_arm_read(channel);
+    }
+  }
+  if (channel->poll_fd != -1) {
+    uring_arm_poll(channel, channel->poll_fd, URING_POLL, true);
+  }
+  uring_arm_poll(channel, channel->event_fd, URING_STOP, false);
+
+  // Готовность опрашиваемого fd приходит по фронту, поэтому обработчик
+  // вызывается без ожидания пока он находит кадры.
+  while (!channel->terminated) {
+    if (uring_submit(ring, channel->poll_ready ? 0 : 1) == -1) {
+      fprintf(stderr, "ERROR> %s io_uring_enter\n", __FUNCTION__);
+      perror("io_uring_enter:");
+      break;
+    }
+
+    int work = 0;
+    unsigned int head = *ring->cq_head;
+    while (head != __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE)) {
+      struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+      work += uring_handle_cqe(channel, cqe);
+      head++;
+      __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+    }
+
+    uring_send_flush(channel);
+    if (channel->poll_ready) {
+      int res = channel->poll_handler(channel->user);
+      channel->poll_ready = res > 0;
+      work += channel->poll_ready;
+    }
+
+    uring_buffers_commit(&channel->rx_buffers);
+    uring_buffers_commit(&channel->fd_buffers);
+    if (work && channel->flush_handler) {
+      channel->flush_handler(channel->user);
+    }
+  }
+
+  return NULL;
+}
+
+int uring_channel_run(struct uring_channel_t* channel) {
+  channel->terminated = false;
+  channel->poll_ready = channel->poll_fd != -1;
+
+  int res =
+      pthread_create(&channel->thread, NULL, uring_channel_thread, channel);
+  if (res != 0) {
+    fprintf(stderr, "ERROR> %s pthread_create\n", __FUNCTION__);
+    channel->thread = 0;
+    return -1;
+  }
+  cpu_place_thread(channel->thread, "uring");
+
+  return 0;
+}
+
+void uring_channel_stop(struct uring_channel_t* channel) {
+  if (!channel->thread) {
+    return;
+  }
+
+  uint64_t value = 1;
+  if (write(channel->event_fd, &value, sizeof(value)) == -1) {
+    fprintf(stderr, "ERROR> %s write eventfd\n", __FUNCTION__);
+  }
+
+  pthread_join(channel->thread, NULL);
+  channel->thread = 0;
+}
@@ -0,0 +1,129 @@
+#ifndef BRIDGE_URING_H
+#define BRIDGE_URING_H
+
+#include "engine.h"
+#include "stats.h"
+#include "tunnel.h"
+#include "udp.h"
+
+#include <inttypes.h>
+#include <linux/io_uring.h>
+#include <netinet/in.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <sys/socket.h>
+
+#define URING_ENTRIES 256
+#define URING_BUFFER_COUNT 256
+#define URING_READS 16
+#define URING_SENDS 512
+#define URING_MAX_ROUTES 256
+
+// NULL - принимаются датаграммы с любого адреса.
+typedef bool (*uring_accept_t)(void* user, const struct sockaddr_in* addr);
+typedef unsigned int (*uring_route_t)(void* user,
+                                      const uint8_t* bytes,
+                                      size_t size,
+                                      const struct sockaddr_in** addrs);
+
+struct uring_t {
+  int fd;
+  uint8_t* sq_ring;
+  size_t sq_ring_size;
+  uint8_t* cq_ring;
+  size_t cq_ring_size;
+  struct io_uring_sqe* sqes;
+  size_t sqes_size;
+  unsigned int* sq_head;
+  unsigned int* sq_tail;
+  unsigned int* sq_array;
+  unsigned int sq_mask;
+  unsigned int sq_entries;
+  unsigned int* cq_head;
+  unsigned int* cq_tail;
+  unsigned int cq_mask;
+  struct io_uring_cqe* cqes;
+  unsigned int pending;
+};
+
+struct uring_buffers_t {
+  struct io_uring_buf_ring* ring;
+  size_t ring_size;
+  uint8_t* buffers;
+  size_t buffer_size;
+  unsigned int count;
+  uint16_t group;
+  uint16_t tail;
+};
+
+#define URING_SEND_FRAMES UDP_GSO_MAX_SEGMENTS
+
+// Одна отправка: одна или несколько (UDP_SEGMENT) датаграмм туннеля, собранных
+// через iovec из заголовков, длин и кадров или фрагментов в буферах чтения.
+struct uring_send_t {
+  const struct sockaddr_in* addr;
+  struct msghdr msg;
+  struct iovec iovs[URING_SEND_FRAMES * 3];
+  struct tunnel_header_t headers[URING_SEND_FRAMES];
+  struct tunnel_fragment_t fragments[URING_SEND_FRAMES];
+  uint16_t lengths[URING_SEND_FRAMES];
+  uint16_t bids[URING_SEND_FRAMES];
+  unsigned int count;
+  unsigned int iov_count;
+  unsigned int datagrams;
+  size_t segment;
+  size_t datagram;
+  size_t size;
+  uint8_t control[CMSG_SPACE(sizeof(uint16_t))];
+};
+
+struct uring_channel_t {
+  struct uring_t ring;
+  struct uring_buffers_t rx_buffers;
+  struct uring_buffers_t fd_buffers;
+  int socket;
+  int fd;
+  int poll_fd;
+  int event_fd;
+  bool read_multishot;
+  bool write_fixed;
+  struct msghdr recv_msg;
+  const struct sockaddr_in* peer;
+  bool gso;
+  struct uring_send_t* sends;
+  struct uring_send_t* send;
+  unsigned int* free_sends;
+  unsigned int free_count;
+  uint16_t* fd_refs;
+  uint16_t* rx_refs;
+  unsigned int rx_bid;
+  size_t mtu;
+  uint32_t fragment_id;
+  uint8_t flags;
+  struct tunnel_reasm_t* reasm;
+  const struct stats_tunnel_t* stats;
+  uring_accept_t accept;
+  uring_route_t route;
+  udp_handler_t learn_handler;
+  udp_handler_t frame_handler;
+  engine_handler_t poll_handler;
+  bool poll_ready;
+  engine_handler_t flush_handler;
+  void* user;
+  pthread_t thread;
+  bool terminated;
+};
+
+void uring_channel_init(struct uring_channel_t* channel);
+int uring_channel_open(struct uring_channel_t* channel,
+                       int socket,
+                       int fd,
+                       size_t rx_size,
+                       size_t fd_size);
+int uring_channel_run(struct uring_channel_t* channel);
+void uring_channel_stop(struct uring_channel_t* channel);
+void uring_channel_close(struct uring_channel_t* channel);
+
+#endif  // BRIDGE_URING_H
@@ -0,0 +1,374 @@
+#include "worker.h"
+#include "cpu.h"
+#include "stats.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#define WORKER_MASK (WORKER_MAX_SOURCES - 1)
+
+void worker_pool_init(struct worker_pool_t* pool) {
+  pool->workers = NULL;
+  pool->count = 0;
+  pool->busy_poll = 0;
+  pool->terminated = false;
+  pool->sources = NULL;
+  pool->source_count = 0;
+}
+
+static void worker_init(struct worker_t* worker,
+                        struct worker_pool_t* pool,
+                        unsigned int index) {
+  worker->pool = pool;
+  worker->index = index;
+  worker->epoll_fd = -1;
+  worker->event_fd = -1;
+  worker->thread = 0;
+  worker->sleeping = false;
+  pthread_mutex_init(&worker->lock, NULL);
+  worker->head = 0;
+  worker->tail = 0;
+  worker->runs = 0;
+  worker->steals = 0;
+  worker->wakeups = 0;
+}
+
+static int worker_open(struct worker_t* worker) {
+  worker->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (worker->epoll_fd == -1) {
+    fprintf(stderr, "ERROR> %s epoll_create1\n", __FUNCTION__);
+    return -1;
+  }
+
+  worker->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (worker->event_fd == -1) {
+    fprintf(stderr, "ERROR> %s eventfd\n", __FUNCTION__);
+    return -1;
+  }
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN;
+  event.data.ptr = NULL;
+  if (epoll_ctl(worker->epoll_fd, EPOLL_CTL_ADD, worker->event_fd, &event) ==
+      -1) {
+    fprintf(stderr, "ERROR> %s epoll_ctl eventfd\n", __FUNCTION__);
+    return -1;
+  }
+
+  return 0;
+}
+
+static void worker_pool_source(void* user, FILE* out) {
+  worker_pool_report(user, out);
+}
+
+int worker_pool_open(struct worker_pool_t* pool,
+                     unsigned int count,
+                     unsigned int busy_poll) {
+  if (!count || (count > WORKER_MAX_THREADS)) {
+    fprintf(stderr, "ERROR> %s expects 1..%d workers\n", __FUNCTION__,
+            WORKER_MAX_THREADS);
+    return -1;
+  }
+
+  pool->workers = malloc(count * sizeof(*pool->workers));
+  pool->sources = calloc(WORKER_MAX_SOURCES, sizeof(*pool->sources));
+  if (!pool->workers || !pool->sources) {
+    fprintf(stderr, "ERROR> %s malloc\n", __FUNCTION__);
+    free(pool->workers);
+    free(pool->sources);
+    worker_pool_init(pool);
+    return -1;
+  }
+
+  pool->count = count;
+  pool->busy_poll = busy_poll;
+  for (unsigned int i = 0; i < count; i++) {
+    worker_init(&pool->workers[i], pool, i);
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    if (worker_open(&pool->workers[i]) == -1) {
+      worker_pool_close(pool);
+      return -1;
+    }
+  }
+
+  stats_source(worker_pool_source, pool);
+  return 0;
+}
+
+// Источники раздаются потокам по кругу: у каждого потока свой epoll, а
+// неравномерную нагрузку выравнивает кража из очередей.
+int worker_pool_add(struct worker_pool_t* pool,
+                    int fd,
+                    engine_handler_t handler,
+                    void* user) {
+  if ((fd < 0) || (pool->source_count >= WORKER_MAX_SOURCES)) {
+    fprintf(stderr, "ERROR> %s can't add fd %d\n", __FUNCTION__, fd);
+    return -1;
+  }
+
+  struct worker_source_t* source = &pool->sources[pool->source_count];
+  source->fd = fd;
+  source->handler = handler;
+  source->user = user;
+  source->home = &pool->workers[pool->source_count % pool->count];
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = source;
+  if (epoll_ctl(source->home->epoll_fd, EPOLL_CTL_ADD, fd, &event) == -1) {
+    fprintf(stderr, "ERROR> %s epoll_ctl fd %d\n", __FUNCTION__, fd);
+    perror("epoll_ctl:");
+    return -1;
+  }
+
+  pool->source_count++;
+  return 0;
+}
+
+static uint64_t worker_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+static unsigned int worker_queued(const struct worker_t* worker) {
+  return __atomic_load_n(&worker->tail, __ATOMIC_RELAXED) -
+         __atomic_load_n(&worker->head, __ATOMIC_RELAXED);
+}
+
+static void worker_push(struct worker_t* worker,
+                        struct worker_source_t* source) {
+  pthread_mutex_lock(&worker->lock);
+  worker->queue[worker->tail & WORKER_MASK] = source;
+  __atomic_store_n(&worker->tail, worker->tail + 1, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&worker->lock);
+}
+
+// Свой поток берет источники с головы очереди, в порядке готовности.
+static struct worker_source_t* worker_pop(struct worker_t* worker) {
+  struct worker_source_t* source = NULL;
+  pthread_mutex_lock(&worker->lock);
+  if (worker->head != worker->tail) {
+    source = worker->queue[worker->head & WORKER_MASK];
+    __atomic_store_n(&worker->head, worker->head + 1, __ATOMIC_RELAXED);
+  }
+  pthread_mutex_unlock(&worker->lock);
+  return source;
+}
+
+// Чужие потоки забирают источники с хвоста, начиная со следующего потока.
+static struct worker_source_t* worker_steal(struct worker_t* worker) {
+  struct worker_pool_t* pool = worker->pool;
+  for (unsigned int i = 1; i < pool->count; i++) {
+    struct worker_t* victim = &pool->workers[(worker->index + i) % pool->count];
+    if (!worker_queued(victim)) {
+      continue;
+    }
+
+    struct worker_source_t* source = NULL;
+    pthread_mutex_lock(&victim->lock);
+    if (victim->head != victim->tail) {
+      __atomic_store_n(&victim->tail, victim->tail - 1, __ATOMIC_RELAXED);
+      source = victim->queue[victim->tail & WORKER_MASK];
+    }
+    pthread_mutex_unlock(&victim->lock);
+    if (source) {
+      __atomic_store_n(&worker->steals, worker->steals + 1, __ATOMIC_RELAXED);
+      return source;
+    }
+  }
+
+  return NULL;
+}
+
+// В очереди больше источников, чем поток обработает сразу: будится один
+// спящий поток, чтобы забрать лишние.
+static void worker_wake(struct worker_t* worker) {
+  struct worker_pool_t* pool = worker->pool;
+  for (unsigned int i = 1; i < pool->count; i++) {
+    struct worker_t* other = &pool->workers[(worker->index + i) % pool->count];
+    bool sleeping = true;
+    if (__atomic_compare_exchange_n(&other->sleeping, &sleeping, false, false,
+                                    __ATOMIC_SEQ_CST, __ATOMIC_SEQ_CST)) {
+      uint64_t value = 1;
+      if (write(other->event_fd, &value, sizeof(value)) == -1) {
+        fprintf(stderr, "ERROR> %s write eventfd\n", __FUNCTION__);
+      }
+      return;
+    }
+  }
+}
+
+// Готовые источники своего epoll переходят в свою очередь.
+static int worker_poll(struct worker_t* worker, int timeout) {
+  struct epoll_event events[WORKER_EVENTS];
+  int count = epoll_wait(worker->epoll_fd, events, WORKER_EVENTS, timeout);
+  if (count == -1) {
+    if (errno != EINTR) {
+      fprintf(stderr, "ERROR> %s epoll_wait\n", __FUNCTION__);
+    }
+    return 0;
+  }
+
+  int ready = 0;
+  for (int i = 0; i < count; i++) {
+    struct worker_source_t* source = events[i].data.ptr;
+    if (!source) {
+      uint64_t value = 0;
+      if (read(worker->event_fd, &value, sizeof(value)) > 0) {
+        __atomic_store_n(&worker->wakeups, worker->wakeups + 1,
+                         __ATOMIC_RELAXED);
+      }
+      continue;
+    }
+    worker_push(worker, source);
+    ready++;
+  }
+
+  if (ready > 1) {
+    worker_wake(worker);
+  }
+  return ready;
+}
+
+// Обработчик разбирает одну пачку, затем fd взводится снова: если данные
+// остались, источник сразу снова готов и встает в конец очереди, поэтому
+// занятый мост не держит поток.
+static int worker_run_source(struct worker_t* worker,
+                             struct worker_source_t* source) {
+  int res = source->handler(source->user);
+  __atomic_store_n(&worker->runs, worker->runs + 1, __ATOMIC_RELAXED);
+
+  struct epoll_event event;
+  memset(&event, 0, sizeof(event));
+  event.events = EPOLLIN | EPOLLONESHOT;
+  event.data.ptr = source;
+  if (epoll_ctl(source->home->epoll_fd, EPOLL_CTL_MOD, source->fd, &event) ==
+      -1) {
+    fprintf(stderr, "ERROR> %s epoll_ctl fd %d\n", __FUNCTION__, source->fd);
+  }
+
+  return (res > 0) ? res : 0;
+}
+
+// Порядок: своя очередь, новые события своего epoll без сна, чужие очереди.
+// Если работы нет, поток еще busy_poll микросекунд повторяет проход, затем
+// засыпает в epoll_wait до события своего источника или пробуждения.
+static void* worker_thread(void* thread_data) {
+  struct worker_t* worker = thread_data;
+  struct worker_pool_t* pool = worker->pool;
+
+  uint64_t last_work = 0;
+  while (!pool->terminated) {
+    struct worker_source_t* source = worker_pop(worker);
+    if (!source && (worker_poll(worker, 0) > 0)) {
+      continue;
+    }
+    if (!source) {
+      source = worker_steal(worker);
+    }
+    if (source) {
+      if (worker_run_source(worker, source)) {
+        last_work = worker_now();
+      }
+      continue;
+    }
+    if (pool->busy_poll && (worker_now() - last_work < pool->busy_poll)) {
+      continue;
+    }
+
+    // Флаг сна ставится до последней проверки чужих очередей: поток, который
+    // положит источники после нее, увидит флаг и разбудит.
+    __atomic_store_n(&worker->sleeping, true, __ATOMIC_SEQ_CST);
+    source = worker_steal(worker);
+    if (source) {
+      __atomic_store_n(&worker->sleeping, false, __ATOMIC_SEQ_CST);
+      worker_run_source(worker, source);
+      last_work = worker_now();
+      continue;
+    }
+    worker_poll(worker, -1);
+    __atomic_store_n(&worker->sleeping, false, __ATOMIC_SEQ_CST);
+  }
+
+  return NULL;
+}
+
+int worker_pool_run(struct worker_pool_t* pool) {
+  pool->terminated = false;
+
+  for (unsigned int i = 0; i < pool->count; i++) {
+    struct worker_t* worker = &pool->workers[i];
+    if (pthread_create(&worker->thread, NULL, worker_thread, worker) != 0) {
+      fprintf(stderr, "ERROR> %s pthread_create\n", __FUNCTION__);
+      worker->thread = 0;
+      return -1;
+    }
+    char name[STATS_NAME_SIZE];
+    snprintf(name, sizeof(name), "worker.%u", i);
+    cpu_place_thread(worker->thread, name);
+  }
+
+  return 0;
+}
+
+void worker_pool_stop(struct worker_pool_t* pool) {
+  pool->terminated = true;
+
+  for (unsigned int i = 0; i < pool->count; i++) {
+    struct worker_t* worker = &pool->workers[i];
+    if (!worker->thread) {
+      continue;
+    }
+    uint64_t value = 1;
+    if (write(worker->event_fd, &value, sizeof(value)) == -1) {
+      fprintf(stderr, "ERROR> %s write eventfd\n", __FUNCTION__);
+    }
+  }
+
+  for (unsigned int i = 0; i < pool->count; i++) {
+    struct worker_t* worker = &pool->workers[i];
+    if (worker->thread) {
+      pthread_join(worker->thread, NULL);
+      worker->thread = 0;
+    }
+  }
+}
+
+void worker_pool_close(struct worker_pool_t* pool) {
+  for (unsigned int i = 0; i < pool->count; i++) {
+    struct worker_t* worker = &pool->workers[i];
+    if (worker->epoll_fd != -1) {
+      close(worker->epoll_fd);
+    }
+    if (worker->event_fd != -1) {
+      close(worker->event_fd);
+    }
+    pthread_mutex_destroy(&worker->lock);
+  }
+  free(pool->workers);
+  free(pool->sources);
+  worker_pool_init(pool);
+}
+
+void worker_pool_report(const struct worker_pool_t* pool, FILE* out) {
+  for (unsigned int i = 0; i < pool->count; i++) {
+    const struct worker_t* worker = &pool->workers[i];
+    fprintf(out,
+            "worker.%u runs %" PRIu64 " steals %" PRIu64 " wakeups %" PRIu64
+            " queued %u\n",
+            i, __atomic_load_n(&worker->runs, __ATOMIC_RELAXED),
+            __atomic_load_n(&worker->steals, __ATOMIC_RELAXED),
+            __atomic_load_n(&worker->wakeups, __ATOMIC_RELAXED),
+            worker_queued(worker));
+  }
+}
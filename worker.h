@@ -0,0 +1,71 @@
+#ifndef BRIDGE_WORKER_H
+#define BRIDGE_WORKER_H
+
+#include "engine.h"
+
+#include <inttypes.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+
+#define WORKER_MAX_THREADS 64
+// Степень двойки: очередь потока вмещает все источники пула.
+#define WORKER_MAX_SOURCES 1024
+#define WORKER_EVENTS 64
+
+struct worker_t;
+
+// Источник - fd одного моста и его обработчик (порт, сокет туннеля, tap).
+// fd взведен в epoll своего потока с EPOLLONESHOT: готовый источник лежит
+// ровно в одной очереди и обрабатывается одним потоком за раз, после
+// обработки fd взводится снова.
+struct worker_source_t {
+  int fd;
+  engine_handler_t handler;
+  void* user;
+  struct worker_t* home;
+};
+
+// Поток пула. Готовые источники из своего epoll кладутся в свою очередь,
+// поток без работы забирает источники из очередей других потоков.
+struct worker_t {
+  struct worker_pool_t* pool;
+  unsigned int index;
+  int epoll_fd;
+  int event_fd;
+  pthread_t thread;
+  bool sleeping;
+  pthread_mutex_t lock;
+  unsigned int head;
+  unsigned int tail;
+  struct worker_source_t* queue[WORKER_MAX_SOURCES];
+  uint64_t runs;
+  uint64_t steals;
+  uint64_t wakeups;
+};
+
+struct worker_pool_t {
+  struct worker_t* workers;
+  unsigned int count;
+  unsigned int busy_poll;
+  bool terminated;
+  struct worker_source_t* sources;
+  unsigned int source_count;
+};
+
+void worker_pool_init(struct worker_pool_t* pool);
+int worker_pool_open(struct worker_pool_t* pool,
+                     unsigned int count,
+                     unsigned int busy_poll);
+// Источники добавляются до worker_pool_run, fd неблокирующий.
+int worker_pool_add(struct worker_pool_t* pool,
+                    int fd,
+                    engine_handler_t handler,
+                    void* user);
+int worker_pool_run(struct worker_pool_t* pool);
+void worker_pool_stop(struct worker_pool_t* pool);
+void worker_pool_close(struct worker_pool_t* pool);
+void worker_pool_report(const struct worker_pool_t* pool, FILE* out);
+
+#endif  // BRIDGE_WORKER_H